@@ -0,0 +1,106 @@
+#!/bin/sh
+# Build flatpak-xdg-utils with link-time optimization and with
+# profile-guided optimization trained on the test suite, whose tests
+# run the tools against mock portals. Then compare startup time and
+# test-suite latency with a plain release build and an LTO-only build,
+# and print the results as tables that can be pasted into README.md.
+#
+# Usage: build-aux/optimized-build.sh [BUILDDIR [MESON_OPTION...]]
+#
+# For example:
+#   build-aux/optimized-build.sh _build -Dmulticall=true -Dstatic_glib=true
+#
+# PGO_TRAINING_RUNS sets how many times the test suite is run to
+# collect profiles (default 3).
+
+set -eu
+
+srcdir=$(cd "$(dirname "$0")/.." && pwd)
+builddir=${1:-_build-optimized}
+[ $# -gt 0 ] && shift
+baseline="${builddir}-baseline"
+lto="${builddir}-lto"
+runs=${PGO_TRAINING_RUNS:-3}
+
+now_ms () {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# Median of three runs of the test suite, in ms
+time_tests () {
+    for _ in 1 2 3; do
+        start=$(now_ms)
+        meson test -C "$1" --num-processes 1 > /dev/null
+        echo $(($(now_ms) - start))
+    done | sort -n | sed -n 2p
+}
+
+# One row per tool: build, tool, warm start, cold start, first D-Bus byte
+startup_rows () {
+    "$2/tests/bench-startup" "$2/src" |
+        awk -v build="$1" '$2 == "warm" { printf "| %s | %s | %s | %s | %s |\n", build, $1, $3, $6, $13 }'
+}
+
+echo "== Baseline: release build without LTO or PGO"
+meson setup "$baseline" "$srcdir" --buildtype=release "$@"
+ninja -C "$baseline"
+
+echo "== LTO build"
+meson setup "$lto" "$srcdir" --buildtype=release -Db_lto=true "$@"
+ninja -C "$lto"
+
+echo "== Instrumented build"
+meson setup "$builddir" "$srcdir" --buildtype=release \
+    -Db_lto=true -Db_pgo=generate "$@"
+ninja -C "$builddir"
+
+echo "== Training on the test suite ($runs runs)"
+# Tools started by the tests run in temporary directories, where clang's
+# instrumentation would write its default.profraw and lose it, so give
+# every process its own file here. gcc writes .gcda files next to the
+# objects and ignores this.
+profdir="$builddir/pgo"
+rm -rf "$profdir"
+mkdir -p "$profdir"
+LLVM_PROFILE_FILE="$profdir/%p-%m.profraw"
+export LLVM_PROFILE_FILE
+i=0
+while [ "$i" -lt "$runs" ]; do
+    meson test -C "$builddir" --num-processes 1 > /dev/null
+    i=$((i + 1))
+done
+unset LLVM_PROFILE_FILE
+
+# clang's raw profiles have to be merged; gcc's .gcda files are used as
+# they are
+if [ -n "$(find "$profdir" -name '*.profraw' -print -quit)" ]; then
+    find "$profdir" -name '*.profraw' -print0 |
+        xargs -0 llvm-profdata merge -output="$builddir/default.profdata"
+fi
+
+echo "== Optimized build"
+meson configure "$builddir" -Db_pgo=use
+ninja -C "$builddir"
+meson test -C "$builddir"
+
+echo "== Results"
+echo
+echo "Machine: $(sed -n 's/^model name[[:space:]]*: //p' /proc/cpuinfo | head -n 1), $(uname -sr)"
+echo "Compiler: $(${CC:-cc} --version | head -n 1)"
+echo "Options: ${*:-(none)}"
+echo
+echo "Median startup times in ms:"
+echo
+echo "| Build | Tool | Warm start | Cold start | Exec to first D-Bus byte |"
+echo "|-------|------|-----------:|-----------:|-------------------------:|"
+startup_rows plain "$baseline"
+startup_rows LTO "$lto"
+startup_rows LTO+PGO "$builddir"
+echo
+echo "Median test suite wall-clock time in ms:"
+echo
+echo "| Build | Test suite |"
+echo "|-------|-----------:|"
+echo "| plain | $(time_tests "$baseline") |"
+echo "| LTO | $(time_tests "$lto") |"
+echo "| LTO+PGO | $(time_tests "$builddir") |"
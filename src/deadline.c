@@ -0,0 +1,209 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gio/gio.h>
+
+#include "deadline.h"
+
+static gint64 budget = 0;    /* microseconds, or 0 for no deadline */
+static gint64 end_time = 0;  /* g_get_monotonic_time(), or 0 */
+static GCancellable *cancellable = NULL;
+
+/* Takes a number of seconds, which need not be whole. The budget
+ * starts when the option is parsed, which is close enough to when
+ * the tool started. */
+gboolean
+deadline_option_cb (G_GNUC_UNUSED const gchar *option_name,
+                    const gchar *value,
+                    G_GNUC_UNUSED gpointer data,
+                    GError **error)
+{
+  gchar *end;
+  double seconds;
+
+  seconds = g_ascii_strtod (value, &end);
+
+  if (end == value || *end != '\0' || !(seconds > 0) || seconds > G_MAXINT / 1000)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "Invalid deadline %s", value);
+      return FALSE;
+    }
+
+  budget = MAX (seconds * G_USEC_PER_SEC, G_TIME_SPAN_MILLISECOND);
+  end_time = g_get_monotonic_time () + budget;
+  return TRUE;
+}
+
+/* Returns: the g_get_monotonic_time() of the deadline, or 0 if none */
+gint64
+deadline_get_end_time (void)
+{
+  return end_time;
+}
+
+/* Returns: the timeout for a question to the portal, which it should be
+ * able to answer at once. This does not depend on how much of the
+ * budget is left, so it can also be used after the deadline, for
+ * example to forward a signal. */
+int
+deadline_get_probe_timeout (void)
+{
+  if (budget == 0)
+    return -1;
+
+  return MAX (budget / 4 / G_TIME_SPAN_MILLISECOND, 1);
+}
+
+/* Returns: @timeout, or the time left before the deadline if that is
+ * shorter. Give -1 for a call that can have all the time left. */
+int
+deadline_get_timeout (int timeout)
+{
+  gint64 remaining;
+
+  if (end_time == 0)
+    return timeout;
+
+  /* GDBus takes 0 to mean the default, so this must be at least 1 */
+  remaining = (end_time - g_get_monotonic_time ()) / G_TIME_SPAN_MILLISECOND;
+  remaining = CLAMP (remaining, 1, G_MAXINT);
+
+  if (timeout < 0 || timeout > remaining)
+    return remaining;
+
+  return timeout;
+}
+
+/* Returns: (transfer none): a cancellable that is cancelled when the
+ * deadline passes, if deadline_watch() was called and the main loop is
+ * running */
+GCancellable *
+deadline_get_cancellable (void)
+{
+  if (cancellable == NULL)
+    cancellable = g_cancellable_new ();
+
+  return cancellable;
+}
+
+static gboolean
+deadline_passed_cb (G_GNUC_UNUSED gpointer user_data)
+{
+  g_debug ("Deadline passed");
+  g_cancellable_cancel (deadline_get_cancellable ());
+  return G_SOURCE_REMOVE;
+}
+
+/* Cancels deadline_get_cancellable() from the default main context
+ * when the deadline passes, for tools with a main loop. The GDBus
+ * timeouts alone would only end one call, and not whatever we were
+ * going to do next. */
+void
+deadline_watch (void)
+{
+  static gboolean watching = FALSE;
+
+  if (end_time == 0 || watching)
+    return;
+
+  watching = TRUE;
+  g_timeout_add (deadline_get_timeout (-1), deadline_passed_cb, NULL);
+}
+
+static void
+bus_get_cb (G_GNUC_UNUSED GObject *source,
+            GAsyncResult          *result,
+            gpointer               user_data)
+{
+  GAsyncResult **result_out = user_data;
+
+  *result_out = g_object_ref (result);
+}
+
+static gboolean
+bus_get_timeout_cb (gpointer user_data)
+{
+  g_cancellable_cancel (user_data);
+  return G_SOURCE_REMOVE;
+}
+
+/* As g_bus_get_sync(), but failing with G_IO_ERROR_TIMED_OUT if the
+ * deadline passes first. Connecting to the bus is the first thing each
+ * tool does that can block, and GDBus gives it no timeout of its own.
+ *
+ * This iterates the default main context, which may dispatch other
+ * sources already attached to it. It must not use a private one: the
+ * connection emits "closed" in the context it was created in, and it
+ * is the process's shared session bus connection. */
+GDBusConnection *
+deadline_bus_get_sync (GBusType   bus_type,
+                       GError   **error)
+{
+  GCancellable *timeout_cancellable;
+  GAsyncResult *result = NULL;
+  GDBusConnection *connection;
+  GError *local_error = NULL;
+  guint timeout_id;
+
+  if (end_time == 0)
+    return g_bus_get_sync (bus_type, NULL, error);
+
+  timeout_cancellable = g_cancellable_new ();
+  timeout_id = g_timeout_add (deadline_get_timeout (-1), bus_get_timeout_cb,
+                              timeout_cancellable);
+
+  g_bus_get (bus_type, timeout_cancellable, bus_get_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  connection = g_bus_get_finish (result, &local_error);
+
+  if (connection == NULL &&
+      g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+      g_cancellable_is_cancelled (timeout_cancellable))
+    {
+      g_clear_error (&local_error);
+      /* The same as GDBus */
+      g_set_error_literal (&local_error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                           "Timeout was reached");
+    }
+
+  if (local_error != NULL)
+    g_propagate_error (error, local_error);
+
+  /* If it has not fired, it still refers to the cancellable */
+  if (!g_cancellable_is_cancelled (timeout_cancellable))
+    g_source_remove (timeout_id);
+
+  g_object_unref (timeout_cancellable);
+  g_object_unref (result);
+  return connection;
+}
+
+/* Returns: %TRUE if @error is from a call that ran out of time */
+gboolean
+deadline_error_is_timeout (const GError *error)
+{
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT))
+    return TRUE;
+
+  return (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+          cancellable != NULL &&
+          g_cancellable_is_cancelled (cancellable));
+}
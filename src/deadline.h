@@ -0,0 +1,53 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * The --deadline option, shared by all the tools: a budget in seconds
+ * for getting the portal to do what we asked. Questions that only
+ * help us decide what to ask, such as the portal's version, get a
+ * quarter of it, and the call that does the work gets whatever is
+ * left. Timeouts are in milliseconds, as for GDBus, with -1 meaning
+ * the D-Bus default; without --deadline, they are all -1. Connecting
+ * to the bus in the first place comes out of the same budget.
+ */
+
+/* The exit status when the deadline passes, as for timeout(1) */
+#define DEADLINE_EXIT_STATUS 124
+
+gboolean      deadline_option_cb             (const gchar  *option_name,
+                                              const gchar  *value,
+                                              gpointer      data,
+                                              GError      **error);
+gint64        deadline_get_end_time          (void);
+int           deadline_get_probe_timeout     (void);
+int           deadline_get_timeout           (int           timeout);
+GCancellable *deadline_get_cancellable       (void);
+void          deadline_watch                 (void);
+GDBusConnection *deadline_bus_get_sync       (GBusType      bus_type,
+                                              GError      **error);
+gboolean      deadline_error_is_timeout      (const GError *error);
+
+G_END_DECLS
+
+#endif /* __DEADLINE_H__ */
@@ -0,0 +1,2035 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+
+#include "backport-autoptr.h"
+#include "flatpak-portal.h"
+#include "flatpak-session-helper.h"
+#include "flatpak-spawn-launcher.h"
+
+/*
+ * A FlatpakSpawnLauncher describes a command to be run by the Flatpak
+ * portal (or, with FLATPAK_SPAWN_LAUNCHER_FLAGS_HOST, by the session
+ * helper on the host) in the same way as GSubprocessLauncher describes a
+ * local one. Each successful spawn yields a FlatpakSpawnProcess.
+ *
+ * All processes spawned on the same GDBusConnection share a single
+ * SpawnWatcher, so that the exit signals and the portal's version are
+ * only subscribed to and queried once per connection, however many
+ * children are running. None of this is thread-safe: use the launcher
+ * and its processes from a single main context.
+ */
+
+G_DEFINE_QUARK (flatpak-spawn-error-quark, flatpak_spawn_error)
+
+typedef enum {
+  SPAWN_SERVICE_PORTAL = 0,
+  SPAWN_SERVICE_HOST,
+  N_SPAWN_SERVICES
+} SpawnService;
+
+typedef struct {
+  const char *bus_name;
+  const char *obj_path;
+  const char *iface;
+  const char *spawn_method;
+  const char *signal_method;
+  const char *exited_signal;
+  /* The first version with the unset-env option, or 0 if none has it */
+  guint32 unset_env_version;
+} SpawnServiceInfo;
+
+static const SpawnServiceInfo spawn_services[N_SPAWN_SERVICES] = {
+  {
+    FLATPAK_PORTAL_BUS_NAME,
+    FLATPAK_PORTAL_PATH,
+    FLATPAK_PORTAL_INTERFACE,
+    "Spawn",
+    "SpawnSignal",
+    "SpawnExited",
+    5,
+  },
+  {
+    FLATPAK_SESSION_HELPER_BUS_NAME,
+    FLATPAK_SESSION_HELPER_PATH_DEVELOPMENT,
+    FLATPAK_SESSION_HELPER_INTERFACE_DEVELOPMENT,
+    "HostCommand",
+    "HostCommandSignal",
+    "HostCommandExited",
+    /* HostCommand has no options, so asking for the version would only
+     * cost a round-trip */
+    0,
+  },
+};
+
+typedef struct {
+  guint exited_id;
+  guint name_owner_id;
+  GHashTable *processes;  /* pid => unowned FlatpakSpawnProcess */
+  guint32 version;
+  guint32 supports;
+  gboolean have_version;
+  gboolean have_supports;
+} SpawnWatcherService;
+
+typedef struct {
+  int ref_count;
+  GDBusConnection *connection;
+  gulong closed_id;
+  SpawnWatcherService services[N_SPAWN_SERVICES];
+} SpawnWatcher;
+
+#define SPAWN_WATCHER_DATA_KEY "flatpak-spawn-watcher"
+
+struct _FlatpakSpawnProcess
+{
+  GObject parent_instance;
+
+  SpawnWatcher *watcher;
+  SpawnService service;
+  guint32 pid;
+  int signal_timeout;
+  gboolean exited;
+  int status;
+  GError *error;
+  GSList *pending_waits;
+};
+
+typedef struct
+{
+  GObjectClass parent_class;
+} FlatpakSpawnProcessClass;
+
+G_DEFINE_TYPE (FlatpakSpawnProcess, flatpak_spawn_process, G_TYPE_OBJECT)
+
+typedef struct {
+  int source;
+  int target;
+} SpawnFd;
+
+struct _FlatpakSpawnLauncher
+{
+  GObject parent_instance;
+
+  FlatpakSpawnLauncherFlags flags;
+  GDBusConnection *connection;
+  char *cwd;
+  GHashTable *env;
+  GHashTable *unset_env;
+  GArray *fds;
+  guint32 sandbox_flags;
+  GPtrArray *sandbox_expose;
+  GPtrArray *sandbox_expose_ro;
+  GPtrArray *sandbox_expose_path;
+  GPtrArray *sandbox_expose_path_try;
+  GPtrArray *sandbox_expose_path_ro;
+  GPtrArray *sandbox_expose_path_ro_try;
+  GPtrArray *a11y_own_names;
+  char *app_path;
+  char *usr_path;
+  int probe_timeout;
+  gint64 deadline;
+};
+
+typedef struct
+{
+  GObjectClass parent_class;
+} FlatpakSpawnLauncherClass;
+
+G_DEFINE_TYPE (FlatpakSpawnLauncher, flatpak_spawn_launcher, G_TYPE_OBJECT)
+
+static void flatpak_spawn_process_complete (FlatpakSpawnProcess *self,
+                                            int                  status,
+                                            const GError        *error);
+
+static SpawnService
+spawn_service_for_interface (const char *interface_name)
+{
+  if (g_strcmp0 (interface_name, spawn_services[SPAWN_SERVICE_HOST].iface) == 0)
+    return SPAWN_SERVICE_HOST;
+
+  return SPAWN_SERVICE_PORTAL;
+}
+
+/* Take a ref on every process we know about for @service, or for all
+ * services if @service is N_SPAWN_SERVICES, so that they can be completed
+ * without the hash tables changing underneath us. */
+static GPtrArray *
+spawn_watcher_ref_processes (SpawnWatcher *watcher,
+                             SpawnService  service)
+{
+  GPtrArray *processes = g_ptr_array_new_with_free_func (g_object_unref);
+  guint i;
+
+  for (i = 0; i < N_SPAWN_SERVICES; i++)
+    {
+      GHashTableIter iter;
+      gpointer value;
+
+      if (service != N_SPAWN_SERVICES && service != i)
+        continue;
+
+      if (watcher->services[i].processes == NULL)
+        continue;
+
+      g_hash_table_iter_init (&iter, watcher->services[i].processes);
+
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        g_ptr_array_add (processes, g_object_ref (value));
+    }
+
+  return processes;
+}
+
+static void
+spawn_watcher_fail_processes (SpawnWatcher *watcher,
+                              SpawnService  service,
+                              const GError *error)
+{
+  g_autoptr(GPtrArray) processes = spawn_watcher_ref_processes (watcher, service);
+  guint i;
+
+  for (i = 0; i < processes->len; i++)
+    flatpak_spawn_process_complete (g_ptr_array_index (processes, i), 0, error);
+}
+
+static void
+spawn_watcher_exited_cb (G_GNUC_UNUSED GDBusConnection *connection,
+                         G_GNUC_UNUSED const gchar     *sender_name,
+                         G_GNUC_UNUSED const gchar     *object_path,
+                         const gchar                   *interface_name,
+                         G_GNUC_UNUSED const gchar     *signal_name,
+                         GVariant                      *parameters,
+                         gpointer                       user_data)
+{
+  SpawnWatcher *watcher = user_data;
+  SpawnService service = spawn_service_for_interface (interface_name);
+  FlatpakSpawnProcess *process;
+  guint32 client_pid = 0;
+  guint32 wait_status = 0;
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(uu)")))
+    return;
+
+  g_variant_get (parameters, "(uu)", &client_pid, &wait_status);
+  g_debug ("child exited %d: %d", client_pid, wait_status);
+
+  if (watcher->services[service].processes == NULL)
+    return;
+
+  process = g_hash_table_lookup (watcher->services[service].processes,
+                                 GUINT_TO_POINTER (client_pid));
+
+  if (process != NULL)
+    flatpak_spawn_process_complete (process, wait_status, NULL);
+}
+
+static void
+spawn_watcher_name_owner_changed_cb (G_GNUC_UNUSED GDBusConnection *connection,
+                                     G_GNUC_UNUSED const gchar     *sender_name,
+                                     G_GNUC_UNUSED const gchar     *object_path,
+                                     G_GNUC_UNUSED const gchar     *interface_name,
+                                     G_GNUC_UNUSED const gchar     *signal_name,
+                                     GVariant                      *parameters,
+                                     gpointer                       user_data)
+{
+  SpawnWatcher *watcher = user_data;
+  const char *name, *from, *to;
+  guint i;
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(sss)")))
+    return;
+
+  g_variant_get (parameters, "(&s&s&s)", &name, &from, &to);
+
+  /* Check if the service dies, then we fail its processes, because we
+   * can't track them anymore */
+  if (strcmp (to, "") != 0)
+    return;
+
+  for (i = 0; i < N_SPAWN_SERVICES; i++)
+    {
+      g_autoptr(GError) error = NULL;
+
+      if (strcmp (name, spawn_services[i].bus_name) != 0)
+        continue;
+
+      g_debug ("%s exited", name);
+
+      /* A restarted service might be a different version */
+      watcher->services[i].have_version = FALSE;
+      watcher->services[i].have_supports = FALSE;
+
+      error = g_error_new (FLATPAK_SPAWN_ERROR,
+                           FLATPAK_SPAWN_ERROR_SERVICE_VANISHED,
+                           "%s exited", name);
+      spawn_watcher_fail_processes (watcher, i, error);
+    }
+}
+
+static void
+spawn_watcher_closed_cb (G_GNUC_UNUSED GDBusConnection *connection,
+                         G_GNUC_UNUSED gboolean remote_peer_vanished,
+                         G_GNUC_UNUSED GError *closed_error,
+                         gpointer user_data)
+{
+  SpawnWatcher *watcher = user_data;
+  g_autoptr(GError) error = NULL;
+
+  g_debug ("Session bus connection closed");
+
+  error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CLOSED,
+                               "Session bus connection closed");
+  spawn_watcher_fail_processes (watcher, N_SPAWN_SERVICES, error);
+}
+
+static SpawnWatcher *
+spawn_watcher_get (GDBusConnection *connection)
+{
+  SpawnWatcher *watcher = g_object_get_data (G_OBJECT (connection),
+                                             SPAWN_WATCHER_DATA_KEY);
+
+  if (watcher != NULL)
+    {
+      watcher->ref_count++;
+      return watcher;
+    }
+
+  watcher = g_new0 (SpawnWatcher, 1);
+  watcher->ref_count = 1;
+  watcher->connection = g_object_ref (connection);
+  watcher->closed_id = g_signal_connect (connection, "closed",
+                                         G_CALLBACK (spawn_watcher_closed_cb),
+                                         watcher);
+  g_object_set_data (G_OBJECT (connection), SPAWN_WATCHER_DATA_KEY, watcher);
+  return watcher;
+}
+
+static void
+spawn_watcher_unref (SpawnWatcher *watcher)
+{
+  guint i;
+
+  g_assert (watcher->ref_count > 0);
+
+  if (--watcher->ref_count > 0)
+    return;
+
+  for (i = 0; i < N_SPAWN_SERVICES; i++)
+    {
+      SpawnWatcherService *service = &watcher->services[i];
+
+      if (service->exited_id != 0)
+        g_dbus_connection_signal_unsubscribe (watcher->connection,
+                                              service->exited_id);
+
+      if (service->name_owner_id != 0)
+        g_dbus_connection_signal_unsubscribe (watcher->connection,
+                                              service->name_owner_id);
+
+      g_clear_pointer (&service->processes, g_hash_table_unref);
+    }
+
+  g_signal_handler_disconnect (watcher->connection, watcher->closed_id);
+  g_object_set_data (G_OBJECT (watcher->connection), SPAWN_WATCHER_DATA_KEY, NULL);
+  g_object_unref (watcher->connection);
+  g_free (watcher);
+}
+
+/* Subscribe to the exit signals of @service. This must happen before the
+ * spawn call is sent, so that the AddMatch reaches the bus first. */
+static void
+spawn_watcher_ensure_service (SpawnWatcher *watcher,
+                              SpawnService  service)
+{
+  SpawnWatcherService *s = &watcher->services[service];
+  const SpawnServiceInfo *info = &spawn_services[service];
+
+  if (s->exited_id != 0)
+    return;
+
+  s->processes = g_hash_table_new (NULL, NULL);
+  s->exited_id = g_dbus_connection_signal_subscribe (watcher->connection,
+                                                     NULL,
+                                                     info->iface,
+                                                     info->exited_signal,
+                                                     info->obj_path,
+                                                     NULL,
+                                                     G_DBUS_SIGNAL_FLAGS_NONE,
+                                                     spawn_watcher_exited_cb,
+                                                     watcher, NULL);
+  s->name_owner_id = g_dbus_connection_signal_subscribe (watcher->connection,
+                                                         "org.freedesktop.DBus",
+                                                         "org.freedesktop.DBus",
+                                                         "NameOwnerChanged",
+                                                         "/org/freedesktop/DBus",
+                                                         info->bus_name,
+                                                         G_DBUS_SIGNAL_FLAGS_NONE,
+                                                         spawn_watcher_name_owner_changed_cb,
+                                                         watcher, NULL);
+}
+
+static void
+spawn_watcher_forget (SpawnWatcher        *watcher,
+                      FlatpakSpawnProcess *process)
+{
+  GHashTable *processes = watcher->services[process->service].processes;
+
+  if (processes != NULL &&
+      g_hash_table_lookup (processes, GUINT_TO_POINTER (process->pid)) == process)
+    g_hash_table_remove (processes, GUINT_TO_POINTER (process->pid));
+}
+
+static void
+flatpak_spawn_process_finalize (GObject *object)
+{
+  FlatpakSpawnProcess *self = FLATPAK_SPAWN_PROCESS (object);
+
+  g_assert (self->pending_waits == NULL);
+
+  if (self->watcher != NULL)
+    {
+      spawn_watcher_forget (self->watcher, self);
+      spawn_watcher_unref (self->watcher);
+    }
+
+  g_clear_error (&self->error);
+
+  G_OBJECT_CLASS (flatpak_spawn_process_parent_class)->finalize (object);
+}
+
+static void
+flatpak_spawn_process_class_init (FlatpakSpawnProcessClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = flatpak_spawn_process_finalize;
+}
+
+static void
+flatpak_spawn_process_init (G_GNUC_UNUSED FlatpakSpawnProcess *self)
+{
+}
+
+static FlatpakSpawnProcess *
+flatpak_spawn_process_new (SpawnWatcher *watcher,
+                           SpawnService  service,
+                           guint32       pid,
+                           int           signal_timeout)
+{
+  FlatpakSpawnProcess *self = g_object_new (FLATPAK_SPAWN_TYPE_PROCESS, NULL);
+
+  self->watcher = watcher;
+  watcher->ref_count++;
+  self->service = service;
+  self->pid = pid;
+  self->signal_timeout = signal_timeout;
+
+  g_hash_table_replace (watcher->services[service].processes,
+                        GUINT_TO_POINTER (pid), self);
+  return self;
+}
+
+typedef struct {
+  gulong cancelled_id;
+} WaitData;
+
+static void
+wait_task_return (GTask *task)
+{
+  FlatpakSpawnProcess *self = g_task_get_source_object (task);
+  WaitData *data = g_task_get_task_data (task);
+
+  if (data->cancelled_id != 0)
+    g_cancellable_disconnect (g_task_get_cancellable (task),
+                              data->cancelled_id);
+
+  if (self->error != NULL)
+    g_task_return_error (task, g_error_copy (self->error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+flatpak_spawn_process_complete (FlatpakSpawnProcess *self,
+                                int                  status,
+                                const GError        *error)
+{
+  g_autoptr(FlatpakSpawnProcess) keep_alive = NULL;
+  GSList *waits, *l;
+
+  if (self->exited || self->error != NULL)
+    return;
+
+  if (error != NULL)
+    {
+      self->error = g_error_copy (error);
+    }
+  else
+    {
+      self->exited = TRUE;
+      self->status = status;
+    }
+
+  keep_alive = g_object_ref (self);
+  spawn_watcher_forget (self->watcher, self);
+
+  waits = g_slist_reverse (g_steal_pointer (&self->pending_waits));
+
+  for (l = waits; l != NULL; l = l->next)
+    {
+      g_autoptr(GTask) task = l->data;
+
+      wait_task_return (task);
+    }
+
+  g_slist_free (waits);
+}
+
+/**
+ * flatpak_spawn_process_get_pid:
+ * @self: a process
+ *
+ * Returns: the process ID as seen by the portal or session helper, which
+ *  is not necessarily meaningful in the caller's pid namespace
+ */
+guint32
+flatpak_spawn_process_get_pid (FlatpakSpawnProcess *self)
+{
+  g_return_val_if_fail (FLATPAK_SPAWN_IS_PROCESS (self), 0);
+
+  return self->pid;
+}
+
+gboolean
+flatpak_spawn_process_has_exited (FlatpakSpawnProcess *self)
+{
+  g_return_val_if_fail (FLATPAK_SPAWN_IS_PROCESS (self), FALSE);
+
+  return self->exited;
+}
+
+/**
+ * flatpak_spawn_process_get_status:
+ * @self: a process that has exited
+ *
+ * Returns: the wait status, suitable for WIFEXITED() and friends
+ */
+int
+flatpak_spawn_process_get_status (FlatpakSpawnProcess *self)
+{
+  g_return_val_if_fail (FLATPAK_SPAWN_IS_PROCESS (self), 0);
+  g_return_val_if_fail (self->exited, 0);
+
+  return self->status;
+}
+
+static void
+send_signal_cb (GObject      *source,
+                GAsyncResult *result,
+                G_GNUC_UNUSED gpointer user_data)
+{
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) error = NULL;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
+
+  if (reply == NULL)
+    g_debug ("Failed to forward signal: %s", error->message);
+}
+
+/**
+ * flatpak_spawn_process_send_signal:
+ * @self: a process
+ * @signum: a signal number
+ * @to_process_group: %TRUE to signal the process's whole process group
+ *
+ * Asks the portal or session helper to send @signum to @self, without
+ * waiting for a reply. Failures are only logged.
+ */
+void
+flatpak_spawn_process_send_signal (FlatpakSpawnProcess *self,
+                                   int                  signum,
+                                   gboolean             to_process_group)
+{
+  const SpawnServiceInfo *info;
+
+  g_return_if_fail (FLATPAK_SPAWN_IS_PROCESS (self));
+
+  info = &spawn_services[self->service];
+  g_dbus_connection_call (self->watcher->connection,
+                          info->bus_name,
+                          info->obj_path,
+                          info->iface,
+                          info->signal_method,
+                          g_variant_new ("(uub)",
+                                         self->pid, signum, to_process_group),
+                          G_VARIANT_TYPE ("()"),
+                          G_DBUS_CALL_FLAGS_NONE,
+                          self->signal_timeout, NULL, send_signal_cb, NULL);
+}
+
+gboolean
+flatpak_spawn_process_send_signal_sync (FlatpakSpawnProcess *self,
+                                        int                  signum,
+                                        gboolean             to_process_group,
+                                        GCancellable        *cancellable,
+                                        GError             **error)
+{
+  const SpawnServiceInfo *info;
+  g_autoptr(GVariant) reply = NULL;
+
+  g_return_val_if_fail (FLATPAK_SPAWN_IS_PROCESS (self), FALSE);
+
+  info = &spawn_services[self->service];
+  reply = g_dbus_connection_call_sync (self->watcher->connection,
+                                       info->bus_name,
+                                       info->obj_path,
+                                       info->iface,
+                                       info->signal_method,
+                                       g_variant_new ("(uub)",
+                                                      self->pid, signum, to_process_group),
+                                       G_VARIANT_TYPE ("()"),
+                                       G_DBUS_CALL_FLAGS_NONE,
+                                       self->signal_timeout, cancellable, error);
+
+  return reply != NULL;
+}
+
+static void
+wait_cancelled_cb (G_GNUC_UNUSED GCancellable *cancellable,
+                   GTask *task)
+{
+  FlatpakSpawnProcess *self = g_task_get_source_object (task);
+  WaitData *data = g_task_get_task_data (task);
+  GSList *link = g_slist_find (self->pending_waits, task);
+
+  /* Already completed */
+  if (link == NULL)
+    return;
+
+  /* We can't disconnect from inside the handler; the GTask reference the
+   * handler holds is released when the cancellable is. */
+  data->cancelled_id = 0;
+  self->pending_waits = g_slist_delete_link (self->pending_waits, link);
+  g_task_return_error_if_cancelled (task);
+  g_object_unref (task);
+}
+
+/**
+ * flatpak_spawn_process_wait_async:
+ * @self: a process
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: called when @self exits
+ * @user_data: user data for @callback
+ *
+ * Waits for the portal or session helper to report that @self has exited.
+ * If the service exits or the connection is closed first, the wait fails
+ * with %FLATPAK_SPAWN_ERROR_SERVICE_VANISHED or %G_IO_ERROR_CLOSED.
+ */
+void
+flatpak_spawn_process_wait_async (FlatpakSpawnProcess *self,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  WaitData *data;
+
+  g_return_if_fail (FLATPAK_SPAWN_IS_PROCESS (self));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, flatpak_spawn_process_wait_async);
+  data = g_new0 (WaitData, 1);
+  g_task_set_task_data (task, data, g_free);
+
+  if (self->exited || self->error != NULL)
+    {
+      wait_task_return (task);
+      return;
+    }
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  self->pending_waits = g_slist_prepend (self->pending_waits,
+                                         g_object_ref (task));
+
+  if (cancellable != NULL)
+    data->cancelled_id = g_cancellable_connect (cancellable,
+                                                G_CALLBACK (wait_cancelled_cb),
+                                                g_object_ref (task),
+                                                g_object_unref);
+}
+
+gboolean
+flatpak_spawn_process_wait_finish (FlatpakSpawnProcess *self,
+                                   GAsyncResult        *result,
+                                   GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+flatpak_spawn_launcher_finalize (GObject *object)
+{
+  FlatpakSpawnLauncher *self = FLATPAK_SPAWN_LAUNCHER (object);
+  guint i;
+
+  for (i = 0; i < self->fds->len; i++)
+    close (g_array_index (self->fds, SpawnFd, i).source);
+
+  g_array_unref (self->fds);
+  g_clear_object (&self->connection);
+  g_free (self->cwd);
+  g_hash_table_unref (self->env);
+  g_hash_table_unref (self->unset_env);
+  g_ptr_array_unref (self->sandbox_expose);
+  g_ptr_array_unref (self->sandbox_expose_ro);
+  g_ptr_array_unref (self->sandbox_expose_path);
+  g_ptr_array_unref (self->sandbox_expose_path_try);
+  g_ptr_array_unref (self->sandbox_expose_path_ro);
+  g_ptr_array_unref (self->sandbox_expose_path_ro_try);
+  g_ptr_array_unref (self->a11y_own_names);
+  g_free (self->app_path);
+  g_free (self->usr_path);
+
+  G_OBJECT_CLASS (flatpak_spawn_launcher_parent_class)->finalize (object);
+}
+
+static void
+flatpak_spawn_launcher_class_init (FlatpakSpawnLauncherClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = flatpak_spawn_launcher_finalize;
+}
+
+static void
+flatpak_spawn_launcher_init (FlatpakSpawnLauncher *self)
+{
+  self->env = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->unset_env = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->fds = g_array_new (FALSE, FALSE, sizeof (SpawnFd));
+  self->sandbox_expose = g_ptr_array_new_with_free_func (g_free);
+  self->sandbox_expose_ro = g_ptr_array_new_with_free_func (g_free);
+  self->sandbox_expose_path = g_ptr_array_new_with_free_func (g_free);
+  self->sandbox_expose_path_try = g_ptr_array_new_with_free_func (g_free);
+  self->sandbox_expose_path_ro = g_ptr_array_new_with_free_func (g_free);
+  self->sandbox_expose_path_ro_try = g_ptr_array_new_with_free_func (g_free);
+  self->a11y_own_names = g_ptr_array_new_with_free_func (g_free);
+  self->probe_timeout = -1;
+}
+
+FlatpakSpawnLauncher *
+flatpak_spawn_launcher_new (FlatpakSpawnLauncherFlags flags)
+{
+  FlatpakSpawnLauncher *self = g_object_new (FLATPAK_SPAWN_TYPE_LAUNCHER, NULL);
+
+  self->flags = flags;
+  return self;
+}
+
+void
+flatpak_spawn_launcher_set_flags (FlatpakSpawnLauncher      *self,
+                                  FlatpakSpawnLauncherFlags  flags)
+{
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+
+  self->flags = flags;
+}
+
+FlatpakSpawnLauncherFlags
+flatpak_spawn_launcher_get_flags (FlatpakSpawnLauncher *self)
+{
+  g_return_val_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self), FLATPAK_SPAWN_LAUNCHER_FLAGS_NONE);
+
+  return self->flags;
+}
+
+/**
+ * flatpak_spawn_launcher_set_connection:
+ * @self: a launcher
+ * @connection: (nullable): the session bus connection to use
+ *
+ * Processes spawned on the same connection share one set of signal
+ * subscriptions. If no connection is set, the shared session bus
+ * connection is used.
+ */
+void
+flatpak_spawn_launcher_set_connection (FlatpakSpawnLauncher *self,
+                                       GDBusConnection      *connection)
+{
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+  g_return_if_fail (connection == NULL || G_IS_DBUS_CONNECTION (connection));
+
+  if (connection != NULL)
+    g_object_ref (connection);
+
+  g_clear_object (&self->connection);
+  self->connection = connection;
+}
+
+/**
+ * flatpak_spawn_launcher_set_cwd:
+ * @self: a launcher
+ * @cwd: (nullable): working directory for the command
+ *
+ * If @cwd is %NULL, the caller's working directory at the time of each
+ * spawn is used.
+ */
+void
+flatpak_spawn_launcher_set_cwd (FlatpakSpawnLauncher *self,
+                                const char           *cwd)
+{
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+
+  g_free (self->cwd);
+  self->cwd = g_strdup (cwd);
+}
+
+void
+flatpak_spawn_launcher_setenv (FlatpakSpawnLauncher *self,
+                               const char           *variable,
+                               const char           *value)
+{
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+  g_return_if_fail (variable != NULL && variable[0] != '\0');
+  g_return_if_fail (value != NULL);
+
+  g_hash_table_remove (self->unset_env, variable);
+  g_hash_table_replace (self->env, g_strdup (variable), g_strdup (value));
+}
+
+void
+flatpak_spawn_launcher_unsetenv (FlatpakSpawnLauncher *self,
+                                 const char           *variable)
+{
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+  g_return_if_fail (variable != NULL);
+
+  g_hash_table_remove (self->env, variable);
+  g_hash_table_add (self->unset_env, g_strdup (variable));
+}
+
+/**
+ * flatpak_spawn_launcher_take_fd:
+ * @self: a launcher
+ * @source_fd: a file descriptor, which is closed when @self is finalized
+ * @target_fd: the file descriptor number it will have in the command
+ *
+ * Unless overridden here, file descriptors 0, 1 and 2 are forwarded from
+ * the caller.
+ */
+void
+flatpak_spawn_launcher_take_fd (FlatpakSpawnLauncher *self,
+                                int                   source_fd,
+                                int                   target_fd)
+{
+  SpawnFd fd = { source_fd, target_fd };
+  guint i;
+
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+  g_return_if_fail (source_fd >= 0);
+  g_return_if_fail (target_fd >= 0);
+
+  for (i = 0; i < self->fds->len; i++)
+    {
+      SpawnFd *existing = &g_array_index (self->fds, SpawnFd, i);
+
+      if (existing->target == target_fd)
+        {
+          close (existing->source);
+          existing->source = source_fd;
+          return;
+        }
+    }
+
+  g_array_append_val (self->fds, fd);
+}
+
+/**
+ * flatpak_spawn_launcher_set_sandbox_flags:
+ * @self: a launcher
+ * @sandbox_flags: sandbox flags as defined by org.freedesktop.portal.Flatpak
+ */
+void
+flatpak_spawn_launcher_set_sandbox_flags (FlatpakSpawnLauncher *self,
+                                          guint32               sandbox_flags)
+{
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+
+  self->sandbox_flags = sandbox_flags;
+}
+
+void
+flatpak_spawn_launcher_sandbox_expose (FlatpakSpawnLauncher *self,
+                                       const char           *name,
+                                       gboolean              readonly)
+{
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+  g_return_if_fail (name != NULL);
+
+  g_ptr_array_add (readonly ? self->sandbox_expose_ro : self->sandbox_expose,
+                   g_strdup (name));
+}
+
+/**
+ * flatpak_spawn_launcher_sandbox_expose_path:
+ * @self: a launcher
+ * @path: a path in the caller's filesystem namespace
+ * @flags: whether to expose it read-only, and whether to ignore it if
+ *  it does not exist
+ *
+ * The path is opened each time a command is spawned.
+ */
+void
+flatpak_spawn_launcher_sandbox_expose_path (FlatpakSpawnLauncher    *self,
+                                            const char              *path,
+                                            FlatpakSpawnExposeFlags  flags)
+{
+  GPtrArray *paths;
+
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+  g_return_if_fail (path != NULL);
+
+  if (flags & FLATPAK_SPAWN_EXPOSE_FLAGS_READONLY)
+    paths = (flags & FLATPAK_SPAWN_EXPOSE_FLAGS_TRY) ? self->sandbox_expose_path_ro_try : self->sandbox_expose_path_ro;
+  else
+    paths = (flags & FLATPAK_SPAWN_EXPOSE_FLAGS_TRY) ? self->sandbox_expose_path_try : self->sandbox_expose_path;
+
+  g_ptr_array_add (paths, g_strdup (path));
+}
+
+void
+flatpak_spawn_launcher_sandbox_a11y_own_name (FlatpakSpawnLauncher *self,
+                                              const char           *name)
+{
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+  g_return_if_fail (g_dbus_is_name (name) && !g_dbus_is_unique_name (name));
+
+  g_ptr_array_add (self->a11y_own_names, g_strdup (name));
+}
+
+/**
+ * flatpak_spawn_launcher_set_app_path:
+ * @self: a launcher
+ * @path: (nullable): directory to use as /app, "" for an empty
+ *  directory, or %NULL for the runtime's default
+ */
+void
+flatpak_spawn_launcher_set_app_path (FlatpakSpawnLauncher *self,
+                                     const char           *path)
+{
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+
+  g_free (self->app_path);
+  self->app_path = g_strdup (path);
+}
+
+void
+flatpak_spawn_launcher_set_usr_path (FlatpakSpawnLauncher *self,
+                                     const char           *path)
+{
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+
+  g_free (self->usr_path);
+  self->usr_path = g_strdup (path);
+}
+
+/**
+ * flatpak_spawn_launcher_set_timeouts:
+ * @self: a launcher
+ * @probe_timeout_msec: how long to wait for the service to answer a
+ *  question, such as its version, or to forward a signal to a process;
+ *  -1 for the D-Bus default
+ * @deadline: the g_get_monotonic_time() by which the command must have
+ *  started, or 0 for none
+ *
+ * Bounds the time spent on D-Bus calls. No call made to start the
+ * command is given longer than is left before @deadline, and once it
+ * has passed they fail with %G_IO_ERROR_TIMED_OUT. That includes asking
+ * the service for its version: a service that does not answer in time
+ * makes the spawn fail, rather than being taken for an old version.
+ */
+void
+flatpak_spawn_launcher_set_timeouts (FlatpakSpawnLauncher *self,
+                                     int                   probe_timeout_msec,
+                                     gint64                deadline)
+{
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+  g_return_if_fail (probe_timeout_msec >= -1);
+
+  self->probe_timeout = probe_timeout_msec;
+  self->deadline = deadline;
+}
+
+/*
+ * @str: A path
+ * @prefix: A possible prefix
+ *
+ * The same as flatpak_has_path_prefix(), but instead of a boolean,
+ * return the part of @str after @prefix (non-%NULL but possibly empty)
+ * if @str has prefix @prefix, or %NULL if it does not.
+ *
+ * Returns: (nullable) (transfer none): the part of @str after @prefix,
+ *  or %NULL if @str is not below @prefix
+ */
+static const char *
+get_path_after (const char *str,
+                const char *prefix)
+{
+  while (TRUE)
+    {
+      /* Skip consecutive slashes to reach next path
+         element */
+      while (*str == '/')
+        str++;
+      while (*prefix == '/')
+        prefix++;
+
+      /* No more prefix path elements? Done! */
+      if (*prefix == 0)
+        return str;
+
+      /* Compare path element */
+      while (*prefix != 0 && *prefix != '/')
+        {
+          if (*str != *prefix)
+            return NULL;
+          str++;
+          prefix++;
+        }
+
+      /* Matched prefix path element,
+         must be entire str path element */
+      if (*str != '/' && *str != 0)
+        return NULL;
+    }
+}
+
+/* Per-spawn state that is only needed while the spawn is in flight */
+typedef struct {
+  SpawnService service;
+  GDBusConnection *connection;
+  SpawnWatcher *watcher;
+  char *cwd;
+  GPtrArray *argv;
+  GPtrArray *unset_env;
+  GUnixFDList *fd_list;
+  GVariant *fds;
+  GVariant *env;
+  GVariant *opts;
+  GVariantBuilder options_builder;
+  guint32 flags;
+  guint32 watch_bus_flag;
+  int probe_timeout;
+  gint64 deadline;
+  GArray *requirements;
+  gboolean need_version;
+  gboolean need_supports;
+  gboolean resolved_home;
+  const char *flatpak_id;
+  char *home_realpath;
+} SpawnRequest;
+
+typedef struct {
+  const char *feature;
+  guint32 version;
+  guint32 supports;
+} SpawnRequirement;
+
+static void
+spawn_request_free (SpawnRequest *request)
+{
+  g_clear_object (&request->connection);
+  g_clear_pointer (&request->watcher, spawn_watcher_unref);
+  g_free (request->cwd);
+  g_ptr_array_unref (request->argv);
+  g_ptr_array_unref (request->unset_env);
+  g_clear_object (&request->fd_list);
+  g_clear_pointer (&request->fds, g_variant_unref);
+  g_clear_pointer (&request->env, g_variant_unref);
+  g_clear_pointer (&request->opts, g_variant_unref);
+  g_variant_builder_clear (&request->options_builder);
+  g_array_unref (request->requirements);
+  g_free (request->home_realpath);
+  g_free (request);
+}
+
+/* Returns: @timeout, or what is left before the deadline if that is
+ * shorter. -1, the D-Bus default, counts as longer than anything. */
+static int
+spawn_request_get_timeout (SpawnRequest *request,
+                           int           timeout)
+{
+  gint64 remaining;
+
+  if (request->deadline == 0)
+    return timeout;
+
+  /* 0 would also mean the default */
+  remaining = (request->deadline - g_get_monotonic_time ()) / G_TIME_SPAN_MILLISECOND;
+  remaining = CLAMP (remaining, 1, G_MAXINT);
+
+  if (timeout < 0 || timeout > remaining)
+    return remaining;
+
+  return timeout;
+}
+
+static void
+spawn_request_require (SpawnRequest *request,
+                       const char   *feature,
+                       guint32       version,
+                       guint32       supports)
+{
+  SpawnRequirement requirement = { feature, version, supports };
+
+  g_array_append_val (request->requirements, requirement);
+  request->need_version = TRUE;
+
+  if (supports != 0)
+    request->need_supports = TRUE;
+}
+
+/* Only resolved if a path is actually going to be exposed */
+static const char *
+spawn_request_get_home_realpath (SpawnRequest *request)
+{
+  if (!request->resolved_home)
+    {
+      request->resolved_home = TRUE;
+      request->flatpak_id = g_getenv ("FLATPAK_ID");
+
+      if (request->flatpak_id != NULL)
+        request->home_realpath = realpath (g_get_home_dir (), NULL);
+    }
+
+  return request->home_realpath;
+}
+
+static gint32
+spawn_request_path_to_handle (SpawnRequest *request,
+                              const char   *path,
+                              GError      **error)
+{
+  int path_fd = open (path, O_PATH|O_CLOEXEC|O_NOFOLLOW|O_RDONLY);
+  const char *home_realpath;
+  const char *flatpak_id;
+  int saved_errno;
+  gint32 handle;
+
+  if (path_fd < 0)
+    {
+      saved_errno = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to open %s to expose in sandbox: %s",
+                   path, g_strerror (saved_errno));
+      return -1;
+    }
+
+  home_realpath = spawn_request_get_home_realpath (request);
+  flatpak_id = request->flatpak_id;
+
+  if (home_realpath != NULL && flatpak_id != NULL)
+    {
+      g_autofree char *real = NULL;
+      const char *after = NULL;
+
+      real = realpath (path, NULL);
+
+      if (real != NULL)
+        after = get_path_after (real, home_realpath);
+
+      if (after != NULL)
+        {
+          g_autofree char *var_path = NULL;
+          int var_fd = -1;
+          struct stat path_buf;
+          struct stat var_buf;
+
+          /* @after is possibly "", but that's OK: if @path is exactly $HOME,
+           * we want to check whether it's the same file as
+           * ~/.var/app/$FLATPAK_ID, with no suffix
+           */
+          var_path = g_build_filename (home_realpath, ".var", "app", flatpak_id,
+                                       after, NULL);
+
+          var_fd = open (var_path, O_PATH|O_CLOEXEC|O_NOFOLLOW|O_RDONLY);
+
+          if (var_fd >= 0 &&
+              fstat (path_fd, &path_buf) == 0 &&
+              fstat (var_fd, &var_buf) == 0 &&
+              path_buf.st_dev == var_buf.st_dev &&
+              path_buf.st_ino == var_buf.st_ino)
+            {
+              close (path_fd);
+              path_fd = var_fd;
+              var_fd = -1;
+            }
+          else if (var_fd >= 0)
+            {
+              close (var_fd);
+            }
+        }
+    }
+
+  handle = g_unix_fd_list_append (request->fd_list, path_fd, error);
+
+  if (handle < 0)
+    {
+      g_prefix_error (error, "Failed to add fd to list for %s: ", path);
+      close (path_fd);
+      return -1;
+    }
+
+  /* The GUnixFdList keeps a duplicate, so we should release the original */
+  close (path_fd);
+  return handle;
+}
+
+static gboolean
+spawn_request_add_paths (SpawnRequest *request,
+                         const char   *option,
+                         GPtrArray    *paths,
+                         GPtrArray    *try_paths,
+                         GError      **error)
+{
+  GVariantBuilder builder;
+  guint i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("ah"));
+
+  for (i = 0; i < paths->len; i++)
+    {
+      gint32 handle = spawn_request_path_to_handle (request,
+                                                    g_ptr_array_index (paths, i),
+                                                    error);
+
+      if (handle < 0)
+        {
+          g_variant_builder_clear (&builder);
+          return FALSE;
+        }
+
+      g_variant_builder_add (&builder, "h", handle);
+    }
+
+  for (i = 0; i < try_paths->len; i++)
+    {
+      gint32 handle = spawn_request_path_to_handle (request,
+                                                    g_ptr_array_index (try_paths, i),
+                                                    NULL);
+
+      if (handle >= 0)
+        g_variant_builder_add (&builder, "h", handle);
+    }
+
+  g_variant_builder_add (&request->options_builder, "{s@v}", option,
+                         g_variant_new_variant (g_variant_builder_end (&builder)));
+  return TRUE;
+}
+
+static gboolean
+spawn_request_add_fd (SpawnRequest    *request,
+                      GVariantBuilder *fd_builder,
+                      int              source,
+                      int              target,
+                      GError         **error)
+{
+  gint handle = g_unix_fd_list_append (request->fd_list, source, error);
+
+  if (handle == -1)
+    {
+      g_prefix_error (error, "Can't append fd: ");
+      return FALSE;
+    }
+
+  g_variant_builder_add (fd_builder, "{uh}", target, handle);
+  return TRUE;
+}
+
+/* @feature is named as in the API, for example as the flag or the
+ * function that enables it */
+static gboolean
+check_not_host (FlatpakSpawnLauncher *self,
+                gboolean              used,
+                const char           *feature,
+                GError              **error)
+{
+  if (used && (self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_HOST))
+    {
+      g_set_error (error, FLATPAK_SPAWN_ERROR, FLATPAK_SPAWN_ERROR_INVALID_OPTION,
+                   "%s cannot be used with FLATPAK_SPAWN_LAUNCHER_FLAGS_HOST",
+                   feature);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Everything that doesn't depend on the service's version is captured
+ * here, so that @self can be modified as soon as spawn_async() returns */
+static SpawnRequest *
+spawn_request_new (FlatpakSpawnLauncher *self,
+                   const char * const   *argv,
+                   GError              **error)
+{
+  SpawnRequest *request;
+  GVariantBuilder fd_builder;
+  GVariantBuilder env_builder;
+  GHashTableIter iter;
+  gpointer key, value;
+  gboolean host = (self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_HOST) != 0;
+  int target;
+  guint i;
+
+  if (argv == NULL || argv[0] == NULL)
+    {
+      g_set_error (error, FLATPAK_SPAWN_ERROR, FLATPAK_SPAWN_ERROR_INVALID_OPTION,
+                   "No command specified");
+      return NULL;
+    }
+
+  if (!check_not_host (self, self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_SHARE_PIDS, "FLATPAK_SPAWN_LAUNCHER_FLAGS_SHARE_PIDS", error) ||
+      !check_not_host (self, self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_EXPOSE_PIDS, "FLATPAK_SPAWN_LAUNCHER_FLAGS_EXPOSE_PIDS", error) ||
+      !check_not_host (self, self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_LATEST_VERSION, "FLATPAK_SPAWN_LAUNCHER_FLAGS_LATEST_VERSION", error) ||
+      !check_not_host (self, self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_SANDBOX, "FLATPAK_SPAWN_LAUNCHER_FLAGS_SANDBOX", error) ||
+      !check_not_host (self, self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_NO_NETWORK, "FLATPAK_SPAWN_LAUNCHER_FLAGS_NO_NETWORK", error) ||
+      !check_not_host (self, self->sandbox_expose->len > 0, "flatpak_spawn_launcher_sandbox_expose()", error) ||
+      !check_not_host (self, self->sandbox_expose_ro->len > 0, "flatpak_spawn_launcher_sandbox_expose()", error) ||
+      !check_not_host (self, self->sandbox_flags != 0, "flatpak_spawn_launcher_set_sandbox_flags()", error) ||
+      !check_not_host (self, self->sandbox_expose_path->len > 0 || self->sandbox_expose_path_try->len > 0,
+                       "flatpak_spawn_launcher_sandbox_expose_path()", error) ||
+      !check_not_host (self, self->sandbox_expose_path_ro->len > 0 || self->sandbox_expose_path_ro_try->len > 0,
+                       "flatpak_spawn_launcher_sandbox_expose_path()", error) ||
+      !check_not_host (self, self->a11y_own_names->len > 0, "flatpak_spawn_launcher_sandbox_a11y_own_name()", error) ||
+      !check_not_host (self, self->app_path != NULL, "flatpak_spawn_launcher_set_app_path()", error) ||
+      !check_not_host (self, self->usr_path != NULL, "flatpak_spawn_launcher_set_usr_path()", error))
+    return NULL;
+
+  request = g_new0 (SpawnRequest, 1);
+  request->service = host ? SPAWN_SERVICE_HOST : SPAWN_SERVICE_PORTAL;
+  request->argv = g_ptr_array_new_with_free_func (g_free);
+  request->unset_env = g_ptr_array_new_with_free_func (g_free);
+  request->fd_list = g_unix_fd_list_new ();
+  request->probe_timeout = self->probe_timeout;
+  request->deadline = self->deadline;
+  request->requirements = g_array_new (FALSE, FALSE, sizeof (SpawnRequirement));
+  g_variant_builder_init (&request->options_builder, G_VARIANT_TYPE ("a{sv}"));
+
+  if (self->cwd != NULL)
+    request->cwd = g_strdup (self->cwd);
+  else
+    request->cwd = g_get_current_dir ();
+
+  for (i = 0; argv[i] != NULL; i++)
+    g_ptr_array_add (request->argv, g_strdup (argv[i]));
+
+  g_variant_builder_init (&fd_builder, G_VARIANT_TYPE ("a{uh}"));
+
+  /* We always forward stdin, stdout and stderr, first */
+  for (target = 0; target <= 2; target++)
+    {
+      int source = target;
+
+      for (i = 0; i < self->fds->len; i++)
+        {
+          if (g_array_index (self->fds, SpawnFd, i).target == target)
+            source = g_array_index (self->fds, SpawnFd, i).source;
+        }
+
+      if (!spawn_request_add_fd (request, &fd_builder, source, target, error))
+        goto fail;
+    }
+
+  for (i = 0; i < self->fds->len; i++)
+    {
+      const SpawnFd *fd = &g_array_index (self->fds, SpawnFd, i);
+
+      if (fd->target <= 2)
+        continue;
+
+      if (!spawn_request_add_fd (request, &fd_builder, fd->source, fd->target, error))
+        goto fail;
+    }
+
+  request->fds = g_variant_ref_sink (g_variant_builder_end (&fd_builder));
+
+  g_variant_builder_init (&env_builder, G_VARIANT_TYPE ("a{ss}"));
+  g_hash_table_iter_init (&iter, self->env);
+
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&env_builder, "{ss}", key, value);
+
+  request->env = g_variant_ref_sink (g_variant_builder_end (&env_builder));
+
+  g_hash_table_iter_init (&iter, self->unset_env);
+
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_ptr_array_add (request->unset_env, g_strdup (key));
+
+  /* Only ask for the version if it could let us unset variables
+   * natively; otherwise they are unset the hard way */
+  if (request->unset_env->len > 0 &&
+      spawn_services[request->service].unset_env_version != 0)
+    request->need_version = TRUE;
+
+  if (self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_CLEAR_ENV)
+    request->flags |= host ? FLATPAK_HOST_COMMAND_FLAGS_CLEAR_ENV : FLATPAK_SPAWN_FLAGS_CLEAR_ENV;
+
+  if (self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_WATCH_BUS)
+    {
+      request->watch_bus_flag = host ? FLATPAK_HOST_COMMAND_FLAGS_WATCH_BUS : FLATPAK_SPAWN_FLAGS_WATCH_BUS;
+      request->flags |= request->watch_bus_flag;
+    }
+
+  if (self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_SHARE_PIDS)
+    {
+      spawn_request_require (request, "FLATPAK_SPAWN_LAUNCHER_FLAGS_SHARE_PIDS", 5,
+                             FLATPAK_SPAWN_SUPPORT_FLAGS_SHARE_PIDS);
+      request->flags |= FLATPAK_SPAWN_FLAGS_SHARE_PIDS;
+    }
+  else if (self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_EXPOSE_PIDS)
+    {
+      spawn_request_require (request, "FLATPAK_SPAWN_LAUNCHER_FLAGS_EXPOSE_PIDS", 3,
+                             FLATPAK_SPAWN_SUPPORT_FLAGS_EXPOSE_PIDS);
+      request->flags |= FLATPAK_SPAWN_FLAGS_EXPOSE_PIDS;
+    }
+
+  if (self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_LATEST_VERSION)
+    request->flags |= FLATPAK_SPAWN_FLAGS_LATEST_VERSION;
+
+  if (self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_SANDBOX)
+    request->flags |= FLATPAK_SPAWN_FLAGS_SANDBOX;
+
+  if (self->flags & FLATPAK_SPAWN_LAUNCHER_FLAGS_NO_NETWORK)
+    request->flags |= FLATPAK_SPAWN_FLAGS_NO_NETWORK;
+
+  if (self->sandbox_expose->len > 0)
+    g_variant_builder_add (&request->options_builder, "{s@v}", "sandbox-expose",
+                           g_variant_new_variant (g_variant_new_strv ((const char * const *) self->sandbox_expose->pdata,
+                                                                      self->sandbox_expose->len)));
+
+  if (self->sandbox_expose_ro->len > 0)
+    g_variant_builder_add (&request->options_builder, "{s@v}", "sandbox-expose-ro",
+                           g_variant_new_variant (g_variant_new_strv ((const char * const *) self->sandbox_expose_ro->pdata,
+                                                                      self->sandbox_expose_ro->len)));
+
+  if (self->sandbox_flags != 0)
+    {
+      spawn_request_require (request, "flatpak_spawn_launcher_set_sandbox_flags()", 3, 0);
+      g_variant_builder_add (&request->options_builder, "{s@v}", "sandbox-flags",
+                             g_variant_new_variant (g_variant_new_uint32 (self->sandbox_flags)));
+    }
+
+  if (self->sandbox_expose_path->len > 0 || self->sandbox_expose_path_try->len > 0)
+    {
+      spawn_request_require (request, "flatpak_spawn_launcher_sandbox_expose_path()", 3, 0);
+
+      if (!spawn_request_add_paths (request, "sandbox-expose-fd",
+                                    self->sandbox_expose_path,
+                                    self->sandbox_expose_path_try,
+                                    error))
+        goto fail;
+    }
+
+  if (self->sandbox_expose_path_ro->len > 0 || self->sandbox_expose_path_ro_try->len > 0)
+    {
+      spawn_request_require (request, "flatpak_spawn_launcher_sandbox_expose_path() with FLATPAK_SPAWN_EXPOSE_FLAGS_READONLY", 3, 0);
+
+      if (!spawn_request_add_paths (request, "sandbox-expose-fd-ro",
+                                    self->sandbox_expose_path_ro,
+                                    self->sandbox_expose_path_ro_try,
+                                    error))
+        goto fail;
+    }
+
+  if (self->a11y_own_names->len > 0)
+    {
+      spawn_request_require (request, "flatpak_spawn_launcher_sandbox_a11y_own_name()", 7, 0);
+      g_variant_builder_add (&request->options_builder, "{s@v}", "sandbox-a11y-own-names",
+                             g_variant_new_variant (g_variant_new_strv ((const char * const *) self->a11y_own_names->pdata,
+                                                                        self->a11y_own_names->len)));
+    }
+
+  if (self->app_path != NULL)
+    {
+      spawn_request_require (request, "flatpak_spawn_launcher_set_app_path()", 6, 0);
+
+      if (self->app_path[0] == '\0')
+        {
+          /* Empty path is special-cased to mean an empty directory */
+          request->flags |= FLATPAK_SPAWN_FLAGS_EMPTY_APP;
+        }
+      else
+        {
+          gint32 handle = spawn_request_path_to_handle (request, self->app_path, error);
+
+          if (handle < 0)
+            goto fail;
+
+          g_variant_builder_add (&request->options_builder, "{s@v}", "app-fd",
+                                 g_variant_new_variant (g_variant_new_handle (handle)));
+        }
+    }
+
+  if (self->usr_path != NULL)
+    {
+      gint32 handle;
+
+      spawn_request_require (request, "flatpak_spawn_launcher_set_usr_path()", 6, 0);
+      handle = spawn_request_path_to_handle (request, self->usr_path, error);
+
+      if (handle < 0)
+        goto fail;
+
+      g_variant_builder_add (&request->options_builder, "{s@v}", "usr-fd",
+                             g_variant_new_variant (g_variant_new_handle (handle)));
+    }
+
+  return request;
+
+fail:
+  g_variant_builder_clear (&fd_builder);
+  spawn_request_free (request);
+  return NULL;
+}
+
+static gboolean
+spawn_request_check_requirements (SpawnRequest *request,
+                                  GError      **error)
+{
+  const SpawnWatcherService *s = &request->watcher->services[request->service];
+  guint i;
+
+  for (i = 0; i < request->requirements->len; i++)
+    {
+      const SpawnRequirement *requirement = &g_array_index (request->requirements,
+                                                            SpawnRequirement, i);
+
+      if (s->version < requirement->version)
+        {
+          g_set_error (error, FLATPAK_SPAWN_ERROR, FLATPAK_SPAWN_ERROR_PORTAL_TOO_OLD,
+                       "%s is not supported by %s version %u (version %u is needed)",
+                       requirement->feature, spawn_services[request->service].bus_name,
+                       s->version, requirement->version);
+          return FALSE;
+        }
+
+      if ((s->supports & requirement->supports) != requirement->supports)
+        {
+          g_set_error (error, FLATPAK_SPAWN_ERROR, FLATPAK_SPAWN_ERROR_NOT_SUPPORTED,
+                       "%s is not supported by %s on this system",
+                       requirement->feature, spawn_services[request->service].bus_name);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Unsets the variables named before "--", then runs the rest. Shell
+ * variables are not an exact match for environment variables, so this
+ * is only used where env(1) can't be. */
+#define UNSET_ENV_TRAMPOLINE \
+  "for v do shift; [ \"$v\" = -- ] && break; unset -v \"$v\"; done; exec \"$@\""
+
+static gboolean
+is_shell_name (const char *name)
+{
+  const char *p;
+
+  if (!g_ascii_isalpha (name[0]) && name[0] != '_')
+    return FALSE;
+
+  for (p = name + 1; *p != '\0'; p++)
+    {
+      if (!g_ascii_isalnum (*p) && *p != '_')
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+all_shell_names (GPtrArray *names)
+{
+  guint i;
+
+  for (i = 0; i < names->len; i++)
+    {
+      if (!is_shell_name (g_ptr_array_index (names, i)))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Apply the --unset-env list, either natively or with a trampoline
+ * that costs a single extra exec */
+static void
+spawn_request_apply_unset_env (SpawnRequest *request)
+{
+  const SpawnWatcherService *s = &request->watcher->services[request->service];
+  guint32 unset_env_version = spawn_services[request->service].unset_env_version;
+  g_autoptr(GPtrArray) argv = NULL;
+  guint i;
+
+  if (request->unset_env->len == 0)
+    return;
+
+  if (unset_env_version != 0 && s->version >= unset_env_version)
+    {
+      g_variant_builder_add (&request->options_builder, "{s@v}", "unset-env",
+                             g_variant_new_variant (g_variant_new_strv ((const char * const *) request->unset_env->pdata,
+                                                                        request->unset_env->len)));
+      return;
+    }
+
+  argv = g_ptr_array_new_full (request->argv->len + 2 * request->unset_env->len + 5,
+                               g_free);
+
+  if (strchr (g_ptr_array_index (request->argv, 0), '=') == NULL)
+    {
+      /* The usual case: replace COMMAND ARGS with
+       *
+       *     /usr/bin/env -u VAR -u VAR2 -- COMMAND ARGS
+       *
+       * where "--" stops a COMMAND starting with "-" from being taken
+       * for an option */
+      g_ptr_array_add (argv, g_strdup ("/usr/bin/env"));
+
+      for (i = 0; i < request->unset_env->len; i++)
+        {
+          g_ptr_array_add (argv, g_strdup ("-u"));
+          g_ptr_array_add (argv, g_strdup (g_ptr_array_index (request->unset_env, i)));
+        }
+
+      g_ptr_array_add (argv, g_strdup ("--"));
+    }
+  else if (all_shell_names (request->unset_env))
+    {
+      /* env(1) would take MY=COMMAND for an assignment, so let the
+       * shell do the unsetting instead:
+       *
+       *     /bin/sh -c TRAMPOLINE sh VAR VAR2 -- MY=COMMAND ARGS */
+      g_ptr_array_add (argv, g_strdup ("/bin/sh"));
+      g_ptr_array_add (argv, g_strdup ("-c"));
+      g_ptr_array_add (argv, g_strdup (UNSET_ENV_TRAMPOLINE));
+      g_ptr_array_add (argv, g_strdup ("sh"));  /* argv[0] */
+
+      for (i = 0; i < request->unset_env->len; i++)
+        g_ptr_array_add (argv, g_strdup (g_ptr_array_index (request->unset_env, i)));
+
+      g_ptr_array_add (argv, g_strdup ("--"));
+    }
+  else
+    {
+      /* The shell can't unset a variable whose name it can't parse,
+       * so fall back to the standard trick for dealing with env(1):
+       *
+       *     /usr/bin/env -u VAR /bin/sh -euc 'exec "$@"' sh MY=COMMAND ARGS */
+      g_ptr_array_add (argv, g_strdup ("/usr/bin/env"));
+
+      for (i = 0; i < request->unset_env->len; i++)
+        {
+          g_ptr_array_add (argv, g_strdup ("-u"));
+          g_ptr_array_add (argv, g_strdup (g_ptr_array_index (request->unset_env, i)));
+        }
+
+      g_ptr_array_add (argv, g_strdup ("/bin/sh"));
+      g_ptr_array_add (argv, g_strdup ("-euc"));
+      g_ptr_array_add (argv, g_strdup ("exec \"$@\""));
+      g_ptr_array_add (argv, g_strdup ("sh"));  /* argv[0] */
+    }
+
+  for (i = 0; i < request->argv->len; i++)
+    g_ptr_array_add (argv, g_strdup (g_ptr_array_index (request->argv, i)));
+
+  g_ptr_array_unref (request->argv);
+  request->argv = g_steal_pointer (&argv);
+}
+
+static void spawn_call (GTask *task);
+
+static void
+spawn_have_version (GTask *task)
+{
+  SpawnRequest *request = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  if (!spawn_request_check_requirements (request, &error))
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  spawn_request_apply_unset_env (request);
+  g_ptr_array_add (request->argv, NULL);
+  request->opts = g_variant_ref_sink (g_variant_builder_end (&request->options_builder));
+
+  spawn_watcher_ensure_service (request->watcher, request->service);
+  spawn_call (task);
+}
+
+/* Sets @value to 0 if the service is missing or too old to have
+ * @property, which is what that means for the features it gates. Any
+ * other error, in particular a timeout or cancellation, is an error. */
+static gboolean
+get_uint32_property_finish (GDBusConnection *connection,
+                            GAsyncResult    *result,
+                            const char      *property,
+                            guint32         *value,
+                            GError         **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GVariant) v = NULL;
+
+  *value = 0;
+  reply = g_dbus_connection_call_finish (connection, result, &local_error);
+
+  if (reply == NULL)
+    {
+      /* GDBus answers Get for a property it does not know about with
+       * InvalidArgs, and other implementations with UnknownProperty */
+      if (g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN) ||
+          g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_PROPERTY) ||
+          g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS))
+        {
+          g_debug ("Failed to get %s: %s", property, local_error->message);
+          return TRUE;
+        }
+
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  g_variant_get (reply, "(v)", &v);
+
+  if (!g_variant_is_of_type (v, G_VARIANT_TYPE_UINT32))
+    {
+      g_debug ("%s had unexpected type %s", property, g_variant_get_type_string (v));
+      return TRUE;
+    }
+
+  *value = g_variant_get_uint32 (v);
+  return TRUE;
+}
+
+static void
+get_uint32_property (GTask               *task,
+                     const char          *property,
+                     GAsyncReadyCallback  callback)
+{
+  SpawnRequest *request = g_task_get_task_data (task);
+  const SpawnServiceInfo *info = &spawn_services[request->service];
+
+  g_dbus_connection_call (request->connection,
+                          info->bus_name,
+                          info->obj_path,
+                          "org.freedesktop.DBus.Properties",
+                          "Get",
+                          g_variant_new ("(ss)", info->iface, property),
+                          G_VARIANT_TYPE ("(v)"),
+                          G_DBUS_CALL_FLAGS_NONE,
+                          spawn_request_get_timeout (request, request->probe_timeout),
+                          g_task_get_cancellable (task),
+                          callback, task);
+}
+
+static void
+get_supports_cb (GObject      *source,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  GTask *task = user_data;
+  SpawnRequest *request = g_task_get_task_data (task);
+  SpawnWatcherService *s = &request->watcher->services[request->service];
+  GError *error = NULL;
+
+  if (!get_uint32_property_finish (G_DBUS_CONNECTION (source), result,
+                                   "supports", &s->supports, &error))
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  s->have_supports = TRUE;
+  spawn_have_version (task);
+}
+
+static void
+spawn_have_version_maybe_supports (GTask *task)
+{
+  SpawnRequest *request = g_task_get_task_data (task);
+  SpawnWatcherService *s = &request->watcher->services[request->service];
+
+  /* Support flags were added in version 3 */
+  if (request->need_supports && !s->have_supports && s->version >= 3)
+    get_uint32_property (task, "supports", get_supports_cb);
+  else
+    spawn_have_version (task);
+}
+
+static void
+get_version_cb (GObject      *source,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  GTask *task = user_data;
+  SpawnRequest *request = g_task_get_task_data (task);
+  SpawnWatcherService *s = &request->watcher->services[request->service];
+  GError *error = NULL;
+
+  if (!get_uint32_property_finish (G_DBUS_CONNECTION (source), result,
+                                   "version", &s->version, &error))
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  /* Don't cache a failure: a service that was not yet running might
+   * start later */
+  s->have_version = (s->version != 0);
+  spawn_have_version_maybe_supports (task);
+}
+
+static void
+spawn_have_connection (GTask *task)
+{
+  SpawnRequest *request = g_task_get_task_data (task);
+
+  request->watcher = spawn_watcher_get (request->connection);
+
+  if (request->need_version &&
+      !request->watcher->services[request->service].have_version)
+    get_uint32_property (task, "version", get_version_cb);
+  else
+    spawn_have_version_maybe_supports (task);
+}
+
+static void
+spawn_cb (GObject      *source,
+          GAsyncResult *result,
+          gpointer      user_data)
+{
+  GTask *task = user_data;
+  SpawnRequest *request = g_task_get_task_data (task);
+  g_autoptr(GVariant) reply = NULL;
+  GError *error = NULL;
+  guint32 pid;
+
+  reply = g_dbus_connection_call_with_unix_fd_list_finish (G_DBUS_CONNECTION (source),
+                                                           NULL, result, &error);
+
+  if (reply == NULL)
+    {
+      if (g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS) &&
+          request->watch_bus_flag != 0)
+        {
+          g_debug ("Got an invalid argument error; trying again without --watch-bus");
+
+          request->flags &= ~request->watch_bus_flag;
+          request->watch_bus_flag = 0;
+          g_clear_error (&error);
+          spawn_call (task);
+          return;
+        }
+
+      g_dbus_error_strip_remote_error (error);
+      g_prefix_error (&error, "Portal call failed: ");
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  g_variant_get (reply, "(u)", &pid);
+  g_debug ("child_pid: %d", pid);
+
+  /* The command is running now, so return it even if the cancellable
+   * was cancelled meanwhile: otherwise nothing could signal it or learn
+   * when it exits */
+  g_task_set_check_cancellable (task, FALSE);
+  g_task_return_pointer (task,
+                         flatpak_spawn_process_new (request->watcher,
+                                                    request->service,
+                                                    pid,
+                                                    request->probe_timeout),
+                         g_object_unref);
+  g_object_unref (task);
+}
+
+static void
+spawn_call (GTask *task)
+{
+  SpawnRequest *request = g_task_get_task_data (task);
+  const SpawnServiceInfo *info = &spawn_services[request->service];
+  GVariant *parameters;
+
+  /* Once the call has been sent, the service might start the command
+   * whatever we do, so after this the reply is waited for (within the
+   * timeout) and the process returned */
+  if (g_task_return_error_if_cancelled (task))
+    {
+      g_object_unref (task);
+      return;
+    }
+
+  if (request->service == SPAWN_SERVICE_HOST)
+    parameters = g_variant_new ("(^ay^aay@a{uh}@a{ss}u)",
+                                request->cwd,
+                                (const char * const *) request->argv->pdata,
+                                request->fds,
+                                request->env,
+                                request->flags);
+  else
+    parameters = g_variant_new ("(^ay^aay@a{uh}@a{ss}u@a{sv})",
+                                request->cwd,
+                                (const char * const *) request->argv->pdata,
+                                request->fds,
+                                request->env,
+                                request->flags,
+                                request->opts);
+
+  g_dbus_connection_call_with_unix_fd_list (request->connection,
+                                            info->bus_name,
+                                            info->obj_path,
+                                            info->iface,
+                                            info->spawn_method,
+                                            parameters,
+                                            G_VARIANT_TYPE ("(u)"),
+                                            G_DBUS_CALL_FLAGS_NONE,
+                                            spawn_request_get_timeout (request, -1),
+                                            request->fd_list,
+                                            NULL,
+                                            spawn_cb, task);
+}
+
+static void
+bus_get_cb (G_GNUC_UNUSED GObject *source,
+            GAsyncResult *result,
+            gpointer      user_data)
+{
+  GTask *task = user_data;
+  SpawnRequest *request = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  request->connection = g_bus_get_finish (result, &error);
+
+  if (request->connection == NULL)
+    {
+      g_prefix_error (&error, "Can't find bus: ");
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  spawn_have_connection (task);
+}
+
+/**
+ * flatpak_spawn_launcher_spawn_async:
+ * @self: a launcher
+ * @argv: (array zero-terminated=1): the command and its arguments
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: called when the command has been started or has failed
+ * @user_data: user data for @callback
+ *
+ * Starts @argv in a new sandbox, or on the host. The launcher's
+ * configuration is captured before this function returns, so @self can
+ * be reused or modified immediately.
+ *
+ * Cancelling @cancellable stops the launcher from asking the service to
+ * start the command. Once it has asked, the command is returned if it
+ * was started, even if @cancellable has been cancelled since.
+ */
+void
+flatpak_spawn_launcher_spawn_async (FlatpakSpawnLauncher *self,
+                                    const char * const   *argv,
+                                    GCancellable         *cancellable,
+                                    GAsyncReadyCallback   callback,
+                                    gpointer              user_data)
+{
+  GTask *task;
+  SpawnRequest *request;
+  GError *error = NULL;
+
+  g_return_if_fail (FLATPAK_SPAWN_IS_LAUNCHER (self));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, flatpak_spawn_launcher_spawn_async);
+
+  request = spawn_request_new (self, argv, &error);
+
+  if (request == NULL)
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  g_task_set_task_data (task, request, (GDestroyNotify) spawn_request_free);
+
+  if (self->connection != NULL)
+    {
+      request->connection = g_object_ref (self->connection);
+      spawn_have_connection (task);
+    }
+  else
+    {
+      g_bus_get (G_BUS_TYPE_SESSION, cancellable, bus_get_cb, task);
+    }
+}
+
+/**
+ * flatpak_spawn_launcher_spawn_finish:
+ * @self: a launcher
+ * @result: the result passed to the callback
+ * @error: return location for an error
+ *
+ * Returns: (transfer full): the new process, or %NULL on error
+ */
+FlatpakSpawnProcess *
+flatpak_spawn_launcher_spawn_finish (FlatpakSpawnLauncher *self,
+                                     GAsyncResult         *result,
+                                     GError              **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_SPAWN_LAUNCHER_H__
+#define __FLATPAK_SPAWN_LAUNCHER_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define FLATPAK_SPAWN_ERROR (flatpak_spawn_error_quark ())
+
+typedef enum {
+  FLATPAK_SPAWN_ERROR_FAILED,
+  FLATPAK_SPAWN_ERROR_INVALID_OPTION,
+  FLATPAK_SPAWN_ERROR_PORTAL_TOO_OLD,
+  FLATPAK_SPAWN_ERROR_NOT_SUPPORTED,
+  FLATPAK_SPAWN_ERROR_SERVICE_VANISHED,
+} FlatpakSpawnError;
+
+typedef enum {
+  FLATPAK_SPAWN_LAUNCHER_FLAGS_NONE = 0,
+  FLATPAK_SPAWN_LAUNCHER_FLAGS_HOST = 1 << 0,
+  FLATPAK_SPAWN_LAUNCHER_FLAGS_CLEAR_ENV = 1 << 1,
+  FLATPAK_SPAWN_LAUNCHER_FLAGS_WATCH_BUS = 1 << 2,
+  FLATPAK_SPAWN_LAUNCHER_FLAGS_LATEST_VERSION = 1 << 3,
+  FLATPAK_SPAWN_LAUNCHER_FLAGS_SANDBOX = 1 << 4,
+  FLATPAK_SPAWN_LAUNCHER_FLAGS_NO_NETWORK = 1 << 5,
+  FLATPAK_SPAWN_LAUNCHER_FLAGS_EXPOSE_PIDS = 1 << 6,
+  FLATPAK_SPAWN_LAUNCHER_FLAGS_SHARE_PIDS = 1 << 7,
+} FlatpakSpawnLauncherFlags;
+
+typedef enum {
+  FLATPAK_SPAWN_EXPOSE_FLAGS_NONE = 0,
+  FLATPAK_SPAWN_EXPOSE_FLAGS_READONLY = 1 << 0,
+  FLATPAK_SPAWN_EXPOSE_FLAGS_TRY = 1 << 1,
+} FlatpakSpawnExposeFlags;
+
+#define FLATPAK_SPAWN_TYPE_LAUNCHER (flatpak_spawn_launcher_get_type ())
+#define FLATPAK_SPAWN_LAUNCHER(o) (G_TYPE_CHECK_INSTANCE_CAST ((o), FLATPAK_SPAWN_TYPE_LAUNCHER, FlatpakSpawnLauncher))
+#define FLATPAK_SPAWN_IS_LAUNCHER(o) (G_TYPE_CHECK_INSTANCE_TYPE ((o), FLATPAK_SPAWN_TYPE_LAUNCHER))
+
+#define FLATPAK_SPAWN_TYPE_PROCESS (flatpak_spawn_process_get_type ())
+#define FLATPAK_SPAWN_PROCESS(o) (G_TYPE_CHECK_INSTANCE_CAST ((o), FLATPAK_SPAWN_TYPE_PROCESS, FlatpakSpawnProcess))
+#define FLATPAK_SPAWN_IS_PROCESS(o) (G_TYPE_CHECK_INSTANCE_TYPE ((o), FLATPAK_SPAWN_TYPE_PROCESS))
+
+typedef struct _FlatpakSpawnLauncher FlatpakSpawnLauncher;
+typedef struct _FlatpakSpawnProcess FlatpakSpawnProcess;
+
+GQuark                flatpak_spawn_error_quark                 (void);
+
+GType                 flatpak_spawn_launcher_get_type           (void) G_GNUC_CONST;
+FlatpakSpawnLauncher *flatpak_spawn_launcher_new                (FlatpakSpawnLauncherFlags flags);
+void                  flatpak_spawn_launcher_set_flags          (FlatpakSpawnLauncher     *self,
+                                                                 FlatpakSpawnLauncherFlags flags);
+FlatpakSpawnLauncherFlags flatpak_spawn_launcher_get_flags      (FlatpakSpawnLauncher     *self);
+void                  flatpak_spawn_launcher_set_connection     (FlatpakSpawnLauncher     *self,
+                                                                 GDBusConnection          *connection);
+void                  flatpak_spawn_launcher_set_cwd            (FlatpakSpawnLauncher     *self,
+                                                                 const char               *cwd);
+void                  flatpak_spawn_launcher_setenv             (FlatpakSpawnLauncher     *self,
+                                                                 const char               *variable,
+                                                                 const char               *value);
+void                  flatpak_spawn_launcher_unsetenv           (FlatpakSpawnLauncher     *self,
+                                                                 const char               *variable);
+void                  flatpak_spawn_launcher_take_fd            (FlatpakSpawnLauncher     *self,
+                                                                 int                       source_fd,
+                                                                 int                       target_fd);
+void                  flatpak_spawn_launcher_set_sandbox_flags  (FlatpakSpawnLauncher     *self,
+                                                                 guint32                   sandbox_flags);
+void                  flatpak_spawn_launcher_sandbox_expose     (FlatpakSpawnLauncher     *self,
+                                                                 const char               *name,
+                                                                 gboolean                  readonly);
+void                  flatpak_spawn_launcher_sandbox_expose_path (FlatpakSpawnLauncher    *self,
+                                                                  const char              *path,
+                                                                  FlatpakSpawnExposeFlags  flags);
+void                  flatpak_spawn_launcher_sandbox_a11y_own_name (FlatpakSpawnLauncher  *self,
+                                                                    const char            *name);
+void                  flatpak_spawn_launcher_set_app_path       (FlatpakSpawnLauncher     *self,
+                                                                 const char               *path);
+void                  flatpak_spawn_launcher_set_usr_path       (FlatpakSpawnLauncher     *self,
+                                                                 const char               *path);
+void                  flatpak_spawn_launcher_set_timeouts       (FlatpakSpawnLauncher     *self,
+                                                                 int                       probe_timeout_msec,
+                                                                 gint64                    deadline);
+void                  flatpak_spawn_launcher_spawn_async        (FlatpakSpawnLauncher     *self,
+                                                                 const char * const       *argv,
+                                                                 GCancellable             *cancellable,
+                                                                 GAsyncReadyCallback       callback,
+                                                                 gpointer                  user_data);
+FlatpakSpawnProcess  *flatpak_spawn_launcher_spawn_finish       (FlatpakSpawnLauncher     *self,
+                                                                 GAsyncResult             *result,
+                                                                 GError                  **error);
+
+GType                 flatpak_spawn_process_get_type            (void) G_GNUC_CONST;
+guint32               flatpak_spawn_process_get_pid             (FlatpakSpawnProcess      *self);
+gboolean              flatpak_spawn_process_has_exited          (FlatpakSpawnProcess      *self);
+int                   flatpak_spawn_process_get_status          (FlatpakSpawnProcess      *self);
+void                  flatpak_spawn_process_send_signal         (FlatpakSpawnProcess      *self,
+                                                                 int                       signum,
+                                                                 gboolean                  to_process_group);
+gboolean              flatpak_spawn_process_send_signal_sync    (FlatpakSpawnProcess      *self,
+                                                                 int                       signum,
+                                                                 gboolean                  to_process_group,
+                                                                 GCancellable             *cancellable,
+                                                                 GError                  **error);
+void                  flatpak_spawn_process_wait_async          (FlatpakSpawnProcess      *self,
+                                                                 GCancellable             *cancellable,
+                                                                 GAsyncReadyCallback       callback,
+                                                                 gpointer                  user_data);
+gboolean              flatpak_spawn_process_wait_finish         (FlatpakSpawnProcess      *self,
+                                                                 GAsyncResult             *result,
+                                                                 GError                  **error);
+
+#ifdef G_DEFINE_AUTOPTR_CLEANUP_FUNC
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakSpawnLauncher, g_object_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakSpawnProcess, g_object_unref)
+#endif
+
+G_END_DECLS
+
+#endif /* __FLATPAK_SPAWN_LAUNCHER_H__ */
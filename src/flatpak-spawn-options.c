@@ -0,0 +1,234 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "flatpak-spawn-options.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backport-autoptr.h"
+#include "flatpak-spawn-launcher.h"
+
+void
+flatpak_spawn_options_init (FlatpakSpawnOptions *self)
+{
+  self->env = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->unset_env = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->sandbox_flags = 0;
+}
+
+void
+flatpak_spawn_options_clear (FlatpakSpawnOptions *self)
+{
+  g_clear_pointer (&self->env, g_hash_table_unref);
+  g_clear_pointer (&self->unset_env, g_hash_table_unref);
+  self->sandbox_flags = 0;
+}
+
+/* As with the launcher, the last of --env and --unset-env wins */
+static void
+setenv_option (FlatpakSpawnOptions *self,
+               const char          *variable,
+               const char          *value)
+{
+  g_hash_table_remove (self->unset_env, variable);
+  g_hash_table_replace (self->env, g_strdup (variable), g_strdup (value));
+}
+
+gboolean
+flatpak_spawn_options_env_cb (G_GNUC_UNUSED const char *option_name,
+                              const gchar *value,
+                              gpointer data,
+                              GError **error)
+{
+  FlatpakSpawnOptions *self = data;
+  const char *equals = strchr (value, '=');
+  g_autofree gchar *variable = NULL;
+
+  if (equals == NULL || equals == value)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "Invalid env format %s", value);
+      return FALSE;
+    }
+
+  variable = g_strndup (value, equals - value);
+  setenv_option (self, variable, equals + 1);
+  return TRUE;
+}
+
+gboolean
+flatpak_spawn_options_unset_env_cb (G_GNUC_UNUSED const char *option_name,
+                                    const gchar *value,
+                                    gpointer data,
+                                    G_GNUC_UNUSED GError **error)
+{
+  FlatpakSpawnOptions *self = data;
+
+  g_hash_table_remove (self->env, value);
+  g_hash_table_add (self->unset_env, g_strdup (value));
+  return TRUE;
+}
+
+/* Parses a block in env -0 format: VARIABLE=VALUE pairs, each followed
+ * by a \0 except perhaps the last */
+gboolean
+flatpak_spawn_options_add_env_block (FlatpakSpawnOptions *self,
+                                     const char *env_block,
+                                     gsize len,
+                                     GError **error)
+{
+  const char *p = env_block;
+  gsize remaining = len;
+
+  while (remaining > 0)
+    {
+      g_autofree gchar *var = NULL;
+      size_t var_len = strnlen (p, remaining);
+      const char *equals;
+
+      g_assert (var_len <= remaining);
+
+      equals = memchr (p, '=', var_len);
+
+      if (equals == NULL || equals == p)
+        {
+          g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                       "Environment variable must be given in the form VARIABLE=VALUE, not %.*s",
+                       (int) var_len, p);
+          return FALSE;
+        }
+
+      var = g_strndup (p, equals - p);
+
+      if (var_len == remaining)
+        {
+          /* The last value is not necessarily terminated */
+          g_autofree gchar *val = g_strndup (equals + 1, p + var_len - (equals + 1));
+
+          setenv_option (self, var, val);
+        }
+      else
+        {
+          setenv_option (self, var, equals + 1);
+        }
+
+      p += var_len;
+      remaining -= var_len;
+
+      if (remaining > 0)
+        {
+          g_assert (*p == '\0');
+          p += 1;
+          remaining -= 1;
+        }
+    }
+
+  return TRUE;
+}
+
+gboolean
+flatpak_spawn_options_env_fd_cb (G_GNUC_UNUSED const gchar *option_name,
+                                 const gchar *value,
+                                 gpointer data,
+                                 GError **error)
+{
+  FlatpakSpawnOptions *self = data;
+  g_autofree gchar *proc_filename = NULL;
+  g_autofree gchar *env_block = NULL;
+  gsize len;
+  guint64 fd;
+  gchar *endptr;
+
+  fd = g_ascii_strtoull (value, &endptr, 10);
+
+  if (endptr == NULL || *endptr != '\0' || fd > G_MAXINT)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "Not a valid file descriptor: %s", value);
+      return FALSE;
+    }
+
+  proc_filename = g_strdup_printf ("/proc/self/fd/%d", (int) fd);
+
+  if (!g_file_get_contents (proc_filename, &env_block, &len, error))
+    return FALSE;
+
+  if (!flatpak_spawn_options_add_env_block (self, env_block, len, error))
+    return FALSE;
+
+  if (fd >= 3)
+    close (fd);
+
+  return TRUE;
+}
+
+gboolean
+flatpak_spawn_options_sandbox_flag_cb (G_GNUC_UNUSED const gchar *option_name,
+                                       const gchar *value,
+                                       gpointer data,
+                                       GError **error)
+{
+  FlatpakSpawnOptions *self = data;
+  long val;
+  char *end;
+
+  if (strcmp (value, "share-display") == 0)
+    {
+      self->sandbox_flags |= FLATPAK_SPAWN_SANDBOX_FLAGS_SHARE_DISPLAY;
+      return TRUE;
+    }
+
+  if (strcmp (value, "share-sound") == 0)
+    {
+      self->sandbox_flags |= FLATPAK_SPAWN_SANDBOX_FLAGS_SHARE_SOUND;
+      return TRUE;
+    }
+
+  if (strcmp (value, "share-gpu") == 0)
+    {
+      self->sandbox_flags |= FLATPAK_SPAWN_SANDBOX_FLAGS_SHARE_GPU;
+      return TRUE;
+    }
+
+  if (strcmp (value, "allow-dbus") == 0)
+    {
+      self->sandbox_flags |= FLATPAK_SPAWN_SANDBOX_FLAGS_ALLOW_DBUS;
+      return TRUE;
+    }
+
+  if (strcmp (value, "allow-a11y") == 0)
+    {
+      self->sandbox_flags |= FLATPAK_SPAWN_SANDBOX_FLAGS_ALLOW_A11Y;
+      return TRUE;
+    }
+
+  val = strtol (value, &end, 10);
+  if (val > 0 && *end == 0)
+    {
+      self->sandbox_flags |= val;
+      return TRUE;
+    }
+
+  g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+               "Unknown sandbox flag %s", value);
+  return FALSE;
+}
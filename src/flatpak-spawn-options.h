@@ -0,0 +1,64 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_SPAWN_OPTIONS_H__
+#define __FLATPAK_SPAWN_OPTIONS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * The options of flatpak-spawn that can be repeated and build up state,
+ * rather than setting a single variable. The callbacks expect the
+ * FlatpakSpawnOptions as the GOptionGroup's user data. They are kept
+ * out of flatpak-spawn.c so that the fuzz targets can use them too.
+ */
+typedef struct
+{
+  GHashTable *env;        /* variable => value */
+  GHashTable *unset_env;  /* set of variables */
+  guint sandbox_flags;    /* FlatpakSpawnSandboxFlags */
+} FlatpakSpawnOptions;
+
+void     flatpak_spawn_options_init          (FlatpakSpawnOptions  *self);
+void     flatpak_spawn_options_clear         (FlatpakSpawnOptions  *self);
+gboolean flatpak_spawn_options_add_env_block (FlatpakSpawnOptions  *self,
+                                              const char           *env_block,
+                                              gsize                 len,
+                                              GError              **error);
+
+gboolean flatpak_spawn_options_env_cb          (const gchar  *option_name,
+                                                const gchar  *value,
+                                                gpointer      data,
+                                                GError      **error);
+gboolean flatpak_spawn_options_unset_env_cb    (const gchar  *option_name,
+                                                const gchar  *value,
+                                                gpointer      data,
+                                                GError      **error);
+gboolean flatpak_spawn_options_env_fd_cb       (const gchar  *option_name,
+                                                const gchar  *value,
+                                                gpointer      data,
+                                                GError      **error);
+gboolean flatpak_spawn_options_sandbox_flag_cb (const gchar  *option_name,
+                                                const gchar  *value,
+                                                gpointer      data,
+                                                GError      **error);
+
+G_END_DECLS
+
+#endif /* __FLATPAK_SPAWN_OPTIONS_H__ */
@@ -0,0 +1,739 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "backport-autoptr.h"
+#include "flatpak-spawn-paths.h"
+
+/*
+ * Each line of /proc/self/mountinfo says which directory (the root) of
+ * which filesystem (the device) is mounted where in the sandbox. The
+ * root is relative to the filesystem, not to the host's /, so it is
+ * only a host path once we know where the host mounts that filesystem.
+ * /.flatpak-info tells us the host paths of /app and /usr, which anchor
+ * their filesystems; any other mount of an anchored filesystem can then
+ * be translated, and the document portal is mounted at the same place
+ * on the host as in the sandbox. Everything else is left alone.
+ *
+ * The result is stored as a trie of path components, flattened so that
+ * the children of each node are contiguous and sorted, which can be
+ * searched directly in the mapped cache file.
+ */
+
+#define CACHE_MAGIC "FSP1"
+#define NO_HOST G_MAXUINT32
+
+typedef struct
+{
+  guint32 name_offset;
+  guint32 name_len;
+  guint32 host_offset;
+  guint32 host_len;
+  guint32 first_child;
+  guint32 n_children;
+} CacheNode;
+
+typedef struct
+{
+  char magic[4];
+  guint32 key_len;
+  guint32 n_nodes;
+  guint32 strings_len;
+  /* Followed by the key, padded to 4 bytes, the nodes and the strings */
+} CacheHeader;
+
+struct _FlatpakSpawnPathMap
+{
+  GBytes *bytes;
+  const CacheNode *nodes;
+  guint32 n_nodes;
+  const char *strings;
+  guint32 strings_len;
+};
+
+typedef struct
+{
+  char *device;
+  char *root;
+  char *mount_point;
+  char *fstype;
+} MountEntry;
+
+typedef struct _TrieNode TrieNode;
+
+struct _TrieNode
+{
+  char *name;
+  char *host;
+  GPtrArray *children;
+};
+
+static void
+mount_entry_free (MountEntry *entry)
+{
+  g_free (entry->device);
+  g_free (entry->root);
+  g_free (entry->mount_point);
+  g_free (entry->fstype);
+  g_free (entry);
+}
+
+static TrieNode *
+trie_node_new (const char *name,
+               gsize       len)
+{
+  TrieNode *node = g_new0 (TrieNode, 1);
+
+  node->name = g_strndup (name, len);
+  return node;
+}
+
+static void
+trie_node_free (TrieNode *node)
+{
+  if (node->children != NULL)
+    g_ptr_array_unref (node->children);
+
+  g_free (node->name);
+  g_free (node->host);
+  g_free (node);
+}
+
+/* A later mount of the same directory hides the earlier one, so the
+ * last insertion wins */
+static void
+trie_insert (TrieNode   *root,
+             const char *path,
+             const char *host)
+{
+  TrieNode *node = root;
+  const char *p = path;
+
+  while (*p != '\0')
+    {
+      const char *end;
+      TrieNode *child = NULL;
+      guint i;
+
+      if (*p == '/')
+        {
+          p++;
+          continue;
+        }
+
+      end = strchrnul (p, '/');
+
+      if (node->children == NULL)
+        node->children = g_ptr_array_new_with_free_func ((GDestroyNotify) trie_node_free);
+
+      for (i = 0; i < node->children->len; i++)
+        {
+          TrieNode *candidate = g_ptr_array_index (node->children, i);
+
+          if (strlen (candidate->name) == (gsize) (end - p) &&
+              strncmp (candidate->name, p, end - p) == 0)
+            {
+              child = candidate;
+              break;
+            }
+        }
+
+      if (child == NULL)
+        {
+          child = trie_node_new (p, end - p);
+          g_ptr_array_add (node->children, child);
+        }
+
+      node = child;
+      p = end;
+    }
+
+  g_free (node->host);
+  node->host = g_strdup (host);
+}
+
+static gint
+trie_node_compare (gconstpointer a,
+                   gconstpointer b)
+{
+  const TrieNode *x = *(const TrieNode * const *) a;
+  const TrieNode *y = *(const TrieNode * const *) b;
+
+  return strcmp (x->name, y->name);
+}
+
+static guint32
+add_string (GString    *strings,
+            const char *s)
+{
+  guint32 offset = strings->len;
+
+  g_string_append (strings, s);
+  return offset;
+}
+
+/* Numbers the nodes breadth-first, so that siblings are adjacent */
+static GBytes *
+trie_serialize (TrieNode   *root,
+                const char *key)
+{
+  g_autoptr(GPtrArray) queue = g_ptr_array_new ();
+  g_autoptr(GArray) nodes = g_array_new (FALSE, TRUE, sizeof (CacheNode));
+  g_autoptr(GString) strings = g_string_new ("");
+  CacheHeader header;
+  GByteArray *out;
+  static const guint8 padding[4] = { 0 };
+  guint32 key_len = strlen (key);
+  guint i;
+
+  g_ptr_array_add (queue, root);
+  g_array_set_size (nodes, 1);
+
+  for (i = 0; i < queue->len; i++)
+    {
+      TrieNode *node = g_ptr_array_index (queue, i);
+      CacheNode *out_node = &g_array_index (nodes, CacheNode, i);
+      guint j;
+
+      out_node->name_offset = add_string (strings, node->name);
+      out_node->name_len = strlen (node->name);
+
+      if (node->host != NULL)
+        {
+          out_node->host_offset = add_string (strings, node->host);
+          out_node->host_len = strlen (node->host);
+        }
+      else
+        {
+          out_node->host_offset = NO_HOST;
+        }
+
+      if (node->children == NULL || node->children->len == 0)
+        continue;
+
+      g_ptr_array_sort (node->children, trie_node_compare);
+      out_node->first_child = queue->len;
+      out_node->n_children = node->children->len;
+
+      for (j = 0; j < node->children->len; j++)
+        g_ptr_array_add (queue, g_ptr_array_index (node->children, j));
+
+      /* This may move the array, so out_node is not used after it */
+      g_array_set_size (nodes, queue->len);
+    }
+
+  memcpy (header.magic, CACHE_MAGIC, sizeof (header.magic));
+  header.key_len = key_len;
+  header.n_nodes = nodes->len;
+  header.strings_len = strings->len;
+
+  out = g_byte_array_new ();
+  g_byte_array_append (out, (const guint8 *) &header, sizeof (header));
+  g_byte_array_append (out, (const guint8 *) key, key_len);
+  g_byte_array_append (out, padding, (4 - key_len % 4) % 4);
+  g_byte_array_append (out, (const guint8 *) nodes->data,
+                       nodes->len * sizeof (CacheNode));
+  g_byte_array_append (out, (const guint8 *) strings->str, strings->len);
+
+  return g_byte_array_free_to_bytes (out);
+}
+
+/* Checks that @bytes is a well-formed cache for @key. Nothing in it is
+ * trusted otherwise, since anything in the sandbox could have written
+ * it. */
+static FlatpakSpawnPathMap *
+path_map_new_from_bytes (GBytes     *bytes,
+                         const char *key)
+{
+  FlatpakSpawnPathMap *self;
+  const guint8 *data;
+  CacheHeader header;
+  gsize len;
+  gsize key_padded;
+  guint32 i;
+
+  data = g_bytes_get_data (bytes, &len);
+
+  if (len < sizeof (header))
+    return NULL;
+
+  memcpy (&header, data, sizeof (header));
+  key_padded = header.key_len + (4 - header.key_len % 4) % 4;
+
+  if (memcmp (header.magic, CACHE_MAGIC, sizeof (header.magic)) != 0 ||
+      header.key_len != strlen (key) ||
+      header.n_nodes == 0 ||
+      key_padded > len - sizeof (header) ||
+      header.n_nodes > (len - sizeof (header) - key_padded) / sizeof (CacheNode) ||
+      header.strings_len != len - sizeof (header) - key_padded - header.n_nodes * sizeof (CacheNode) ||
+      memcmp (data + sizeof (header), key, header.key_len) != 0)
+    return NULL;
+
+  self = g_new0 (FlatpakSpawnPathMap, 1);
+  self->bytes = g_bytes_ref (bytes);
+  self->nodes = (const CacheNode *) (data + sizeof (header) + key_padded);
+  self->n_nodes = header.n_nodes;
+  self->strings = (const char *) (self->nodes + header.n_nodes);
+  self->strings_len = header.strings_len;
+
+  for (i = 0; i < self->n_nodes; i++)
+    {
+      const CacheNode *node = &self->nodes[i];
+
+      if (node->name_offset > self->strings_len ||
+          node->name_len > self->strings_len - node->name_offset ||
+          (node->host_offset != NO_HOST &&
+           (node->host_offset > self->strings_len ||
+            node->host_len > self->strings_len - node->host_offset)) ||
+          (node->n_children > 0 &&
+           (node->first_child <= i ||
+            node->first_child > self->n_nodes ||
+            node->n_children > self->n_nodes - node->first_child)))
+        {
+          flatpak_spawn_path_map_free (self);
+          return NULL;
+        }
+    }
+
+  return self;
+}
+
+/* Undoes the octal escapes that mountinfo uses for spaces and the like */
+static char *
+unescape_mountinfo (const char *s)
+{
+  GString *out = g_string_sized_new (strlen (s));
+
+  while (*s != '\0')
+    {
+      if (s[0] == '\\' &&
+          s[1] >= '0' && s[1] <= '3' &&
+          s[2] >= '0' && s[2] <= '7' &&
+          s[3] >= '0' && s[3] <= '7')
+        {
+          g_string_append_c (out, ((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0'));
+          s += 4;
+        }
+      else
+        {
+          g_string_append_c (out, *s++);
+        }
+    }
+
+  return g_string_free (out, FALSE);
+}
+
+static GPtrArray *
+parse_mountinfo (const char *contents)
+{
+  GPtrArray *entries = g_ptr_array_new_with_free_func ((GDestroyNotify) mount_entry_free);
+  g_auto(GStrv) lines = g_strsplit (contents, "\n", -1);
+  gsize i;
+
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      g_auto(GStrv) fields = g_strsplit (lines[i], " ", -1);
+      MountEntry *entry;
+      gsize n = g_strv_length (fields);
+      gsize sep;
+
+      /* ID PARENT MAJ:MIN ROOT MOUNT-POINT OPTIONS [OPTIONAL...] - TYPE ... */
+      for (sep = 6; sep < n; sep++)
+        {
+          if (strcmp (fields[sep], "-") == 0)
+            break;
+        }
+
+      if (n < 6 || sep + 1 >= n)
+        continue;
+
+      entry = g_new0 (MountEntry, 1);
+      entry->device = g_strdup (fields[2]);
+      entry->root = unescape_mountinfo (fields[3]);
+      entry->mount_point = unescape_mountinfo (fields[4]);
+      entry->fstype = g_strdup (fields[sep + 1]);
+      g_ptr_array_add (entries, entry);
+    }
+
+  return entries;
+}
+
+/* If @host ends with @root, returns the rest: where the host mounts the
+ * filesystem of which @root is a directory */
+static char *
+host_mount_prefix (const char *host,
+                   const char *root)
+{
+  gsize host_len = strlen (host);
+  gsize root_len;
+
+  if (strcmp (root, "/") == 0)
+    return g_strdup (host);
+
+  root_len = strlen (root);
+
+  if (root_len > host_len ||
+      strcmp (host + host_len - root_len, root) != 0 ||
+      (root_len < host_len && root[0] != '/'))
+    return NULL;
+
+  return g_strndup (host, host_len - root_len);
+}
+
+static char *
+join_host_path (const char *prefix,
+                const char *root)
+{
+  if (strcmp (root, "/") == 0)
+    return g_strdup (prefix[0] == '\0' ? "/" : prefix);
+
+  return g_strconcat (prefix, root, NULL);
+}
+
+static MountEntry *
+find_mount (GPtrArray  *entries,
+            const char *mount_point)
+{
+  guint i;
+
+  for (i = entries->len; i > 0; i--)
+    {
+      MountEntry *entry = g_ptr_array_index (entries, i - 1);
+
+      if (strcmp (entry->mount_point, mount_point) == 0)
+        return entry;
+    }
+
+  return NULL;
+}
+
+static GBytes *
+build_map (const char *flatpak_info_path,
+           const char *mountinfo_path,
+           const char *key,
+           GError    **error)
+{
+  static const struct {
+    const char *mount_point;
+    const char *key;
+  } anchors[] = {
+    { "/app", "app-path" },
+    { "/usr", "runtime-path" },
+  };
+  g_autoptr(GKeyFile) info = g_key_file_new ();
+  g_autoptr(GHashTable) prefixes = NULL;  /* device => host mount point */
+  g_autoptr(GPtrArray) entries = NULL;
+  g_autofree char *contents = NULL;
+  TrieNode *root;
+  GBytes *bytes;
+  gsize i;
+
+  if (!g_file_get_contents (mountinfo_path, &contents, NULL, error))
+    return NULL;
+
+  entries = parse_mountinfo (contents);
+  prefixes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  root = trie_node_new ("", 0);
+  trie_insert (root, "/", "/");
+
+  /* Not being in a Flatpak sandbox is not an error: nothing will be
+   * translated */
+  if (!g_key_file_load_from_file (info, flatpak_info_path, G_KEY_FILE_NONE, NULL))
+    g_debug ("Unable to load %s, not translating /app or /usr", flatpak_info_path);
+
+  for (i = 0; i < G_N_ELEMENTS (anchors); i++)
+    {
+      g_autofree char *host = g_key_file_get_string (info, "Instance", anchors[i].key, NULL);
+      MountEntry *entry = find_mount (entries, anchors[i].mount_point);
+      char *prefix;
+
+      if (host == NULL || host[0] != '/' || entry == NULL)
+        continue;
+
+      prefix = host_mount_prefix (host, entry->root);
+
+      if (prefix != NULL)
+        g_hash_table_replace (prefixes, g_strdup (entry->device), prefix);
+    }
+
+  for (i = 0; i < entries->len; i++)
+    {
+      MountEntry *entry = g_ptr_array_index (entries, i);
+      g_autofree char *host = NULL;
+      const char *prefix;
+
+      if (entry->mount_point[0] != '/')
+        continue;
+
+      if (strcmp (entry->fstype, "fuse.portal") == 0)
+        {
+          /* The document portal: the host has the whole filesystem at
+           * the same place, and we see a subdirectory of it */
+          host = join_host_path (entry->mount_point, entry->root);
+        }
+      else if ((prefix = g_hash_table_lookup (prefixes, entry->device)) != NULL)
+        {
+          host = join_host_path (prefix, entry->root);
+        }
+      else
+        {
+          /* Unknown, or private to the sandbox: leave anything under it
+           * as it is, even if something above it is translated */
+          host = g_strdup (entry->mount_point);
+        }
+
+      trie_insert (root, entry->mount_point, host);
+    }
+
+  /* /.flatpak-info is more authoritative than any guesswork */
+  for (i = 0; i < G_N_ELEMENTS (anchors); i++)
+    {
+      g_autofree char *host = g_key_file_get_string (info, "Instance", anchors[i].key, NULL);
+
+      if (host != NULL && host[0] == '/')
+        trie_insert (root, anchors[i].mount_point, host);
+    }
+
+  bytes = trie_serialize (root, key);
+  trie_node_free (root);
+  return bytes;
+}
+
+/* Identifies what the map was built from: any change to the mount
+ * namespace or to /.flatpak-info makes the cache stale */
+static char *
+cache_key (const char *flatpak_info_path,
+           const char *mountinfo_path)
+{
+  g_autofree char *ns = g_file_read_link ("/proc/self/ns/mnt", NULL);
+  struct stat st;
+
+  if (stat (flatpak_info_path, &st) != 0)
+    memset (&st, 0, sizeof (st));
+
+  return g_strdup_printf ("%s %s %s %" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT,
+                          ns != NULL ? ns : "-",
+                          flatpak_info_path,
+                          mountinfo_path,
+                          (guint64) st.st_dev,
+                          (guint64) st.st_ino,
+                          (gint64) st.st_mtime);
+}
+
+/**
+ * flatpak_spawn_path_map_load:
+ * @cache_path: (nullable): where to keep the map between calls
+ * @flatpak_info_path: normally /.flatpak-info
+ * @mountinfo_path: normally /proc/self/mountinfo
+ * @error: return location for an error
+ *
+ * Loads the map from @cache_path if it is still valid, or builds it and
+ * saves it there.
+ *
+ * Returns: (transfer full): the map, or %NULL if the mount table could
+ *  not be read
+ */
+FlatpakSpawnPathMap *
+flatpak_spawn_path_map_load (const char  *cache_path,
+                             const char  *flatpak_info_path,
+                             const char  *mountinfo_path,
+                             GError     **error)
+{
+  g_autofree char *key = cache_key (flatpak_info_path, mountinfo_path);
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) local_error = NULL;
+  FlatpakSpawnPathMap *self;
+
+  if (cache_path != NULL)
+    {
+      g_autoptr(GMappedFile) mapped = g_mapped_file_new (cache_path, FALSE, NULL);
+
+      if (mapped != NULL)
+        {
+          bytes = g_mapped_file_get_bytes (mapped);
+          self = path_map_new_from_bytes (bytes, key);
+
+          if (self != NULL)
+            return self;
+
+          g_debug ("Path translation cache %s is stale", cache_path);
+          g_clear_pointer (&bytes, g_bytes_unref);
+        }
+    }
+
+  bytes = build_map (flatpak_info_path, mountinfo_path, key, error);
+
+  if (bytes == NULL)
+    return NULL;
+
+  if (cache_path != NULL &&
+      !g_file_set_contents (cache_path, g_bytes_get_data (bytes, NULL),
+                            g_bytes_get_size (bytes), &local_error))
+    g_debug ("Unable to save path translation cache: %s", local_error->message);
+
+  self = path_map_new_from_bytes (bytes, key);
+  g_assert (self != NULL);
+  return self;
+}
+
+static const CacheNode *
+find_child (FlatpakSpawnPathMap *self,
+            const CacheNode     *node,
+            const char          *name,
+            gsize                len)
+{
+  guint32 lo = node->first_child;
+  guint32 hi = node->first_child + node->n_children;
+
+  while (lo < hi)
+    {
+      guint32 mid = lo + (hi - lo) / 2;
+      const CacheNode *child = &self->nodes[mid];
+      int cmp = strncmp (self->strings + child->name_offset, name,
+                         MIN (child->name_len, len));
+
+      if (cmp == 0)
+        cmp = (child->name_len > len) - (child->name_len < len);
+
+      if (cmp == 0)
+        return child;
+
+      if (cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return NULL;
+}
+
+/**
+ * flatpak_spawn_path_map_translate:
+ * @self: a map
+ * @path: an absolute path in the sandbox
+ *
+ * Returns: (transfer full): the same file's path on the host, or a copy
+ *  of @path if it is not known to be different
+ */
+char *
+flatpak_spawn_path_map_translate (FlatpakSpawnPathMap *self,
+                                  const char          *path)
+{
+  const CacheNode *node = &self->nodes[0];
+  const CacheNode *best = NULL;
+  const char *best_end = path;
+  const char *p = path;
+  const char *host;
+
+  if (path[0] != '/')
+    return g_strdup (path);
+
+  if (node->host_offset != NO_HOST)
+    best = node;
+
+  while (*p != '\0')
+    {
+      const char *end;
+
+      if (*p == '/')
+        {
+          p++;
+          continue;
+        }
+
+      end = strchrnul (p, '/');
+      node = find_child (self, node, p, end - p);
+
+      if (node == NULL)
+        break;
+
+      if (node->host_offset != NO_HOST)
+        {
+          best = node;
+          best_end = end;
+        }
+
+      p = end;
+    }
+
+  if (best == NULL)
+    return g_strdup (path);
+
+  host = self->strings + best->host_offset;
+
+  /* Don't turn /foo into //foo */
+  if (best->host_len == 1 && host[0] == '/' && best_end[0] == '/')
+    return g_strdup (best_end);
+
+  if (best_end[0] == '\0' && best->host_len == 0)
+    return g_strdup ("/");
+
+  return g_strdup_printf ("%.*s%s", (int) best->host_len, host, best_end);
+}
+
+/**
+ * flatpak_spawn_path_map_translate_args:
+ * @self: a map
+ * @argv: (array zero-terminated=1) (inout): a command and its arguments
+ * @allocated: the new strings are added to this, which must free them
+ *
+ * Replaces each absolute path among the arguments in @argv with the
+ * same file's path on the host. The command itself is left as given:
+ * /usr/bin/make should be the host's make, not the runtime's run
+ * against the host's libraries. Relative arguments are relative to the
+ * working directory, so they don't need rewriting.
+ */
+void
+flatpak_spawn_path_map_translate_args (FlatpakSpawnPathMap  *self,
+                                       char                **argv,
+                                       GPtrArray            *allocated)
+{
+  gsize i;
+
+  if (argv[0] == NULL)
+    return;
+
+  for (i = 1; argv[i] != NULL; i++)
+    {
+      char *host_arg;
+
+      if (argv[i][0] != '/')
+        continue;
+
+      host_arg = flatpak_spawn_path_map_translate (self, argv[i]);
+      g_ptr_array_add (allocated, host_arg);
+      argv[i] = host_arg;
+    }
+}
+
+void
+flatpak_spawn_path_map_free (FlatpakSpawnPathMap *self)
+{
+  if (self == NULL)
+    return;
+
+  g_bytes_unref (self->bytes);
+  g_free (self);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_SPAWN_PATHS_H__
+#define __FLATPAK_SPAWN_PATHS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Maps paths in the sandbox to the same files' paths on the host, for
+ * flatpak-spawn --host --translate-paths. The map is built from the
+ * sandbox's mount table and /.flatpak-info, and saved as a prefix trie
+ * that later calls can use without reading either again.
+ */
+typedef struct _FlatpakSpawnPathMap FlatpakSpawnPathMap;
+
+FlatpakSpawnPathMap *flatpak_spawn_path_map_load      (const char           *cache_path,
+                                                       const char           *flatpak_info_path,
+                                                       const char           *mountinfo_path,
+                                                       GError              **error);
+char                *flatpak_spawn_path_map_translate (FlatpakSpawnPathMap  *self,
+                                                       const char           *path);
+void                 flatpak_spawn_path_map_translate_args (FlatpakSpawnPathMap  *self,
+                                                            char                **argv,
+                                                            GPtrArray            *allocated);
+void                 flatpak_spawn_path_map_free      (FlatpakSpawnPathMap  *self);
+
+#ifdef G_DEFINE_AUTOPTR_CLEANUP_FUNC
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakSpawnPathMap, flatpak_spawn_path_map_free)
+#endif
+
+G_END_DECLS
+
+#endif /* __FLATPAK_SPAWN_PATHS_H__ */
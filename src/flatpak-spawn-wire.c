@@ -0,0 +1,1651 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Only for the error domains: nothing here uses GObject */
+#include <gio/gio.h>
+
+#include "backport-autoptr.h"
+#include "flatpak-portal.h"
+#include "flatpak-session-helper.h"
+#include "flatpak-spawn-wire.h"
+
+/*
+ * See the "Message Protocol" section of the D-Bus Specification. We
+ * only ever send method calls, and errors in reply to calls made to
+ * us, with everything in our native byte order, and only look at the
+ * header fields and bodies of the few replies and signals we expect.
+ */
+
+#define DBUS_SERVICE_DBUS "org.freedesktop.DBus"
+#define DBUS_PATH_DBUS "/org/freedesktop/DBus"
+#define DBUS_INTERFACE_DBUS DBUS_SERVICE_DBUS
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define NATIVE_ENDIANNESS 'l'
+#else
+#define NATIVE_ENDIANNESS 'B'
+#endif
+
+/* The maximum length of a message, and so of its header and body */
+#define MAX_MESSAGE_LENGTH (128 * 1024 * 1024)
+/* Auth lines are short; anything longer is not a D-Bus server */
+#define MAX_AUTH_LINE_LENGTH 16384
+/* The maximum depth of arrays and structs within a single type */
+#define MAX_TYPE_DEPTH 64
+
+typedef enum {
+  MESSAGE_TYPE_METHOD_CALL = 1,
+  MESSAGE_TYPE_METHOD_RETURN = 2,
+  MESSAGE_TYPE_ERROR = 3,
+  MESSAGE_TYPE_SIGNAL = 4,
+} MessageType;
+
+#define MESSAGE_FLAG_NO_REPLY_EXPECTED 0x1
+
+typedef enum {
+  FIELD_PATH = 1,
+  FIELD_INTERFACE = 2,
+  FIELD_MEMBER = 3,
+  FIELD_ERROR_NAME = 4,
+  FIELD_REPLY_SERIAL = 5,
+  FIELD_DESTINATION = 6,
+  FIELD_SENDER = 7,
+  FIELD_SIGNATURE = 8,
+  FIELD_UNIX_FDS = 9,
+} HeaderField;
+
+typedef struct {
+  const char *bus_name;
+  const char *obj_path;
+  const char *iface;
+  const char *spawn_method;
+  const char *spawn_signature;
+  const char *signal_method;
+  const char *exited_signal;
+} WireService;
+
+static const WireService portal_service = {
+  FLATPAK_PORTAL_BUS_NAME,
+  FLATPAK_PORTAL_PATH,
+  FLATPAK_PORTAL_INTERFACE,
+  "Spawn",
+  "ayaaya{uh}a{ss}ua{sv}",
+  "SpawnSignal",
+  "SpawnExited",
+};
+
+static const WireService host_service = {
+  FLATPAK_SESSION_HELPER_BUS_NAME,
+  FLATPAK_SESSION_HELPER_PATH_DEVELOPMENT,
+  FLATPAK_SESSION_HELPER_INTERFACE_DEVELOPMENT,
+  "HostCommand",
+  "ayaaya{uh}a{ss}u",
+  "HostCommandSignal",
+  "HostCommandExited",
+};
+
+struct _FlatpakSpawnWire
+{
+  int fd;
+  GByteArray *in;
+  guint32 next_serial;
+  const WireService *service;
+  /* Unique name of the service, taken from the Spawn reply, so that
+   * nobody else can fake our child's exit */
+  char *service_owner;
+  guint32 pid;
+  gboolean exited;
+  int wait_status;
+  GError *vanished;
+  /* g_get_monotonic_time() by which replies must arrive, or 0 */
+  gint64 deadline;
+};
+
+typedef struct
+{
+  guint8 type;
+  guint8 flags;
+  guint32 serial;
+  guint32 reply_serial;
+  const char *path;
+  const char *interface;
+  const char *member;
+  const char *error_name;
+  const char *sender;
+  const char *signature;
+  const guint8 *body;
+  gsize body_len;
+  gboolean swap;
+} WireMessage;
+
+/* Serialization */
+
+static void
+write_align (GByteArray *buf,
+             guint       alignment)
+{
+  static const guint8 zeroes[8] = { 0 };
+
+  g_byte_array_append (buf, zeroes, (alignment - buf->len % alignment) % alignment);
+}
+
+static void
+write_byte (GByteArray *buf,
+            guint8      value)
+{
+  g_byte_array_append (buf, &value, 1);
+}
+
+static void
+write_uint32 (GByteArray *buf,
+              guint32     value)
+{
+  write_align (buf, 4);
+  g_byte_array_append (buf, (const guint8 *) &value, sizeof (value));
+}
+
+static void
+write_string (GByteArray *buf,
+              const char *value)
+{
+  gsize len = strlen (value);
+
+  write_uint32 (buf, len);
+  g_byte_array_append (buf, (const guint8 *) value, len + 1);
+}
+
+static void
+write_signature (GByteArray *buf,
+                 const char *value)
+{
+  gsize len = strlen (value);
+
+  write_byte (buf, len);
+  g_byte_array_append (buf, (const guint8 *) value, len + 1);
+}
+
+/* As for g_variant_new_bytestring(), the trailing nul is part of the
+ * array */
+static void
+write_bytestring (GByteArray *buf,
+                  const char *value)
+{
+  gsize len = strlen (value) + 1;
+
+  write_uint32 (buf, len);
+  g_byte_array_append (buf, (const guint8 *) value, len);
+}
+
+typedef struct
+{
+  guint length_offset;
+  guint start;
+} WireArray;
+
+static void
+write_array_open (GByteArray *buf,
+                  guint       element_alignment,
+                  WireArray  *array)
+{
+  write_uint32 (buf, 0);
+  array->length_offset = buf->len - 4;
+  /* The padding before the first element is there even if there are no
+   * elements, and is not included in the length */
+  write_align (buf, element_alignment);
+  array->start = buf->len;
+}
+
+static void
+write_array_close (GByteArray      *buf,
+                   const WireArray *array)
+{
+  guint32 length = buf->len - array->start;
+
+  memcpy (buf->data + array->length_offset, &length, sizeof (length));
+}
+
+static void
+write_field (GByteArray  *buf,
+             HeaderField  code,
+             const char  *type,
+             const char  *value)
+{
+  write_align (buf, 8);
+  write_byte (buf, code);
+  write_signature (buf, type);
+
+  if (type[0] == 'g')
+    write_signature (buf, value);
+  else
+    write_string (buf, value);
+}
+
+static void
+write_field_uint32 (GByteArray  *buf,
+                    HeaderField  code,
+                    guint32      value)
+{
+  write_align (buf, 8);
+  write_byte (buf, code);
+  write_signature (buf, "u");
+  write_uint32 (buf, value);
+}
+
+/* Starts a message, leaving the header fields array open for the
+ * caller to fill in */
+static GByteArray *
+message_open (FlatpakSpawnWire *self,
+              MessageType       type,
+              guint8            flags,
+              const GByteArray *body,
+              WireArray        *fields,
+              guint32          *serial_out)
+{
+  GByteArray *buf = g_byte_array_new ();
+  guint32 serial = self->next_serial++;
+
+  write_byte (buf, NATIVE_ENDIANNESS);
+  write_byte (buf, type);
+  write_byte (buf, flags);
+  write_byte (buf, 1);  /* protocol version */
+  write_uint32 (buf, body != NULL ? body->len : 0);
+  write_uint32 (buf, serial);
+
+  write_array_open (buf, 8, fields);
+
+  if (serial_out != NULL)
+    *serial_out = serial;
+
+  return buf;
+}
+
+static GByteArray *
+message_close (GByteArray       *buf,
+               const WireArray  *fields,
+               const GByteArray *body)
+{
+  write_array_close (buf, fields);
+  write_align (buf, 8);
+
+  if (body != NULL)
+    g_byte_array_append (buf, body->data, body->len);
+
+  return buf;
+}
+
+/* Bodies are built separately, starting at offset 0: that gives the
+ * same alignment as in the message, where the body starts on an
+ * 8-byte boundary */
+static GByteArray *
+method_call_new (FlatpakSpawnWire *self,
+                 guint8            flags,
+                 const char       *destination,
+                 const char       *path,
+                 const char       *interface,
+                 const char       *member,
+                 const char       *signature,
+                 const GByteArray *body,
+                 guint             n_fds,
+                 guint32          *serial_out)
+{
+  GByteArray *buf;
+  WireArray fields;
+
+  buf = message_open (self, MESSAGE_TYPE_METHOD_CALL, flags, body,
+                      &fields, serial_out);
+  write_field (buf, FIELD_PATH, "o", path);
+  write_field (buf, FIELD_INTERFACE, "s", interface);
+  write_field (buf, FIELD_MEMBER, "s", member);
+  write_field (buf, FIELD_DESTINATION, "s", destination);
+
+  if (signature != NULL)
+    write_field (buf, FIELD_SIGNATURE, "g", signature);
+
+  if (n_fds > 0)
+    write_field_uint32 (buf, FIELD_UNIX_FDS, n_fds);
+
+  return message_close (buf, &fields, body);
+}
+
+static GByteArray *
+error_new (FlatpakSpawnWire *self,
+           const char       *destination,
+           guint32           reply_serial,
+           const char       *error_name,
+           const char       *text)
+{
+  g_autoptr(GByteArray) body = g_byte_array_new ();
+  GByteArray *buf;
+  WireArray fields;
+
+  write_string (body, text);
+
+  buf = message_open (self, MESSAGE_TYPE_ERROR, MESSAGE_FLAG_NO_REPLY_EXPECTED,
+                      body, &fields, NULL);
+  write_field (buf, FIELD_ERROR_NAME, "s", error_name);
+  write_field_uint32 (buf, FIELD_REPLY_SERIAL, reply_serial);
+
+  if (destination != NULL)
+    write_field (buf, FIELD_DESTINATION, "s", destination);
+
+  write_field (buf, FIELD_SIGNATURE, "g", "s");
+  return message_close (buf, &fields, body);
+}
+
+/* Deserialization */
+
+typedef struct
+{
+  const guint8 *data;
+  gsize len;
+  gsize pos;
+  gboolean swap;
+} Reader;
+
+static gboolean
+read_align (Reader *r,
+            gsize   alignment)
+{
+  gsize pos = (r->pos + alignment - 1) & ~(alignment - 1);
+
+  if (pos > r->len)
+    return FALSE;
+
+  r->pos = pos;
+  return TRUE;
+}
+
+static gboolean
+read_byte (Reader *r,
+           guint8 *value)
+{
+  if (r->pos >= r->len)
+    return FALSE;
+
+  *value = r->data[r->pos++];
+  return TRUE;
+}
+
+static gboolean
+read_uint32 (Reader  *r,
+             guint32 *value)
+{
+  guint32 v;
+
+  if (!read_align (r, 4) || r->len - r->pos < sizeof (v))
+    return FALSE;
+
+  memcpy (&v, r->data + r->pos, sizeof (v));
+  r->pos += sizeof (v);
+  *value = r->swap ? GUINT32_SWAP_LE_BE (v) : v;
+  return TRUE;
+}
+
+static gboolean
+read_string (Reader      *r,
+             const char **value)
+{
+  guint32 len;
+
+  if (!read_uint32 (r, &len) ||
+      r->len - r->pos <= len ||
+      r->data[r->pos + len] != '\0')
+    return FALSE;
+
+  *value = (const char *) r->data + r->pos;
+  r->pos += len + 1;
+  return TRUE;
+}
+
+static gboolean
+read_signature (Reader      *r,
+                const char **value)
+{
+  guint8 len;
+
+  if (!read_byte (r, &len) ||
+      r->len - r->pos <= len ||
+      r->data[r->pos + len] != '\0')
+    return FALSE;
+
+  *value = (const char *) r->data + r->pos;
+  r->pos += len + 1;
+  return TRUE;
+}
+
+static gsize
+type_alignment (char type)
+{
+  switch (type)
+    {
+      case 'n':
+      case 'q':
+        return 2;
+
+      case 'b':
+      case 'i':
+      case 'u':
+      case 'h':
+      case 's':
+      case 'o':
+      case 'a':
+        return 4;
+
+      case 'x':
+      case 't':
+      case 'd':
+      case '(':
+      case '{':
+        return 8;
+
+      default:
+        return 1;
+    }
+}
+
+/* Moves @signature past one complete type */
+static gboolean
+signature_skip_type (const char **signature,
+                     guint        depth)
+{
+  char end;
+
+  if (depth > MAX_TYPE_DEPTH)
+    return FALSE;
+
+  switch (**signature)
+    {
+      case 'a':
+        (*signature)++;
+        return signature_skip_type (signature, depth + 1);
+
+      case '(':
+      case '{':
+        end = (**signature == '(') ? ')' : '}';
+        (*signature)++;
+
+        while (**signature != end)
+          {
+            if (!signature_skip_type (signature, depth + 1))
+              return FALSE;
+          }
+
+        (*signature)++;
+        return TRUE;
+
+      case '\0':
+        return FALSE;
+
+      default:
+        if (strchr ("ybnqiuxtdsoghv", **signature) == NULL)
+          return FALSE;
+
+        (*signature)++;
+        return TRUE;
+    }
+}
+
+static gboolean
+read_skip (Reader *r,
+           gsize   len)
+{
+  if (r->len - r->pos < len)
+    return FALSE;
+
+  r->pos += len;
+  return TRUE;
+}
+
+/* Skips a value of the first complete type in @signature, moving
+ * @signature past it. Only the framing is checked, not the contents. */
+static gboolean
+skip_value (Reader      *r,
+            const char **signature,
+            guint        depth)
+{
+  const char *type = *signature;
+  const char *value;
+  guint32 len;
+
+  if (!signature_skip_type (signature, depth))
+    return FALSE;
+
+  switch (type[0])
+    {
+      case 's':
+      case 'o':
+        return read_string (r, &value);
+
+      case 'g':
+        return read_signature (r, &value);
+
+      case 'v':
+        {
+          const char *inner;
+
+          return read_signature (r, &inner) &&
+                 skip_value (r, &inner, depth + 1) &&
+                 *inner == '\0';
+        }
+
+      case 'a':
+        return read_uint32 (r, &len) &&
+               read_align (r, type_alignment (type[1])) &&
+               read_skip (r, len);
+
+      case '(':
+      case '{':
+        if (!read_align (r, 8))
+          return FALSE;
+
+        type++;
+
+        while (type < *signature - 1)
+          {
+            if (!skip_value (r, &type, depth + 1))
+              return FALSE;
+          }
+
+        return TRUE;
+
+      default:
+        /* Fixed-size types are as big as their alignment */
+        return read_align (r, type_alignment (type[0])) &&
+               read_skip (r, type_alignment (type[0]));
+    }
+}
+
+static void
+message_body_reader (const WireMessage *message,
+                     Reader            *r)
+{
+  r->data = message->body;
+  r->len = message->body_len;
+  r->pos = 0;
+  r->swap = message->swap;
+}
+
+/* Returns the length of the first message in @data, 0 if it is not
+ * complete yet, or -1 if it is invalid */
+static gssize
+parse_message (const guint8 *data,
+               gsize         len,
+               WireMessage  *message)
+{
+  Reader r = { data, len, 0, FALSE };
+  guint32 body_len, fields_len;
+  gsize header_len;
+
+  if (len < 16)
+    return 0;
+
+  if (data[0] != 'l' && data[0] != 'B')
+    return -1;
+
+  memset (message, 0, sizeof (*message));
+  r.swap = (data[0] != NATIVE_ENDIANNESS);
+  message->swap = r.swap;
+  message->type = data[1];
+  message->flags = data[2];
+  r.pos = 4;
+
+  if (!read_uint32 (&r, &body_len) ||
+      !read_uint32 (&r, &message->serial) ||
+      !read_uint32 (&r, &fields_len))
+    return -1;
+
+  if (body_len > MAX_MESSAGE_LENGTH || fields_len > MAX_MESSAGE_LENGTH)
+    return -1;
+
+  header_len = (16 + fields_len + 7) & ~(gsize) 7;
+
+  if (len < header_len + body_len)
+    return 0;
+
+  r.len = 16 + fields_len;
+
+  while (r.pos < r.len)
+    {
+      const char *type;
+      guint8 code;
+
+      if (!read_align (&r, 8) ||
+          !read_byte (&r, &code) ||
+          !read_signature (&r, &type))
+        return -1;
+
+      if (strcmp (type, "s") == 0 || strcmp (type, "o") == 0 ||
+          strcmp (type, "g") == 0)
+        {
+          const char *value;
+
+          if (type[0] == 'g' ? !read_signature (&r, &value) : !read_string (&r, &value))
+            return -1;
+
+          switch (code)
+            {
+              case FIELD_PATH:
+                message->path = value;
+                break;
+
+              case FIELD_INTERFACE:
+                message->interface = value;
+                break;
+
+              case FIELD_MEMBER:
+                message->member = value;
+                break;
+
+              case FIELD_ERROR_NAME:
+                message->error_name = value;
+                break;
+
+              case FIELD_SENDER:
+                message->sender = value;
+                break;
+
+              case FIELD_SIGNATURE:
+                message->signature = value;
+                break;
+
+              default:
+                break;
+            }
+        }
+      else if (strcmp (type, "u") == 0)
+        {
+          guint32 value;
+
+          if (!read_uint32 (&r, &value))
+            return -1;
+
+          if (code == FIELD_REPLY_SERIAL)
+            message->reply_serial = value;
+        }
+      else
+        {
+          /* A field added to the specification since this was
+           * written: as the specification requires, ignore it */
+          const char *signature = type;
+
+          if (!skip_value (&r, &signature, 0) || *signature != '\0')
+            return -1;
+        }
+    }
+
+  message->body = data + header_len;
+  message->body_len = body_len;
+
+  if (message->signature == NULL)
+    message->signature = "";
+
+  return header_len + body_len;
+}
+
+/* I/O */
+
+static gboolean
+send_all (FlatpakSpawnWire *self,
+          const guint8     *data,
+          gsize             len,
+          const int        *fds,
+          guint             n_fds,
+          GError          **error)
+{
+  g_autofree char *control = NULL;
+  gsize control_len = 0;
+
+  if (n_fds > 0)
+    {
+      struct cmsghdr *cmsg;
+
+      control_len = CMSG_SPACE (sizeof (int) * n_fds);
+      control = g_malloc0 (control_len);
+      cmsg = (struct cmsghdr *) control;
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN (sizeof (int) * n_fds);
+      memcpy (CMSG_DATA (cmsg), fds, sizeof (int) * n_fds);
+    }
+
+  while (len > 0)
+    {
+      struct iovec iov = { (void *) data, len };
+      struct msghdr msg;
+      ssize_t sent;
+
+      memset (&msg, 0, sizeof (msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = control_len;
+
+      sent = sendmsg (self->fd, &msg, MSG_NOSIGNAL);
+
+      if (sent < 0)
+        {
+          int saved_errno = errno;
+
+          if (saved_errno == EINTR)
+            continue;
+
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                       "Failed to write to bus: %s", g_strerror (saved_errno));
+          return FALSE;
+        }
+
+      /* The fds travel with the first byte */
+      control = (g_free (control), NULL);
+      control_len = 0;
+      data += sent;
+      len -= sent;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+read_more (FlatpakSpawnWire *self,
+           GError          **error)
+{
+  guint8 chunk[4096];
+  ssize_t n;
+
+  do
+    n = recv (self->fd, chunk, sizeof (chunk), 0);
+  while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to read from bus: %s", g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  if (n == 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                           "Bus connection closed");
+      return FALSE;
+    }
+
+  g_byte_array_append (self->in, chunk, n);
+  return TRUE;
+}
+
+/* Waits until the socket is readable, or until the deadline */
+static gboolean
+wait_readable (FlatpakSpawnWire *self,
+               GError          **error)
+{
+  struct pollfd pfd = { self->fd, POLLIN, 0 };
+  int ret;
+
+  if (self->deadline == 0)
+    return TRUE;
+
+  do
+    {
+      gint64 remaining = self->deadline - g_get_monotonic_time ();
+      int timeout = 0;
+
+      if (remaining > 0)
+        timeout = MIN ((remaining + G_TIME_SPAN_MILLISECOND - 1) / G_TIME_SPAN_MILLISECOND,
+                       G_MAXINT);
+
+      ret = poll (&pfd, 1, timeout);
+    }
+  while (ret < 0 && errno == EINTR);
+
+  if (ret < 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to wait for bus: %s", g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  if (ret == 0)
+    {
+      /* The same as GDBus */
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                           "Timeout was reached");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static char *
+read_auth_line (FlatpakSpawnWire *self,
+                GError          **error)
+{
+  while (TRUE)
+    {
+      const guint8 *end = NULL;
+      char *line;
+
+      if (self->in->len >= 2)
+        {
+          const guint8 *p = self->in->data;
+
+          while ((p = memchr (p, '\r', self->in->data + self->in->len - 1 - p)) != NULL)
+            {
+              if (p[1] == '\n')
+                {
+                  end = p;
+                  break;
+                }
+
+              p++;
+            }
+        }
+
+      if (end != NULL)
+        {
+          line = g_strndup ((const char *) self->in->data, end - self->in->data);
+          g_byte_array_remove_range (self->in, 0, end + 2 - self->in->data);
+          return line;
+        }
+
+      if (self->in->len > MAX_AUTH_LINE_LENGTH)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                               "Authentication line too long");
+          return NULL;
+        }
+
+      if (!wait_readable (self, error) ||
+          !read_more (self, error))
+        return NULL;
+    }
+}
+
+static gboolean
+authenticate (FlatpakSpawnWire *self,
+              GError          **error)
+{
+  g_autofree char *uid = g_strdup_printf ("%u", (guint) geteuid ());
+  g_autofree char *line = NULL;
+  g_autoptr(GString) request = NULL;
+  const char *p;
+
+  /* The nul byte is where the server picks up our credentials. Like
+   * sd-bus, send everything up to BEGIN at once: if the server doesn't
+   * agree, it will reject the later commands and we give up. */
+  request = g_string_new_len ("", 1);
+  g_string_append (request, "AUTH EXTERNAL ");
+
+  for (p = uid; *p != '\0'; p++)
+    g_string_append_printf (request, "%02x", *p);
+
+  g_string_append (request, "\r\nNEGOTIATE_UNIX_FD\r\nBEGIN\r\n");
+
+  if (!send_all (self, (const guint8 *) request->str, request->len, NULL, 0, error))
+    return FALSE;
+
+  line = read_auth_line (self, error);
+
+  if (line == NULL)
+    return FALSE;
+
+  if (!g_str_has_prefix (line, "OK "))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED,
+                   "Authentication failed: %s", line);
+      return FALSE;
+    }
+
+  g_free (line);
+  line = read_auth_line (self, error);
+
+  if (line == NULL)
+    return FALSE;
+
+  if (strcmp (line, "AGREE_UNIX_FD") != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Bus does not support fd passing: %s", line);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Messages */
+
+static void
+set_error_from_message (const WireMessage *message,
+                        GError           **error)
+{
+  static const struct {
+    const char *name;
+    GDBusError code;
+  } errors[] = {
+    { "org.freedesktop.DBus.Error.ServiceUnknown", G_DBUS_ERROR_SERVICE_UNKNOWN },
+    { "org.freedesktop.DBus.Error.InvalidArgs", G_DBUS_ERROR_INVALID_ARGS },
+    { "org.freedesktop.DBus.Error.UnknownMethod", G_DBUS_ERROR_UNKNOWN_METHOD },
+    { "org.freedesktop.DBus.Error.AccessDenied", G_DBUS_ERROR_ACCESS_DENIED },
+    { "org.freedesktop.DBus.Error.NoReply", G_DBUS_ERROR_NO_REPLY },
+  };
+  const char *text = NULL;
+  GDBusError code = G_DBUS_ERROR_FAILED;
+  Reader r;
+  gsize i;
+
+  message_body_reader (message, &r);
+
+  if (message->signature[0] != 's' || !read_string (&r, &text))
+    text = message->error_name != NULL ? message->error_name : "Unknown error";
+
+  for (i = 0; message->error_name != NULL && i < G_N_ELEMENTS (errors); i++)
+    {
+      if (strcmp (message->error_name, errors[i].name) == 0)
+        code = errors[i].code;
+    }
+
+  g_set_error_literal (error, G_DBUS_ERROR, code, text);
+}
+
+static void
+handle_signal (FlatpakSpawnWire  *self,
+               const WireMessage *message)
+{
+  const WireService *s = self->service;
+  Reader r;
+
+  if (message->type != MESSAGE_TYPE_SIGNAL ||
+      message->interface == NULL || message->member == NULL ||
+      s == NULL || self->pid == 0)
+    return;
+
+  message_body_reader (message, &r);
+
+  if (strcmp (message->interface, s->iface) == 0 &&
+      strcmp (message->member, s->exited_signal) == 0 &&
+      strcmp (message->signature, "uu") == 0 &&
+      g_strcmp0 (message->sender, self->service_owner) == 0)
+    {
+      guint32 pid, wait_status;
+
+      if (read_uint32 (&r, &pid) && read_uint32 (&r, &wait_status) &&
+          pid == self->pid && !self->exited)
+        {
+          self->exited = TRUE;
+          self->wait_status = wait_status;
+        }
+    }
+  else if (strcmp (message->interface, DBUS_INTERFACE_DBUS) == 0 &&
+           strcmp (message->member, "NameOwnerChanged") == 0 &&
+           strcmp (message->signature, "sss") == 0 &&
+           g_strcmp0 (message->sender, DBUS_SERVICE_DBUS) == 0)
+    {
+      const char *name, *old_owner, *new_owner;
+
+      if (read_string (&r, &name) && read_string (&r, &old_owner) &&
+          read_string (&r, &new_owner) &&
+          strcmp (name, s->bus_name) == 0 &&
+          g_strcmp0 (old_owner, self->service_owner) == 0 &&
+          self->vanished == NULL)
+        self->vanished = g_error_new (G_DBUS_ERROR, G_DBUS_ERROR_NAME_HAS_NO_OWNER,
+                                      "%s exited", s->bus_name);
+    }
+}
+
+/* We export no objects, but a call to us (such as
+ * org.freedesktop.DBus.Peer.Ping) must still get a reply, or the
+ * caller would wait for its timeout */
+static gboolean
+reply_unknown_method (FlatpakSpawnWire  *self,
+                      const WireMessage *message,
+                      GError           **error)
+{
+  g_autoptr(GByteArray) reply = NULL;
+  g_autofree char *text = NULL;
+
+  if (message->flags & MESSAGE_FLAG_NO_REPLY_EXPECTED)
+    return TRUE;
+
+  text = g_strdup_printf ("No such method \"%s\" on interface \"%s\" at path %s",
+                          message->member != NULL ? message->member : "",
+                          message->interface != NULL ? message->interface : "",
+                          message->path != NULL ? message->path : "");
+  reply = error_new (self, message->sender, message->serial,
+                     "org.freedesktop.DBus.Error.UnknownMethod", text);
+  return send_all (self, reply->data, reply->len, NULL, 0, error);
+}
+
+/* Handles every complete message in the buffer, until the reply to
+ * @serial if nonzero. Returns 1 if that reply was found, 0 if more
+ * data is needed, -1 on error */
+static int
+process_messages (FlatpakSpawnWire *self,
+                  guint32           serial,
+                  guint32          *reply_uint32,
+                  GError          **error)
+{
+  while (TRUE)
+    {
+      WireMessage message;
+      gssize len = parse_message (self->in->data, self->in->len, &message);
+      int ret = 0;
+
+      if (len < 0)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                               "Invalid message from bus");
+          return -1;
+        }
+
+      if (len == 0)
+        return 0;
+
+      if (serial != 0 && message.reply_serial == serial &&
+          message.type == MESSAGE_TYPE_ERROR)
+        {
+          set_error_from_message (&message, error);
+          ret = -1;
+        }
+      else if (serial != 0 && message.reply_serial == serial &&
+               message.type == MESSAGE_TYPE_METHOD_RETURN)
+        {
+          Reader r;
+
+          message_body_reader (&message, &r);
+          ret = 1;
+
+          if (reply_uint32 != NULL)
+            {
+              if (strcmp (message.signature, "u") != 0 ||
+                  !read_uint32 (&r, reply_uint32))
+                {
+                  g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_SIGNATURE,
+                               "Method returned type (%s), but expected (u)",
+                               message.signature);
+                  ret = -1;
+                }
+              else
+                {
+                  g_free (self->service_owner);
+                  self->service_owner = g_strdup (message.sender);
+                }
+            }
+        }
+      else if (message.type == MESSAGE_TYPE_METHOD_CALL)
+        {
+          if (!reply_unknown_method (self, &message, error))
+            ret = -1;
+        }
+      else
+        {
+          handle_signal (self, &message);
+        }
+
+      g_byte_array_remove_range (self->in, 0, len);
+
+      if (ret != 0)
+        return ret;
+    }
+}
+
+static gboolean
+wait_for_reply (FlatpakSpawnWire *self,
+                guint32           serial,
+                guint32          *reply_uint32,
+                GError          **error)
+{
+  while (TRUE)
+    {
+      int ret = process_messages (self, serial, reply_uint32, error);
+
+      if (ret != 0)
+        return ret > 0;
+
+      if (!wait_readable (self, error) ||
+          !read_more (self, error))
+        return FALSE;
+    }
+}
+
+static gboolean
+call (FlatpakSpawnWire *self,
+      GByteArray       *message,
+      guint32           serial,
+      const int        *fds,
+      guint             n_fds,
+      guint32          *reply_uint32,
+      GError          **error)
+{
+  gboolean ret;
+
+  ret = send_all (self, message->data, message->len, fds, n_fds, error) &&
+        wait_for_reply (self, serial, reply_uint32, error);
+  g_byte_array_unref (message);
+  return ret;
+}
+
+/* Connection */
+
+static gboolean
+parse_address (const char         *address,
+               struct sockaddr_un *addr,
+               socklen_t          *addr_len,
+               GError            **error)
+{
+  g_auto(GStrv) addresses = g_strsplit (address, ";", -1);
+  gsize i, j;
+
+  for (i = 0; addresses[i] != NULL; i++)
+    {
+      g_auto(GStrv) params = NULL;
+
+      if (!g_str_has_prefix (addresses[i], "unix:"))
+        continue;
+
+      params = g_strsplit (addresses[i] + strlen ("unix:"), ",", -1);
+
+      for (j = 0; params[j] != NULL; j++)
+        {
+          g_autofree char *value = NULL;
+          gboolean abstract;
+          gsize len;
+
+          if (g_str_has_prefix (params[j], "path="))
+            abstract = FALSE;
+          else if (g_str_has_prefix (params[j], "abstract="))
+            abstract = TRUE;
+          else
+            continue;
+
+          value = g_uri_unescape_string (strchr (params[j], '=') + 1, NULL);
+
+          if (value == NULL)
+            continue;
+
+          len = strlen (value);
+
+          if (len + 1 > sizeof (addr->sun_path))
+            continue;
+
+          memset (addr, 0, sizeof (*addr));
+          addr->sun_family = AF_UNIX;
+
+          if (abstract)
+            {
+              memcpy (addr->sun_path + 1, value, len);
+              *addr_len = offsetof (struct sockaddr_un, sun_path) + 1 + len;
+            }
+          else
+            {
+              memcpy (addr->sun_path, value, len);
+              *addr_len = sizeof (*addr);
+            }
+
+          return TRUE;
+        }
+    }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+               "Unsupported bus address \"%s\"", address);
+  return FALSE;
+}
+
+/* connect() on a Unix socket waits for room in the listener's backlog
+ * for up to the send timeout, then fails with EAGAIN */
+static int
+connect_with_deadline (int                       fd,
+                       const struct sockaddr_un *addr,
+                       socklen_t                 addr_len,
+                       gint64                    deadline)
+{
+  static const struct timeval no_timeout = { 0, 0 };
+  int ret;
+
+  do
+    {
+      if (deadline != 0)
+        {
+          gint64 remaining = deadline - g_get_monotonic_time ();
+          struct timeval timeout;
+
+          if (remaining <= 0)
+            {
+              errno = ETIMEDOUT;
+              return -1;
+            }
+
+          timeout.tv_sec = remaining / G_USEC_PER_SEC;
+          timeout.tv_usec = remaining % G_USEC_PER_SEC;
+
+          if (setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout)) < 0)
+            return -1;
+        }
+
+      ret = connect (fd, (const struct sockaddr *) addr, addr_len);
+    }
+  while (ret < 0 && errno == EINTR);
+
+  if (ret < 0)
+    {
+      if (errno == EAGAIN && deadline != 0)
+        errno = ETIMEDOUT;
+
+      return -1;
+    }
+
+  /* Later writes are bounded by the deadline on their replies instead */
+  if (deadline != 0 &&
+      setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &no_timeout, sizeof (no_timeout)) < 0)
+    return -1;
+
+  return 0;
+}
+
+/**
+ * flatpak_spawn_wire_connect:
+ * @deadline: a g_get_monotonic_time() by which to have connected and
+ *  authenticated, or 0 for none
+ * @error: return location for an error
+ *
+ * Connects and authenticates to the session bus. Only Unix sockets with
+ * fd passing are supported. If @deadline passes first, fails with
+ * %G_IO_ERROR_TIMED_OUT. The deadline remains set for later calls, as
+ * if by flatpak_spawn_wire_set_deadline().
+ *
+ * Returns: (transfer full): a new connection, or %NULL
+ */
+FlatpakSpawnWire *
+flatpak_spawn_wire_connect (gint64   deadline,
+                            GError **error)
+{
+  g_autofree char *default_address = NULL;
+  const char *address = g_getenv ("DBUS_SESSION_BUS_ADDRESS");
+  FlatpakSpawnWire *self;
+  struct sockaddr_un addr;
+  socklen_t addr_len;
+  int fd;
+
+  if (address == NULL)
+    {
+      const char *runtime_dir = g_getenv ("XDG_RUNTIME_DIR");
+
+      if (runtime_dir == NULL)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                               "No session bus address");
+          return NULL;
+        }
+
+      default_address = g_strdup_printf ("unix:path=%s/bus", runtime_dir);
+      address = default_address;
+    }
+
+  if (!parse_address (address, &addr, &addr_len, error))
+    return NULL;
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (fd < 0 || connect_with_deadline (fd, &addr, addr_len, deadline) < 0)
+    {
+      int saved_errno = errno;
+
+      if (fd >= 0)
+        close (fd);
+
+      if (saved_errno == ETIMEDOUT)
+        {
+          /* The same as GDBus */
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                               "Timeout was reached");
+          return NULL;
+        }
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Could not connect: %s", g_strerror (saved_errno));
+      return NULL;
+    }
+
+  self = g_new0 (FlatpakSpawnWire, 1);
+  self->fd = fd;
+  self->in = g_byte_array_new ();
+  self->next_serial = 1;
+  self->deadline = deadline;
+
+  if (!authenticate (self, error))
+    {
+      flatpak_spawn_wire_free (self);
+      return NULL;
+    }
+
+  return self;
+}
+
+static GByteArray *
+spawn_body_new (const WireService  *service,
+                const char         *cwd,
+                const char * const *argv,
+                const guint32      *targets,
+                guint               n_fds,
+                GHashTable         *env,
+                guint32             flags)
+{
+  GByteArray *body = g_byte_array_new ();
+  GHashTableIter iter;
+  gpointer key, value;
+  WireArray array;
+  guint i;
+
+  write_bytestring (body, cwd);
+
+  write_array_open (body, 4, &array);
+
+  for (i = 0; argv[i] != NULL; i++)
+    write_bytestring (body, argv[i]);
+
+  write_array_close (body, &array);
+
+  write_array_open (body, 8, &array);
+
+  for (i = 0; i < n_fds; i++)
+    {
+      write_align (body, 8);
+      write_uint32 (body, targets[i]);
+      write_uint32 (body, i);   /* index into the fds we attach */
+    }
+
+  write_array_close (body, &array);
+
+  write_array_open (body, 8, &array);
+
+  if (env != NULL)
+    {
+      g_hash_table_iter_init (&iter, env);
+
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          write_align (body, 8);
+          write_string (body, key);
+          write_string (body, value);
+        }
+    }
+
+  write_array_close (body, &array);
+
+  write_uint32 (body, flags);
+
+  if (service == &portal_service)
+    {
+      /* No options: anything that needs them goes through GDBus */
+      write_array_open (body, 8, &array);
+      write_array_close (body, &array);
+    }
+
+  return body;
+}
+
+/**
+ * flatpak_spawn_wire_spawn:
+ * @self: a connection
+ * @host: whether to use HostCommand rather than Spawn
+ * @cwd: working directory
+ * @argv: the command
+ * @fds: file descriptors to send
+ * @targets: the fd number each of @fds will have in the command
+ * @n_fds: length of @fds and @targets
+ * @env: (nullable): variable name => value
+ * @flags: Spawn or HostCommand flags
+ * @watch_bus_flag: the flag in @flags, if any, to drop if the service
+ *  is too old to understand it
+ * @error: return location for an error
+ *
+ * Says hello to the bus, subscribes to the exit signal and starts the
+ * command, with a single round-trip.
+ */
+gboolean
+flatpak_spawn_wire_spawn (FlatpakSpawnWire   *self,
+                          gboolean            host,
+                          const char         *cwd,
+                          const char * const *argv,
+                          const int          *fds,
+                          const guint32      *targets,
+                          guint               n_fds,
+                          GHashTable         *env,
+                          guint32             flags,
+                          guint32             watch_bus_flag,
+                          GError            **error)
+{
+  g_autoptr(GByteArray) preamble = g_byte_array_new ();
+  g_autoptr(GByteArray) message = NULL;
+  g_autoptr(GByteArray) body = NULL;
+  g_autofree char *exited_rule = NULL;
+  g_autofree char *owner_rule = NULL;
+  const WireService *s = host ? &host_service : &portal_service;
+  GError *local_error = NULL;
+  guint32 serial;
+  guint32 pid;
+
+  g_return_val_if_fail (self->service == NULL, FALSE);
+
+  self->service = s;
+
+  /* Replies to these arrive before the reply to the call, and are
+   * ignored; the bus processes messages in order, so both matches are
+   * in place before the service can send anything */
+  message = method_call_new (self, 0, DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                             DBUS_INTERFACE_DBUS, "Hello", NULL, NULL, 0, NULL);
+  g_byte_array_append (preamble, message->data, message->len);
+  g_clear_pointer (&message, g_byte_array_unref);
+
+  exited_rule = g_strdup_printf ("type='signal',sender='%s',path='%s',interface='%s',member='%s'",
+                                 s->bus_name, s->obj_path, s->iface, s->exited_signal);
+  owner_rule = g_strdup_printf ("type='signal',sender='" DBUS_SERVICE_DBUS "',"
+                                "path='" DBUS_PATH_DBUS "',interface='" DBUS_INTERFACE_DBUS "',"
+                                "member='NameOwnerChanged',arg0='%s'",
+                                s->bus_name);
+
+  body = g_byte_array_new ();
+  write_string (body, exited_rule);
+  message = method_call_new (self, MESSAGE_FLAG_NO_REPLY_EXPECTED,
+                             DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                             DBUS_INTERFACE_DBUS, "AddMatch", "s", body, 0, NULL);
+  g_byte_array_append (preamble, message->data, message->len);
+  g_clear_pointer (&message, g_byte_array_unref);
+  g_clear_pointer (&body, g_byte_array_unref);
+
+  body = g_byte_array_new ();
+  write_string (body, owner_rule);
+  message = method_call_new (self, MESSAGE_FLAG_NO_REPLY_EXPECTED,
+                             DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                             DBUS_INTERFACE_DBUS, "AddMatch", "s", body, 0, NULL);
+  g_byte_array_append (preamble, message->data, message->len);
+  g_clear_pointer (&message, g_byte_array_unref);
+  g_clear_pointer (&body, g_byte_array_unref);
+
+  if (!send_all (self, preamble->data, preamble->len, NULL, 0, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      body = spawn_body_new (s, cwd, argv, targets, n_fds, env, flags);
+      /* Sent separately, so that the fds are unambiguously attached
+       * to this message */
+      message = method_call_new (self, 0, s->bus_name, s->obj_path, s->iface,
+                                 s->spawn_method, s->spawn_signature, body,
+                                 n_fds, &serial);
+      g_clear_pointer (&body, g_byte_array_unref);
+
+      if (call (self, g_steal_pointer (&message), serial, fds, n_fds, &pid, &local_error))
+        break;
+
+      if (g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS) &&
+          watch_bus_flag != 0)
+        {
+          g_debug ("Got an invalid argument error; trying again without --watch-bus");
+          flags &= ~watch_bus_flag;
+          watch_bus_flag = 0;
+          g_clear_error (&local_error);
+          continue;
+        }
+
+      g_propagate_prefixed_error (error, local_error, "Portal call failed: ");
+      return FALSE;
+    }
+
+  self->pid = pid;
+  return TRUE;
+}
+
+/**
+ * flatpak_spawn_wire_set_deadline:
+ * @self: a connection
+ * @deadline: a g_get_monotonic_time(), or 0 for none
+ *
+ * Makes later calls fail with %G_IO_ERROR_TIMED_OUT if their reply has
+ * not arrived by @deadline.
+ */
+void
+flatpak_spawn_wire_set_deadline (FlatpakSpawnWire *self,
+                                 gint64            deadline)
+{
+  self->deadline = deadline;
+}
+
+guint32
+flatpak_spawn_wire_get_pid (FlatpakSpawnWire *self)
+{
+  return self->pid;
+}
+
+/**
+ * flatpak_spawn_wire_get_fd:
+ * @self: a connection
+ *
+ * Returns: the socket, which should be polled for input, calling
+ *  flatpak_spawn_wire_dispatch() whenever it is readable
+ */
+int
+flatpak_spawn_wire_get_fd (FlatpakSpawnWire *self)
+{
+  return self->fd;
+}
+
+/**
+ * flatpak_spawn_wire_dispatch:
+ * @self: a connection
+ * @error: return location for an error
+ *
+ * Reads from the socket, which may block if it is not readable, and
+ * handles the messages received.
+ *
+ * Returns: %FALSE if the connection was closed or broken
+ */
+gboolean
+flatpak_spawn_wire_dispatch (FlatpakSpawnWire *self,
+                             GError          **error)
+{
+  return read_more (self, error) &&
+         process_messages (self, 0, NULL, error) >= 0;
+}
+
+/**
+ * flatpak_spawn_wire_check_exited:
+ * @self: a connection
+ * @wait_status: (out): the command's wait status, if it has exited
+ * @error: return location for an error
+ *
+ * Handles any messages already received, and checks whether the
+ * command has stopped: either it exited, or the service exited (or the
+ * connection broke), and with it our chance to find out how the
+ * command ends, in which case @error is set. Call this before each
+ * poll().
+ *
+ * Returns: %TRUE if the command has stopped
+ */
+gboolean
+flatpak_spawn_wire_check_exited (FlatpakSpawnWire *self,
+                                 int              *wait_status,
+                                 GError          **error)
+{
+  /* A reply we waited for may have been followed by more messages in
+   * the same read, which poll() will not tell us about */
+  if (process_messages (self, 0, NULL, error) < 0)
+    return TRUE;
+
+  if (self->exited)
+    {
+      *wait_status = self->wait_status;
+      return TRUE;
+    }
+
+  if (self->vanished != NULL)
+    {
+      g_propagate_error (error, g_error_copy (self->vanished));
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+gboolean
+flatpak_spawn_wire_send_signal (FlatpakSpawnWire *self,
+                                int               signum,
+                                gboolean          to_process_group,
+                                GError          **error)
+{
+  g_autoptr(GByteArray) body = g_byte_array_new ();
+  const WireService *s = self->service;
+  guint32 serial;
+
+  g_return_val_if_fail (self->pid != 0, FALSE);
+
+  write_uint32 (body, self->pid);
+  write_uint32 (body, signum);
+  write_uint32 (body, to_process_group ? 1 : 0);
+
+  return call (self,
+               method_call_new (self, 0, s->bus_name, s->obj_path, s->iface,
+                                s->signal_method, "uub", body, 0, &serial),
+               serial, NULL, 0, NULL, error);
+}
+
+void
+flatpak_spawn_wire_free (FlatpakSpawnWire *self)
+{
+  if (self == NULL)
+    return;
+
+  close (self->fd);
+  g_byte_array_unref (self->in);
+  g_free (self->service_owner);
+  g_clear_error (&self->vanished);
+  g_free (self);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_SPAWN_WIRE_H__
+#define __FLATPAK_SPAWN_WIRE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * A minimal D-Bus client that speaks just enough of the wire protocol
+ * for flatpak-spawn's common case: a Spawn or HostCommand call with no
+ * options that would need the service's version, followed by waiting
+ * for the exit signal. It uses neither GObject nor a worker thread.
+ *
+ * Errors before the call is sent (an unsupported bus address, failed
+ * authentication) should be treated as "use GDBus instead", except
+ * for G_IO_ERROR_TIMED_OUT when a deadline was given. Errors
+ * from the service are in the G_DBUS_ERROR domain, as with GDBus.
+ */
+typedef struct _FlatpakSpawnWire FlatpakSpawnWire;
+
+FlatpakSpawnWire *flatpak_spawn_wire_connect     (gint64               deadline,
+                                                  GError             **error);
+gboolean          flatpak_spawn_wire_spawn       (FlatpakSpawnWire    *self,
+                                                  gboolean             host,
+                                                  const char          *cwd,
+                                                  const char * const  *argv,
+                                                  const int           *fds,
+                                                  const guint32       *targets,
+                                                  guint                n_fds,
+                                                  GHashTable          *env,
+                                                  guint32              flags,
+                                                  guint32              watch_bus_flag,
+                                                  GError             **error);
+void              flatpak_spawn_wire_set_deadline (FlatpakSpawnWire   *self,
+                                                  gint64              deadline);
+guint32           flatpak_spawn_wire_get_pid     (FlatpakSpawnWire    *self);
+int               flatpak_spawn_wire_get_fd      (FlatpakSpawnWire    *self);
+gboolean          flatpak_spawn_wire_dispatch    (FlatpakSpawnWire    *self,
+                                                  GError             **error);
+gboolean          flatpak_spawn_wire_check_exited (FlatpakSpawnWire   *self,
+                                                  int                 *wait_status,
+                                                  GError             **error);
+gboolean          flatpak_spawn_wire_send_signal (FlatpakSpawnWire    *self,
+                                                  int                  signum,
+                                                  gboolean             to_process_group,
+                                                  GError             **error);
+void              flatpak_spawn_wire_free        (FlatpakSpawnWire    *self);
+
+G_END_DECLS
+
+#endif /* __FLATPAK_SPAWN_WIRE_H__ */
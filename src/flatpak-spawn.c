@@ -18,8 +18,10 @@
  *       Alexander Larsson <alexl@redhat.com>
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <locale.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,8 +36,17 @@
 #include <gio/gunixfdlist.h>
 
 #include "backport-autoptr.h"
+#include "deadline.h"
 #include "flatpak-portal.h"
 #include "flatpak-session-helper.h"
+#include "flatpak-spawn-launcher.h"
+#include "flatpak-spawn-options.h"
+#include "flatpak-spawn-paths.h"
+#ifdef ENABLE_WIRE_DBUS
+#include "flatpak-spawn-wire.h"
+#endif
+#include "flatpak-xdg-utils.h"
+#include "startup-trace.h"
 
 /* Change to #if 1 to check backwards-compatibility code paths */
 #if 0
@@ -43,68 +54,184 @@
 #define GLIB_CHECK_VERSION(x, y, z) (0)
 #endif
 
-static GDBusConnection *session_bus = NULL;
+static FlatpakSpawnLauncher *launcher = NULL;
+static FlatpakSpawnProcess *child_process = NULL;
+/* Holds on to the launcher's watcher for the connection, and so to the
+ * service's version and exit signal subscription, between restarts */
+static FlatpakSpawnProcess *exited_process = NULL;
+#ifdef ENABLE_WIRE_DBUS
+static FlatpakSpawnWire *wire_child = NULL;
+#endif
+static int exit_code = 0;
+static gboolean opt_host = FALSE;
+/* Collected here rather than in the launcher, which is only created if
+ * the built-in D-Bus client can't be used */
+static FlatpakSpawnOptions opts;
+
+typedef enum
+{
+  RESTART_NO,
+  RESTART_ON_FAILURE,
+  RESTART_ALWAYS,
+} RestartMode;
+
+/* The delay before each restart doubles up to the maximum, and goes back
+ * to the minimum once the command has stayed up for the maximum */
+#define RESTART_DELAY_MIN_MS 100
+#define RESTART_DELAY_MAX_MS (30 * 1000)
+
+static RestartMode opt_restart = RESTART_NO;
+static int opt_restart_limit = 5;
+static const char * const *spawn_argv = NULL;
+static guint n_restarts = 0;
+static guint restart_delay_min_ms = RESTART_DELAY_MIN_MS;
+static guint restart_delay_ms = RESTART_DELAY_MIN_MS;
+static guint last_restart_delay_ms = 0;
+static gboolean stop_restarting = FALSE;
+static gint64 child_started_time = 0;
+static gint64 child_exited_time = 0;
+
+static int
+exit_code_from_wait_status (int wait_status)
+{
+  if (WIFEXITED (wait_status))
+    {
+      return WEXITSTATUS (wait_status);
+    }
+  else if (WIFSIGNALED (wait_status))
+    {
+      /* Smush the signal into an unsigned byte, as the shell does. This is
+       * not quite right from the perspective of whatever ran flatpak-spawn
+       * — it will get WIFEXITED() not WIFSIGNALED() — but the
+       *  alternative is to disconnect all signal() handlers then send this
+       *  signal to ourselves and hope it kills us.
+       */
+      return 128 + WTERMSIG (wait_status);
+    }
+  else
+    {
+      /* wait(3p) claims that if the waitpid() call that returned the exit
+       * code specified neither WUNTRACED nor WIFSIGNALED, then exactly one
+       * of WIFEXITED() or WIFSIGNALED() will be true.
+       */
+      g_warning ("wait status %d is neither WIFEXITED() nor WIFSIGNALED()",
+                 wait_status);
+      /* EX_SOFTWARE "internal software error" from sysexits.h, for want of
+       * a better code.
+       */
+      return 70;
+    }
+}
+
+/* Sets exit_code from the child's wait status, or from @error if we
+ * lost track of it */
+static void
+child_finished (guint32       pid,
+                int           wait_status,
+                const GError *error)
+{
+  if (error == NULL)
+    {
+      exit_code = exit_code_from_wait_status (wait_status);
+      g_debug ("child exit code %d: %d", pid, exit_code);
+    }
+  else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CLOSED))
+    {
+      g_debug ("Session bus connection closed, quitting");
+      exit_code = 0;
+    }
+  else
+    {
+      /* We can't track the child anymore */
+      g_debug ("%s", error->message);
+      exit_code = 1;
+    }
+}
+
+static void spawn_cb (GObject      *source,
+                      GAsyncResult *result,
+                      gpointer      user_data);
+
+/* Called once exit_code reflects how the command ended */
+static gboolean
+should_restart (void)
+{
+  if (opt_restart == RESTART_NO || stop_restarting)
+    return FALSE;
+
+  if (opt_restart == RESTART_ON_FAILURE && exit_code == 0)
+    return FALSE;
+
+  if (opt_restart_limit > 0 && n_restarts >= (guint) opt_restart_limit)
+    {
+      g_printerr ("Not restarting the command again after %u restarts\n",
+                  n_restarts);
+      return FALSE;
+    }
 
-guint child_pid = 0;
-gboolean opt_host;
+  return TRUE;
+}
 
-const char *service_iface;
-const char *service_obj_path;
-const char *service_bus_name;
+static gboolean
+restart_cb (gpointer user_data)
+{
+  GMainLoop *loop = user_data;
+
+  n_restarts++;
+  g_debug ("Restarting command (restart %u)", n_restarts);
+
+  /* The launcher still has the fds, environment and options, and
+   * exited_process keeps what we know about the service. --deadline
+   * was only for starting the command the first time. */
+  flatpak_spawn_launcher_set_timeouts (launcher, deadline_get_probe_timeout (), 0);
+  flatpak_spawn_launcher_spawn_async (launcher, spawn_argv, NULL,
+                                      spawn_cb, loop);
+  return G_SOURCE_REMOVE;
+}
 
 static void
-spawn_exited_cb (G_GNUC_UNUSED GDBusConnection *connection,
-                 G_GNUC_UNUSED const gchar     *sender_name,
-                 G_GNUC_UNUSED const gchar     *object_path,
-                 G_GNUC_UNUSED const gchar     *interface_name,
-                 G_GNUC_UNUSED const gchar     *signal_name,
-                 GVariant                      *parameters,
-                 G_GNUC_UNUSED gpointer         user_data)
+schedule_restart (GMainLoop *loop)
 {
-  guint32 client_pid = 0;
-  guint32 wait_status = 0;
+  child_exited_time = g_get_monotonic_time ();
 
-  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(uu)")))
-    return;
+  if (child_started_time != 0 &&
+      child_exited_time - child_started_time >= RESTART_DELAY_MAX_MS * G_TIME_SPAN_MILLISECOND)
+    restart_delay_ms = restart_delay_min_ms;
+
+  g_debug ("Restarting command in %u ms", restart_delay_ms);
+  last_restart_delay_ms = restart_delay_ms;
+  g_timeout_add (restart_delay_ms, restart_cb, loop);
+  restart_delay_ms = MIN (restart_delay_ms * 2, RESTART_DELAY_MAX_MS);
+}
 
-  g_variant_get (parameters, "(uu)", &client_pid, &wait_status);
-  g_debug ("child exited %d: %d", client_pid, wait_status);
+static void
+child_exited_cb (G_GNUC_UNUSED GObject *source,
+                 GAsyncResult          *result,
+                 gpointer               user_data)
+{
+  GMainLoop *loop = user_data;
+  g_autoptr(GError) error = NULL;
 
-  if (child_pid == client_pid)
+  if (flatpak_spawn_process_wait_finish (child_process, result, &error))
     {
-      int exit_code;
+      child_finished (flatpak_spawn_process_get_pid (child_process),
+                      flatpak_spawn_process_get_status (child_process),
+                      NULL);
 
-      if (WIFEXITED (wait_status))
+      if (should_restart ())
         {
-          exit_code = WEXITSTATUS (wait_status);
-        }
-      else if (WIFSIGNALED (wait_status))
-        {
-          /* Smush the signal into an unsigned byte, as the shell does. This is
-           * not quite right from the perspective of whatever ran flatpak-spawn
-           * — it will get WIFEXITED() not WIFSIGNALED() — but the
-           *  alternative is to disconnect all signal() handlers then send this
-           *  signal to ourselves and hope it kills us.
-           */
-          exit_code = 128 + WTERMSIG (wait_status);
-        }
-      else
-        {
-          /* wait(3p) claims that if the waitpid() call that returned the exit
-           * code specified neither WUNTRACED nor WIFSIGNALED, then exactly one
-           * of WIFEXITED() or WIFSIGNALED() will be true.
-           */
-          g_warning ("wait status %d is neither WIFEXITED() nor WIFSIGNALED()",
-                     wait_status);
-          /* EX_SOFTWARE "internal software error" from sysexits.h, for want of
-           * a better code.
-           */
-          exit_code = 70;
+          /* Until there is a new child, signals act on us */
+          exited_process = g_steal_pointer (&child_process);
+          schedule_restart (loop);
+          return;
         }
+    }
+  else
+    {
+      child_finished (0, 0, error);
+    }
 
-      g_debug ("child exit code %d: %d", client_pid, exit_code);
-      exit (exit_code);
-  }
+  g_main_loop_quit (loop);
 }
 
 static void
@@ -120,17 +247,92 @@ message_handler (G_GNUC_UNUSED const gchar   *log_domain,
     g_printerr ("%s: %s\n", g_get_prgname (), message);
 }
 
+/* The full locale is only needed to print messages, so loading it is
+ * put off until the first one. LC_CTYPE is set up front, because
+ * GOption needs it to convert arguments to UTF-8. */
+static void
+ensure_locale (void)
+{
+  static gboolean done = FALSE;
+
+  if (done)
+    return;
+
+  done = TRUE;
+  setlocale (LC_ALL, "");
+  startup_trace ("locale");
+}
+
+static void
+print_localized (const gchar *string,
+                 FILE        *stream)
+{
+  g_autofree gchar *converted = NULL;
+
+  ensure_locale ();
+
+  if (!g_get_charset (NULL))
+    converted = g_locale_from_utf8 (string, -1, NULL, NULL, NULL);
+
+  fputs (converted != NULL ? converted : string, stream);
+  fflush (stream);
+}
+
+static void
+print_handler (const gchar *string)
+{
+  print_localized (string, stdout);
+}
+
+static void
+printerr_handler (const gchar *string)
+{
+  print_localized (string, stderr);
+}
+
+static gboolean
+have_child (void)
+{
+#ifdef ENABLE_WIRE_DBUS
+  if (wire_child != NULL)
+    return TRUE;
+#endif
+
+  return child_process != NULL;
+}
+
+static gboolean
+send_signal_to_child (int       sig,
+                      gboolean  to_process_group,
+                      GError  **error)
+{
+#ifdef ENABLE_WIRE_DBUS
+  if (wire_child != NULL)
+    {
+      int timeout = deadline_get_probe_timeout ();
+
+      flatpak_spawn_wire_set_deadline (wire_child,
+                                       timeout < 0 ? 0 : g_get_monotonic_time () + timeout * G_TIME_SPAN_MILLISECOND);
+      return flatpak_spawn_wire_send_signal (wire_child, sig, to_process_group, error);
+    }
+#endif
+
+  return flatpak_spawn_process_send_signal_sync (child_process, sig,
+                                                 to_process_group,
+                                                 NULL, error);
+}
+
 static void
 forward_signal (int sig)
 {
-  g_autoptr(GVariant) reply = NULL;
   gboolean to_process_group = FALSE;
   g_autoptr(GError) error = NULL;
 
-  if (child_pid == 0)
+  if (!have_child ())
     {
-      /* We are not monitoring a child yet, so let the signal act on
-       * this main process instead */
+      /* We are not monitoring a child yet, or not any more while
+       * waiting to restart it, so let the signal act on this main
+       * process instead. That also means no further restart. */
       if (sig == SIGTSTP || sig == SIGSTOP || sig == SIGTTIN || sig == SIGTTOU)
         {
           raise (SIGSTOP);
@@ -153,6 +355,10 @@ forward_signal (int sig)
 
   g_debug ("Forwarding signal: %d", sig);
 
+  /* The command is being asked to go away, so it should stay away */
+  if (sig == SIGHUP || sig == SIGINT || sig == SIGQUIT || sig == SIGTERM)
+    stop_restarting = TRUE;
+
   /* We forward stop requests as real stop, because the default doesn't
      seem to be to stop for non-kernel sent TSTP??? */
   if (sig == SIGTSTP)
@@ -162,18 +368,9 @@ forward_signal (int sig)
   if (sig == SIGINT || sig == SIGSTOP || sig == SIGCONT)
     to_process_group = TRUE;
 
-  reply = g_dbus_connection_call_sync (session_bus,
-                                       service_bus_name,
-                                       service_obj_path,
-                                       service_iface,
-                                       opt_host ? "HostCommandSignal" : "SpawnSignal",
-                                       g_variant_new ("(uub)",
-                                                      child_pid, sig, to_process_group),
-                                       G_VARIANT_TYPE ("()"),
-                                       G_DBUS_CALL_FLAGS_NONE,
-                                       -1, NULL, &error);
-
-  if (error)
+  /* This is synchronous so that a SIGSTOP has reached the child before
+   * we stop ourselves */
+  if (!send_signal_to_child (sig, to_process_group, &error))
     g_debug ("Failed to forward signal: %s", error->message);
 
   if (sig == SIGSTOP)
@@ -183,26 +380,12 @@ forward_signal (int sig)
     }
 }
 
-static gboolean
-forward_signal_handler (
-#if GLIB_CHECK_VERSION (2, 36, 0)
-                        int sfd,
-#else
-                        GIOChannel *source,
-#endif
-                        G_GNUC_UNUSED GIOCondition condition,
-                        G_GNUC_UNUSED gpointer data)
+static void
+read_forwarded_signal (int sfd)
 {
   struct signalfd_siginfo info;
   ssize_t size;
 
-#if !GLIB_CHECK_VERSION (2, 36, 0)
-  int sfd;
-
-  sfd = g_io_channel_unix_get_fd (source);
-  g_return_val_if_fail (sfd >= 0, G_SOURCE_CONTINUE);
-#endif
-
   size = read (sfd, &info, sizeof (info));
 
   if (size < 0)
@@ -221,12 +404,32 @@ forward_signal_handler (
     {
       forward_signal (info.ssi_signo);
     }
+}
+
+static gboolean
+forward_signal_handler (
+#if GLIB_CHECK_VERSION (2, 36, 0)
+                        int sfd,
+#else
+                        GIOChannel *source,
+#endif
+                        G_GNUC_UNUSED GIOCondition condition,
+                        G_GNUC_UNUSED gpointer data)
+{
+#if !GLIB_CHECK_VERSION (2, 36, 0)
+  int sfd;
+
+  sfd = g_io_channel_unix_get_fd (source);
+  g_return_val_if_fail (sfd >= 0, G_SOURCE_CONTINUE);
+#endif
 
+  read_forwarded_signal (sfd);
   return G_SOURCE_CONTINUE;
 }
 
-static guint
-forward_signals (void)
+/* Returns a signalfd for the signals we forward, or -1 */
+static int
+block_forwarded_signals (void)
 {
   static int forward[] = {
     SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGCONT, SIGTSTP, SIGUSR1, SIGUSR2
@@ -245,7 +448,7 @@ forward_signals (void)
   if (sfd < 0)
     {
       g_warning ("Unable to watch signals: %s", g_strerror (errno));
-      return 0;
+      return -1;
     }
 
   /*
@@ -260,6 +463,12 @@ forward_signals (void)
    */
   pthread_sigmask (SIG_BLOCK, &mask, NULL);
 
+  return sfd;
+}
+
+static guint
+forward_signals (int sfd)
+{
 #if GLIB_CHECK_VERSION (2, 36, 0)
   return g_unix_fd_add (sfd, G_IO_IN, forward_signal_handler, NULL);
 #else
@@ -274,27 +483,6 @@ forward_signals (void)
 #endif
 }
 
-static void
-name_owner_changed (G_GNUC_UNUSED GDBusConnection *connection,
-                    G_GNUC_UNUSED const gchar     *sender_name,
-                    G_GNUC_UNUSED const gchar     *object_path,
-                    G_GNUC_UNUSED const gchar     *interface_name,
-                    G_GNUC_UNUSED const gchar     *signal_name,
-                    GVariant                      *parameters,
-                    G_GNUC_UNUSED gpointer         user_data)
-{
-  const char *name, *from, *to;
-  g_variant_get (parameters, "(&s&s&s)", &name, &from, &to);
-
-  /* Check if the service dies, then we exit, because we can't track it anymore */
-  if (strcmp (name, service_bus_name) == 0 &&
-      strcmp (to, "") == 0)
-    {
-      g_debug ("portal exited");
-      exit (1);
-    }
-}
-
 static gboolean
 command_specified (GPtrArray *child_argv,
                    GError   **error)
@@ -307,70 +495,29 @@ command_specified (GPtrArray *child_argv,
   return FALSE;
 }
 
-static void
-session_bus_closed_cb (G_GNUC_UNUSED GDBusConnection *bus,
-                       G_GNUC_UNUSED gboolean remote_peer_vanished,
-                       G_GNUC_UNUSED GError *error,
-                       GMainLoop *loop)
-{
-  g_debug ("Session bus connection closed, quitting");
-  g_main_loop_quit (loop);
-}
-
-static gboolean opt_sandbox_flags = 0;
-
 static gboolean
-sandbox_flag_callback (G_GNUC_UNUSED const gchar *option_name,
-                       const gchar *value,
-                       G_GNUC_UNUSED gpointer data,
-                       GError **error)
+restart_callback (G_GNUC_UNUSED const gchar *option_name,
+                  const gchar *value,
+                  G_GNUC_UNUSED gpointer data,
+                  GError **error)
 {
-  long val;
-  char *end;
-
-  if (strcmp (value, "share-display") == 0)
-    {
-      opt_sandbox_flags |= FLATPAK_SPAWN_SANDBOX_FLAGS_SHARE_DISPLAY;
-      return TRUE;
-    }
-
-  if (strcmp (value, "share-sound") == 0)
-    {
-      opt_sandbox_flags |= FLATPAK_SPAWN_SANDBOX_FLAGS_SHARE_SOUND;
-      return TRUE;
-    }
-
-  if (strcmp (value, "share-gpu") == 0)
-    {
-      opt_sandbox_flags |= FLATPAK_SPAWN_SANDBOX_FLAGS_SHARE_GPU;
-      return TRUE;
-    }
-
-  if (strcmp (value, "allow-dbus") == 0)
-    {
-      opt_sandbox_flags |= FLATPAK_SPAWN_SANDBOX_FLAGS_ALLOW_DBUS;
-      return TRUE;
-    }
-
-  if (strcmp (value, "allow-a11y") == 0)
-    {
-      opt_sandbox_flags |= FLATPAK_SPAWN_SANDBOX_FLAGS_ALLOW_A11Y;
-      return TRUE;
-    }
-
-  val = strtol (value, &end, 10);
-  if (val > 0 && *end == 0)
+  if (strcmp (value, "no") == 0)
+    opt_restart = RESTART_NO;
+  else if (strcmp (value, "on-failure") == 0)
+    opt_restart = RESTART_ON_FAILURE;
+  else if (strcmp (value, "always") == 0)
+    opt_restart = RESTART_ALWAYS;
+  else
     {
-      opt_sandbox_flags |= val;
-      return TRUE;
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "Unknown restart mode %s", value);
+      return FALSE;
     }
 
-  g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
-               "Unknown sandbox flag %s", value);
-  return FALSE;
+  return TRUE;
 }
 
-static GPtrArray *sandbox_a11y_own_names = NULL;
+static GPtrArray *opt_sandbox_a11y_own_names = NULL;
 
 static gboolean
 sandbox_a11y_own_name_callback (G_GNUC_UNUSED const gchar *option_name,
@@ -378,9 +525,6 @@ sandbox_a11y_own_name_callback (G_GNUC_UNUSED const gchar *option_name,
                                 G_GNUC_UNUSED gpointer data,
                                 GError **error)
 {
-  if (sandbox_a11y_own_names == NULL)
-    sandbox_a11y_own_names = g_ptr_array_new ();
-
   if (!g_dbus_is_name (value) || g_dbus_is_unique_name (value))
     {
       g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
@@ -388,92 +532,11 @@ sandbox_a11y_own_name_callback (G_GNUC_UNUSED const gchar *option_name,
       return FALSE;
     }
 
-  g_ptr_array_add (sandbox_a11y_own_names, g_strdup (value));
-  return TRUE;
-}
-
-static guint32
-get_portal_version (void)
-{
-  static guint32 version = 0;
-
-  if (version == 0)
-    {
-      g_autoptr(GError) error = NULL;
-      g_autoptr(GVariant) reply =
-        g_dbus_connection_call_sync (session_bus,
-                                     service_bus_name,
-                                     service_obj_path,
-                                     "org.freedesktop.DBus.Properties",
-                                     "Get",
-                                     g_variant_new ("(ss)", service_iface, "version"),
-                                     G_VARIANT_TYPE ("(v)"),
-                                     G_DBUS_CALL_FLAGS_NONE,
-                                     -1,
-                                     NULL, &error);
-
-      if (reply == NULL)
-        g_debug ("Failed to get version: %s", error->message);
-      else
-        {
-          g_autoptr(GVariant) v = g_variant_get_child_value (reply, 0);
-          g_autoptr(GVariant) v2 = g_variant_get_variant (v);
-          version = g_variant_get_uint32 (v2);
-        }
-    }
-
-  return version;
-}
-
-static void
-check_portal_version (const char *option, guint32 version_needed)
-{
-  guint32 portal_version = get_portal_version ();
-  if (portal_version < version_needed)
-    {
-      g_printerr ("--%s not supported by host portal version (need version %d, has %d)\n", option, version_needed, portal_version);
-      exit (1);
-    }
-}
-
-static guint32
-get_portal_supports (void)
-{
-  static guint32 supports = 0;
-  static gboolean ran = FALSE;
+  if (opt_sandbox_a11y_own_names == NULL)
+    opt_sandbox_a11y_own_names = g_ptr_array_new_with_free_func (g_free);
 
-  if (!ran)
-    {
-      g_autoptr(GError) error = NULL;
-      g_autoptr(GVariant) reply = NULL;
-
-      ran = TRUE;
-
-      /* Support flags were added in version 3 */
-      if (get_portal_version () >= 3)
-        {
-          reply = g_dbus_connection_call_sync (session_bus,
-                                               service_bus_name,
-                                               service_obj_path,
-                                               "org.freedesktop.DBus.Properties",
-                                               "Get",
-                                               g_variant_new ("(ss)", service_iface, "supports"),
-                                               G_VARIANT_TYPE ("(v)"),
-                                               G_DBUS_CALL_FLAGS_NONE,
-                                               -1,
-                                               NULL, &error);
-          if (reply == NULL)
-            g_debug ("Failed to get supports: %s", error->message);
-          else
-            {
-              g_autoptr(GVariant) v = g_variant_get_child_value (reply, 0);
-              g_autoptr(GVariant) v2 = g_variant_get_variant (v);
-              supports = g_variant_get_uint32 (v2);
-            }
-        }
-    }
-
-  return supports;
+  g_ptr_array_add (opt_sandbox_a11y_own_names, g_strdup (value));
+  return TRUE;
 }
 
 #define NOT_SETUID_ROOT_MESSAGE \
@@ -488,309 +551,213 @@ get_portal_supports (void)
 "\n"
 
 static void
-check_portal_supports (const char *option, guint32 supports_needed)
-{
-  guint32 supports = get_portal_supports ();
-
-  if ((supports & supports_needed) != supports_needed)
-    {
-      g_printerr ("--%s not supported by host portal\n", option);
-
-      if (supports_needed == FLATPAK_SPAWN_SUPPORT_FLAGS_EXPOSE_PIDS)
-        g_printerr ("\n%s", NOT_SETUID_ROOT_MESSAGE);
-
-      exit (1);
-    }
-}
-
-/*
- * @str: A path
- * @prefix: A possible prefix
- *
- * The same as flatpak_has_path_prefix(), but instead of a boolean,
- * return the part of @str after @prefix (non-%NULL but possibly empty)
- * if @str has prefix @prefix, or %NULL if it does not.
- *
- * Returns: (nullable) (transfer none): the part of @str after @prefix,
- *  or %NULL if @str is not below @prefix
- */
-static const char *
-get_path_after (const char *str,
-                const char *prefix)
+add_paths_to_launcher (const GStrv paths,
+                       FlatpakSpawnExposeFlags flags)
 {
-  while (TRUE)
-    {
-      /* Skip consecutive slashes to reach next path
-         element */
-      while (*str == '/')
-        str++;
-      while (*prefix == '/')
-        prefix++;
-
-      /* No more prefix path elements? Done! */
-      if (*prefix == 0)
-        return str;
-
-      /* Compare path element */
-      while (*prefix != 0 && *prefix != '/')
-        {
-          if (*str != *prefix)
-            return NULL;
-          str++;
-          prefix++;
-        }
+  if (!paths)
+    return;
 
-      /* Matched prefix path element,
-         must be entire str path element */
-      if (*str != '/' && *str != 0)
-        return NULL;
-    }
+  for (gsize i = 0; paths[i] != NULL; i++)
+    flatpak_spawn_launcher_sandbox_expose_path (launcher, paths[i], flags);
 }
 
-static gint32
-path_to_handle (GUnixFDList *fd_list,
-                const char *path,
-                const char *home_realpath,
-                const char *flatpak_id,
-                GError **error)
+static void
+report_spawn_error (const GError *error)
 {
-  int path_fd = open (path, O_PATH|O_CLOEXEC|O_NOFOLLOW|O_RDONLY);
-  int saved_errno;
-  gint32 handle;
-
-  if (path_fd < 0)
+  if (deadline_error_is_timeout (error))
     {
-      saved_errno = errno;
-      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
-                   "Failed to open %s to expose in sandbox: %s",
-                   path, g_strerror (saved_errno));
-      return -1;
+      g_printerr ("Timed out waiting for the command to start: %s\n",
+                  error->message);
+      exit_code = DEADLINE_EXIT_STATUS;
+      return;
     }
 
-  if (home_realpath != NULL && flatpak_id != NULL)
-    {
-      g_autofree char *real = NULL;
-      const char *after = NULL;
+  g_printerr ("%s\n", error->message);
 
-      real = realpath (path, NULL);
+  /* The launcher names the API it was asked to use, not our options */
+  if (g_error_matches (error, FLATPAK_SPAWN_ERROR, FLATPAK_SPAWN_ERROR_PORTAL_TOO_OLD))
+    g_printerr ("Hint: one of the options given needs a newer version of Flatpak\n");
 
-      if (real != NULL)
-        after = get_path_after (real, home_realpath);
-
-      if (after != NULL)
-        {
-          g_autofree char *var_path = NULL;
-          int var_fd = -1;
-          struct stat path_buf;
-          struct stat var_buf;
-
-          /* @after is possibly "", but that's OK: if @path is exactly $HOME,
-           * we want to check whether it's the same file as
-           * ~/.var/app/$FLATPAK_ID, with no suffix
-           */
-          var_path = g_build_filename (home_realpath, ".var", "app", flatpak_id,
-                                       after, NULL);
-
-          var_fd = open (var_path, O_PATH|O_CLOEXEC|O_NOFOLLOW|O_RDONLY);
-
-          if (var_fd >= 0 &&
-              fstat (path_fd, &path_buf) == 0 &&
-              fstat (var_fd, &var_buf) == 0 &&
-              path_buf.st_dev == var_buf.st_dev &&
-              path_buf.st_ino == var_buf.st_ino)
-            {
-              close (path_fd);
-              path_fd = var_fd;
-              var_fd = -1;
-            }
-          else
-            {
-              close (var_fd);
-            }
-        }
-    }
+  if (g_error_matches (error, FLATPAK_SPAWN_ERROR, FLATPAK_SPAWN_ERROR_NOT_SUPPORTED))
+    g_printerr ("\n%s", NOT_SETUID_ROOT_MESSAGE);
 
+  if (opt_host && g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN))
+    g_printerr ("Hint: --host only works when the Flatpak is allowed to talk to org.freedesktop.Flatpak\n");
 
-  handle = g_unix_fd_list_append (fd_list, path_fd, error);
-
-  if (handle < 0)
-    {
-      g_prefix_error (error, "Failed to add fd to list for %s: ", path);
-      close (path_fd);
-      return -1;
-    }
-
-  /* The GUnixFdList keeps a duplicate, so we should release the original */
-  close (path_fd);
-  return handle;
+  exit_code = 1;
 }
 
-static gboolean
-add_paths_to_variant (GVariantBuilder *builder,
-                      GUnixFDList *fd_list,
-                      const GStrv paths,
-                      const char *home_realpath,
-                      const char *flatpak_id,
-                      gboolean ignore_errors)
+static void
+spawn_cb (G_GNUC_UNUSED GObject *source,
+          GAsyncResult          *result,
+          gpointer               user_data)
 {
+  GMainLoop *loop = user_data;
   g_autoptr(GError) error = NULL;
 
-  if (!paths)
-    return TRUE;
+  child_process = flatpak_spawn_launcher_spawn_finish (launcher, result, &error);
+  startup_trace ("spawn finished");
+  g_clear_object (&exited_process);
 
-  for (gsize i = 0; paths[i] != NULL; i++)
+  /* Release our reference to the fds, so that only the copy we sent over
+   * D-Bus remains open, unless we might need to send them again */
+  if (opt_restart == RESTART_NO)
+    g_clear_object (&launcher);
+
+  if (child_process == NULL)
     {
-      gint32 handle = path_to_handle (fd_list, paths[i], home_realpath,
-                                      flatpak_id,
-                                      ignore_errors ? NULL : &error);
+      report_spawn_error (error);
 
-      if (handle < 0)
+      /* Failing to start the command the first time is more likely to be
+       * a mistake on the command line than something that will go away */
+      if (n_restarts > 0 && should_restart ())
         {
-          if (ignore_errors)
-            continue;
-
-          g_printerr ("%s\n", error->message);
-          return FALSE;
+          child_started_time = 0;
+          schedule_restart (loop);
+          return;
         }
 
-      g_variant_builder_add (builder, "h", handle);
+      g_main_loop_quit (loop);
+      return;
     }
 
-  return TRUE;
-}
+  child_started_time = g_get_monotonic_time ();
 
-static GHashTable *opt_env = NULL;
-static GHashTable *opt_unsetenv = NULL;
+  if (n_restarts > 0)
+    g_printerr ("Restarted command as pid %u (restart %u), %.1f ms after it exited including %u ms backoff\n",
+                flatpak_spawn_process_get_pid (child_process), n_restarts,
+                (child_started_time - child_exited_time) / 1000.0,
+                last_restart_delay_ms);
+
+  flatpak_spawn_process_wait_async (child_process, NULL, child_exited_cb, loop);
+}
 
+#ifdef ENABLE_WIRE_DBUS
+/*
+ * The common case needs neither the service's version nor any options,
+ * so it can be done in one round-trip on a connection of our own,
+ * without GDBus and its worker thread. Returns FALSE if we could not
+ * connect, in which case the caller should use the launcher instead;
+ * otherwise the command has run, or failed to start (perhaps because
+ * the deadline passed while connecting), and exit_code is set.
+ */
 static gboolean
-opt_env_cb (G_GNUC_UNUSED const char *option_name,
-            const gchar *value,
-            G_GNUC_UNUSED gpointer data,
-            GError **error)
+run_with_wire (const char * const *argv,
+               const char         *cwd,
+               const int          *fds,
+               const guint32      *targets,
+               guint               n_fds,
+               guint32             flags,
+               guint32             watch_bus_flag,
+               int                 sfd)
 {
-  g_auto(GStrv) split = g_strsplit (value, "=", 2);
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *current_dir = NULL;
+  FlatpakSpawnWire *wire;
+  guint32 pid;
+  guint i;
 
-  g_assert (opt_env != NULL);
-  g_assert (opt_unsetenv != NULL);
+  wire = flatpak_spawn_wire_connect (deadline_get_end_time (), &error);
 
-  if (split == NULL ||
-      split[0] == NULL ||
-      split[0][0] == 0 ||
-      split[1] == NULL)
+  /* GDBus would not get any further in the time left */
+  if (wire == NULL && deadline_error_is_timeout (error))
     {
-      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
-                   "Invalid env format %s", value);
-      return FALSE;
+      report_spawn_error (error);
+      return TRUE;
     }
 
-  g_hash_table_remove (opt_unsetenv, split[0]);
-  g_hash_table_replace (opt_env,
-                        g_steal_pointer (&split[0]),
-                        g_steal_pointer (&split[1]));
-  return TRUE;
-}
-
-static gboolean
-opt_unset_env_cb (G_GNUC_UNUSED const char *option_name,
-                  const gchar *value,
-                  G_GNUC_UNUSED gpointer data,
-                  G_GNUC_UNUSED GError **error)
-{
-  g_assert (opt_env != NULL);
-  g_assert (opt_unsetenv != NULL);
-
-  g_hash_table_remove (opt_env, value);
-  g_hash_table_add (opt_unsetenv, g_strdup (value));
-  return TRUE;
-}
+  if (wire == NULL)
+    {
+      g_debug ("Not using the built-in D-Bus client: %s", error->message);
+      return FALSE;
+    }
 
-static gboolean
-option_env_fd_cb (G_GNUC_UNUSED const gchar *option_name,
-                  const gchar *value,
-                  G_GNUC_UNUSED gpointer data,
-                  GError **error)
-{
-  g_autofree gchar *proc_filename = NULL;
-  g_autofree gchar *env_block = NULL;
-  gsize remaining;
-  const char *p;
-  guint64 fd;
-  gchar *endptr;
+  startup_trace ("bus connected");
 
-  g_assert (opt_env != NULL);
-  g_assert (opt_unsetenv != NULL);
+  if (cwd == NULL)
+    cwd = current_dir = g_get_current_dir ();
 
-  fd = g_ascii_strtoull (value, &endptr, 10);
+  startup_trace ("spawning");
 
-  if (endptr == NULL || *endptr != '\0' || fd > G_MAXINT)
+  if (!flatpak_spawn_wire_spawn (wire, opt_host, cwd, argv, fds, targets,
+                                 n_fds, opts.env, flags, watch_bus_flag,
+                                 &error))
     {
-      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
-                   "Not a valid file descriptor: %s", value);
-      return FALSE;
+      startup_trace ("spawn finished");
+      report_spawn_error (error);
+      flatpak_spawn_wire_free (wire);
+      return TRUE;
     }
 
-  proc_filename = g_strdup_printf ("/proc/self/fd/%d", (int) fd);
-
-  if (!g_file_get_contents (proc_filename, &env_block, &remaining, error))
-    return FALSE;
+  startup_trace ("spawn finished");
+  wire_child = wire;
+  pid = flatpak_spawn_wire_get_pid (wire);
+  g_debug ("child_pid: %d", pid);
 
-  p = env_block;
+  /* As in spawn_cb(), only the copies we sent should remain open */
+  for (i = 0; i < n_fds; i++)
+    {
+      if (fds[i] > 2)
+        close (fds[i]);
+    }
 
-  while (remaining > 0)
+  while (TRUE)
     {
-      g_autofree gchar *var = NULL;
-      g_autofree gchar *val = NULL;
-      size_t len = strnlen (p, remaining);
-      const char *equals;
+      struct pollfd pfds[2];
+      int wait_status = 0;
 
-      g_assert (len <= remaining);
+      if (flatpak_spawn_wire_check_exited (wire, &wait_status, &error))
+        {
+          child_finished (pid, wait_status, error);
+          break;
+        }
 
-      equals = memchr (p, '=', len);
+      pfds[0].fd = flatpak_spawn_wire_get_fd (wire);
+      pfds[0].events = POLLIN;
+      pfds[1].fd = sfd;
+      pfds[1].events = POLLIN;
 
-      if (equals == NULL || equals == p)
+      if (poll (pfds, G_N_ELEMENTS (pfds), -1) < 0)
         {
-          g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
-                       "Environment variable must be given in the form VARIABLE=VALUE, not %.*s",
-                       (int) len, p);
-          return FALSE;
-        }
+          if (errno == EINTR)
+            continue;
 
-      var = g_strndup (p, equals - p);
-      val = g_strndup (equals + 1, len - (equals - p) - 1);
-      g_hash_table_remove (opt_unsetenv, var);
-      g_hash_table_replace (opt_env,
-                            g_steal_pointer (&var),
-                            g_steal_pointer (&val));
+          g_warning ("Unable to poll: %s", g_strerror (errno));
+          exit_code = 1;
+          break;
+        }
 
-      p += len;
-      remaining -= len;
+      if (pfds[1].revents & POLLIN)
+        read_forwarded_signal (sfd);
 
-      if (remaining > 0)
+      if (pfds[0].revents != 0 &&
+          !flatpak_spawn_wire_dispatch (wire, &error))
         {
-          g_assert (*p == '\0');
-          p += 1;
-          remaining -= 1;
+          child_finished (pid, 0, error);
+          break;
         }
     }
 
-  if (fd >= 3)
-    close (fd);
-
+  wire_child = NULL;
+  flatpak_spawn_wire_free (wire);
   return TRUE;
 }
+#endif
 
 int
-main (int    argc,
-      char **argv)
+FLATPAK_XDG_UTILS_MAIN (flatpak_spawn) (int    argc,
+                                        char **argv)
 {
   GMainLoop *loop;
   g_autoptr(GError) error = NULL;
   GOptionContext *context;
+  GOptionGroup *main_group;
   g_autoptr(GPtrArray) child_argv = NULL;
+  g_autoptr(GDBusConnection) session_bus = NULL;
   int i, opt_argc;
   gboolean verbose = FALSE;
   char **forward_fds = NULL;
-  guint spawn_flags;
+  FlatpakSpawnLauncherFlags launcher_flags;
   gboolean opt_clear_env = FALSE;
   gboolean opt_watch_bus = FALSE;
   gboolean opt_expose_pids = FALSE;
@@ -807,10 +774,7 @@ main (int    argc,
   char *opt_directory = NULL;
   char *opt_app_path = NULL;
   char *opt_usr_path = NULL;
-  g_autofree char *cwd = NULL;
-  g_autofree char *home_realpath = NULL;
-  const char *flatpak_id = NULL;
-  GVariantBuilder options_builder;
+  gboolean opt_translate_paths = FALSE;
   const GOptionEntry options[] = {
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,  "Enable debug output", NULL },
     { "forward-fd", 0, 0, G_OPTION_ARG_STRING_ARRAY, &forward_fds,  "Forward file descriptor", "FD" },
@@ -818,9 +782,9 @@ main (int    argc,
     { "watch-bus", 0, 0, G_OPTION_ARG_NONE, &opt_watch_bus,  "Make the spawned command exit if we do", NULL },
     { "expose-pids", 0, 0, G_OPTION_ARG_NONE, &opt_expose_pids, "Expose sandbox pid in calling sandbox", NULL },
     { "share-pids", 0, 0, G_OPTION_ARG_NONE, &opt_share_pids, "Use same pid namespace as calling sandbox", NULL },
-    { "env", 0, 0, G_OPTION_ARG_CALLBACK, &opt_env_cb, "Set environment variable", "VAR=VALUE" },
-    { "unset-env", 0, 0, G_OPTION_ARG_CALLBACK, &opt_unset_env_cb, "Unset environment variable", "VAR=VALUE" },
-    { "env-fd", 0, 0, G_OPTION_ARG_CALLBACK, &option_env_fd_cb, "Read environment variables in env -0 format from FD", "FD" },
+    { "env", 0, 0, G_OPTION_ARG_CALLBACK, flatpak_spawn_options_env_cb, "Set environment variable", "VAR=VALUE" },
+    { "unset-env", 0, 0, G_OPTION_ARG_CALLBACK, flatpak_spawn_options_unset_env_cb, "Unset environment variable", "VAR=VALUE" },
+    { "env-fd", 0, 0, G_OPTION_ARG_CALLBACK, flatpak_spawn_options_env_fd_cb, "Read environment variables in env -0 format from FD", "FD" },
     { "latest-version", 0, 0, G_OPTION_ARG_NONE, &opt_latest_version,  "Run latest version", NULL },
     { "sandbox", 0, 0, G_OPTION_ARG_NONE, &opt_sandbox,  "Run sandboxed", NULL },
     { "no-network", 0, 0, G_OPTION_ARG_NONE, &opt_no_network,  "Run without network access", NULL },
@@ -830,35 +794,52 @@ main (int    argc,
     { "sandbox-expose-path-ro", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_sandbox_expose_path_ro, "Expose readonly access to path", "PATH" },
     { "sandbox-expose-path-try", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_sandbox_expose_path_try, "Expose access to path if it exists", "PATH" },
     { "sandbox-expose-path-ro-try", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_sandbox_expose_path_ro_try, "Expose readonly access to path if it exists", "PATH" },
-    { "sandbox-flag", 0, 0, G_OPTION_ARG_CALLBACK, sandbox_flag_callback, "Enable sandbox flag", "FLAG" },
+    { "sandbox-flag", 0, 0, G_OPTION_ARG_CALLBACK, flatpak_spawn_options_sandbox_flag_cb, "Enable sandbox flag", "FLAG" },
     { "sandbox-a11y-own-name", 0, 0, G_OPTION_ARG_CALLBACK, sandbox_a11y_own_name_callback, "Allow owning the name on the a11y bus", "DBUS_NAME" },
     { "host", 0, 0, G_OPTION_ARG_NONE, &opt_host, "Start the command on the host", NULL },
     { "directory", 0, 0, G_OPTION_ARG_FILENAME, &opt_directory, "Working directory in which to run the command", "DIR" },
     { "app-path", 0, 0, G_OPTION_ARG_FILENAME, &opt_app_path, "Replace runtime's /app with DIR or empty", "DIR|\"\"" },
     { "usr-path", 0, 0, G_OPTION_ARG_FILENAME, &opt_usr_path, "Replace runtime's /usr with DIR", "DIR" },
+    { "deadline", 0, 0, G_OPTION_ARG_CALLBACK, deadline_option_cb, "Give up if the command has not started after SECONDS", "SECONDS" },
+    { "restart", 0, 0, G_OPTION_ARG_CALLBACK, restart_callback, "Restart the command when it exits: no, on-failure or always", "WHEN" },
+    { "restart-limit", 0, 0, G_OPTION_ARG_INT, &opt_restart_limit, "Restart the command at most N times, or 0 for no limit (default 5)", "N" },
+    { "translate-paths", 0, 0, G_OPTION_ARG_NONE, &opt_translate_paths, "Translate the directory and absolute paths in the command to host paths", NULL },
     { NULL }
   };
+  g_autoptr(GArray) forwarded = NULL;
+  g_autoptr(GPtrArray) translated = NULL;
   guint signal_source = 0;
   GHashTableIter iter;
   gpointer key, value;
+  int sfd;
 
-  setlocale (LC_ALL, "");
+  startup_trace ("main");
+
+  setlocale (LC_CTYPE, "");
+  g_set_print_handler (print_handler);
+  g_set_printerr_handler (printerr_handler);
 
   g_setenv ("GIO_USE_VFS", "local", TRUE);
 
   g_set_prgname (argv[0]);
 
-  child_argv = g_ptr_array_new ();
+  flatpak_spawn_options_init (&opts);
 
-  cwd = g_get_current_dir ();
+  child_argv = g_ptr_array_new ();
 
   i = 1;
   while (i < argc && argv[i][0] == '-')
-    i++;
+    {
+      /* GOption translates the help as it builds it */
+      if (g_str_has_prefix (argv[i], "--help") ||
+          strcmp (argv[i], "-h") == 0 ||
+          strcmp (argv[i], "-?") == 0)
+        ensure_locale ();
+
+      i++;
+    }
 
   opt_argc = i;
-  opt_env = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-  opt_unsetenv = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
   while (i < argc)
     {
@@ -870,7 +851,11 @@ main (int    argc,
   context = g_option_context_new ("COMMAND [ARGUMENT…]");
 
   g_option_context_set_summary (context, "Run a command in a sandbox");
-  g_option_context_add_main_entries (context, options, GETTEXT_PACKAGE);
+  /* The options' callbacks get the state they build up as user data */
+  main_group = g_option_group_new (NULL, NULL, NULL, &opts, NULL);
+  g_option_group_add_entries (main_group, options);
+  g_option_group_set_translation_domain (main_group, GETTEXT_PACKAGE);
+  g_option_context_set_main_group (context, main_group);
 
   if (!g_option_context_parse (context, &opt_argc, &argv, &error) ||
       !command_specified (child_argv, &error))
@@ -884,478 +869,338 @@ main (int    argc,
       return 1;
     }
 
+  startup_trace ("options parsed");
+
   if (verbose)
     g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, message_handler, NULL);
 
-  /* We have to block the signals we want to forward before we start any
-   * other thread, and in particular the GDBus worker thread, because
-   * the signal mask is per-thread. We need all threads to have the same
-   * mask, otherwise a thread that doesn't have the mask will receive
-   * process-directed signals, causing the whole process to exit. */
-  signal_source = forward_signals ();
-
-  if (signal_source == 0)
-    return 1;
-
-  flatpak_id = g_getenv ("FLATPAK_ID");
-
-  if (flatpak_id != NULL)
-    home_realpath = realpath (g_get_home_dir (), NULL);
-
-  session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
-  if (session_bus == NULL)
+  if (opt_restart_limit < 0)
     {
-      g_printerr ("Can't find bus: %s\n", error->message);
+      g_printerr ("--restart-limit must not be negative\n");
       return 1;
     }
 
-  if (opt_host)
-    {
-      service_iface = FLATPAK_SESSION_HELPER_INTERFACE_DEVELOPMENT;
-      service_obj_path = FLATPAK_SESSION_HELPER_PATH_DEVELOPMENT;
-      service_bus_name = FLATPAK_SESSION_HELPER_BUS_NAME;
-    }
-  else
+  /* FLATPAK_SPAWN_RESTART_DELAY_MS is for tests that need to act during
+   * the backoff, without racing the default 100ms */
+  if (g_getenv ("FLATPAK_SPAWN_RESTART_DELAY_MS") != NULL)
     {
-      service_iface = FLATPAK_PORTAL_INTERFACE;
-      service_obj_path = FLATPAK_PORTAL_PATH;
-      service_bus_name = FLATPAK_PORTAL_BUS_NAME;
-    }
+      guint64 delay = g_ascii_strtoull (g_getenv ("FLATPAK_SPAWN_RESTART_DELAY_MS"), NULL, 10);
 
-  g_dbus_connection_signal_subscribe (session_bus,
-                                      NULL,
-                                      service_iface,
-                                      opt_host ? "HostCommandExited" : "SpawnExited",
-                                      service_obj_path,
-                                      NULL,
-                                      G_DBUS_SIGNAL_FLAGS_NONE,
-                                      spawn_exited_cb,
-                                      NULL, NULL);
-
-  g_autoptr(GVariantBuilder) fd_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{uh}"));
-  g_autoptr(GVariantBuilder) env_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{ss}"));
-  g_autoptr(GUnixFDList) fd_list = g_unix_fd_list_new ();
-  gint stdin_handle = -1;
-  gint stdout_handle = -1;
-  gint stderr_handle = -1;
-
-  stdin_handle = g_unix_fd_list_append (fd_list, 0, &error);
-  if (stdin_handle == -1)
-    {
-      g_printerr ("Can't append fd: %s\n", error->message);
-      return 1;
-    }
-  stdout_handle = g_unix_fd_list_append (fd_list, 1, &error);
-  if (stdout_handle == -1)
-    {
-      g_printerr ("Can't append fd: %s\n", error->message);
-      return 1;
-    }
-  stderr_handle = g_unix_fd_list_append (fd_list, 2, &error);
-  if (stderr_handle == -1)
-    {
-      g_printerr ("Can't append fd: %s\n", error->message);
-      return 1;
+      restart_delay_min_ms = CLAMP (delay, 1, RESTART_DELAY_MAX_MS);
+      restart_delay_ms = restart_delay_min_ms;
     }
 
-  g_variant_builder_add (fd_builder, "{uh}", 0, stdin_handle);
-  g_variant_builder_add (fd_builder, "{uh}", 1, stdout_handle);
-  g_variant_builder_add (fd_builder, "{uh}", 2, stderr_handle);
-  g_autoptr(GVariant) reply = NULL;
+  spawn_argv = (const char * const *) child_argv->pdata;
 
-  for (i = 0; forward_fds != NULL && forward_fds[i] != NULL; i++)
+  if (opt_host)
     {
-      int fd = strtol (forward_fds[i],  NULL, 10);
-      gint handle = -1;
-
-      if (fd == 0)
+      const struct {
+        gboolean used;
+        const char *option;
+      } not_with_host[] = {
+        { opt_share_pids, "share-pids" },
+        { opt_expose_pids, "expose-pids" },
+        { opt_latest_version, "latest-version" },
+        { opt_sandbox, "sandbox" },
+        { opt_no_network, "no-network" },
+        { opt_sandbox_expose != NULL, "sandbox-expose" },
+        { opt_sandbox_expose_ro != NULL, "sandbox-expose-ro" },
+        { opts.sandbox_flags != 0, "sandbox-flag" },
+        { opt_sandbox_expose_path != NULL || opt_sandbox_expose_path_try != NULL, "sandbox-expose-path" },
+        { opt_sandbox_expose_path_ro != NULL || opt_sandbox_expose_path_ro_try != NULL, "sandbox-expose-path-ro" },
+        { opt_sandbox_a11y_own_names != NULL, "sandbox-a11y-own-name" },
+        { opt_app_path != NULL, "app-path" },
+        { opt_usr_path != NULL, "usr-path" },
+      };
+
+      for (gsize j = 0; j < G_N_ELEMENTS (not_with_host); j++)
         {
-          g_printerr ("Invalid fd '%s'\n", forward_fds[i]);
-          return 1;
+          if (not_with_host[j].used)
+            {
+              g_printerr ("--host not compatible with --%s\n", not_with_host[j].option);
+              return 1;
+            }
         }
+    }
 
-      if (fd >= 0 && fd <= 2)
-        continue; // We always forward these
+  if (opt_translate_paths)
+    {
+      g_autoptr(FlatpakSpawnPathMap) map = NULL;
+      g_autofree char *cache_path = NULL;
+      const char *runtime_dir = g_getenv ("XDG_RUNTIME_DIR");
 
-      handle = g_unix_fd_list_append (fd_list, fd, &error);
-      if (handle == -1)
+      if (!opt_host)
         {
-          g_printerr ("Can't append fd: %s\n", error->message);
+          g_printerr ("--translate-paths requires --host\n");
           return 1;
         }
-      /* The GUnixFdList keeps a duplicate, so we should release the original */
-      close (fd);
-      g_variant_builder_add (fd_builder, "{uh}", fd, handle);
-    }
-
-  g_hash_table_iter_init (&iter, opt_env);
 
-  while (g_hash_table_iter_next (&iter, &key, &value))
-    g_variant_builder_add (env_builder, "{ss}", key, value);
-
-  g_clear_pointer (&opt_env, g_hash_table_unref);
+      /* Only a real runtime directory is worth caching in: it is private
+       * to the sandbox and goes away with the session */
+      if (runtime_dir != NULL && runtime_dir[0] == '/')
+        cache_path = g_build_filename (runtime_dir, ".flatpak-spawn-paths", NULL);
 
-  spawn_flags = 0;
-
-  if (opt_clear_env)
-    spawn_flags |= opt_host ? FLATPAK_HOST_COMMAND_FLAGS_CLEAR_ENV : FLATPAK_SPAWN_FLAGS_CLEAR_ENV;
+      map = flatpak_spawn_path_map_load (cache_path, "/.flatpak-info",
+                                         "/proc/self/mountinfo", &error);
 
-  if (opt_watch_bus)
-    spawn_flags |= opt_host ? FLATPAK_HOST_COMMAND_FLAGS_WATCH_BUS : FLATPAK_SPAWN_FLAGS_WATCH_BUS;
-
-  if (opt_share_pids)
-    {
-      if (opt_host)
+      if (map == NULL)
         {
-          g_printerr ("--host not compatible with --share-pids\n");
+          g_printerr ("Unable to translate paths: %s\n", error->message);
           return 1;
         }
 
-      check_portal_version ("share-pids", 5);
-      check_portal_supports ("share-pids", FLATPAK_SPAWN_SUPPORT_FLAGS_SHARE_PIDS);
+      startup_trace ("path map loaded");
 
-      spawn_flags |= FLATPAK_SPAWN_FLAGS_SHARE_PIDS;
-    }
-  else if (opt_expose_pids)
-    {
-      if (opt_host)
+      translated = g_ptr_array_new_with_free_func (g_free);
+
+      if (opt_directory == NULL)
         {
-          g_printerr ("--host not compatible with --expose-pids\n");
-          return 1;
+          opt_directory = g_get_current_dir ();
+          g_ptr_array_add (translated, opt_directory);
         }
 
-      check_portal_version ("expose-pids", 3);
-      check_portal_supports ("expose-pids", FLATPAK_SPAWN_SUPPORT_FLAGS_EXPOSE_PIDS);
+      opt_directory = flatpak_spawn_path_map_translate (map, opt_directory);
+      g_ptr_array_add (translated, opt_directory);
+      g_debug ("Running in %s on the host", opt_directory);
 
-      spawn_flags |= FLATPAK_SPAWN_FLAGS_EXPOSE_PIDS;
+      flatpak_spawn_path_map_translate_args (map, (char **) child_argv->pdata,
+                                             translated);
     }
 
-  if (opt_latest_version)
-    {
-      if (opt_host)
-        {
-          g_printerr ("--host not compatible with --latest-version\n");
-          return 1;
-        }
-      spawn_flags |= FLATPAK_SPAWN_FLAGS_LATEST_VERSION;
-    }
+  /* stdin, stdout and stderr are always forwarded */
+  forwarded = g_array_new (FALSE, FALSE, sizeof (int));
 
-  if (opt_sandbox)
+  for (i = 0; forward_fds != NULL && forward_fds[i] != NULL; i++)
     {
-      if (opt_host)
-        {
-          g_printerr ("--host not compatible with --sandbox\n");
-          return 1;
-        }
-      spawn_flags |= FLATPAK_SPAWN_FLAGS_SANDBOX;
-    }
+      gchar *endptr = NULL;
+      gint64 value = g_ascii_strtoll (forward_fds[i], &endptr, 10);
+      int fd;
 
-  if (opt_no_network)
-    {
-      if (opt_host)
+      if (endptr == forward_fds[i] || *endptr != '\0' || value < 0 || value > G_MAXINT)
         {
-          g_printerr ("--host not compatible with --no-network\n");
+          g_printerr ("Invalid fd '%s'\n", forward_fds[i]);
           return 1;
         }
-      spawn_flags |= FLATPAK_SPAWN_FLAGS_NO_NETWORK;
-    }
 
-  g_variant_builder_init (&options_builder, G_VARIANT_TYPE ("a{sv}"));
+      fd = value;
 
-  if (g_hash_table_size (opt_unsetenv) > 0)
-    {
-      g_hash_table_iter_init (&iter, opt_unsetenv);
-
-      /* The host portal doesn't support options, so we always have to do
-       * this the hard way. The subsandbox portal supports unset-env in
-       * versions >= 5. */
-      if (opt_host ? FALSE : (get_portal_version () >= 5))
-        {
-          GVariantBuilder strv_builder;
+      if (fd <= 2)
+        continue; // We always forward these
 
-          g_variant_builder_init (&strv_builder, G_VARIANT_TYPE_STRING_ARRAY);
+      g_array_append_val (forwarded, fd);
+    }
 
-          while (g_hash_table_iter_next (&iter, &key, NULL))
-            g_variant_builder_add (&strv_builder, "s", key);
+  /* We have to block the signals we want to forward before we start any
+   * other thread, and in particular the GDBus worker thread, because
+   * the signal mask is per-thread. We need all threads to have the same
+   * mask, otherwise a thread that doesn't have the mask will receive
+   * process-directed signals, causing the whole process to exit. */
+  sfd = block_forwarded_signals ();
 
-          g_variant_builder_add (&options_builder, "{s@v}", "unset-env",
-                                 g_variant_new_variant (g_variant_builder_end (&strv_builder)));
-        }
-      else
-        {
-          /* env(1) will do the wrong thing if argv[0] contains an equals
-           * sign, so we might need to prepend this incantation - and
-           * because we're prepending, we need to do it backwards.
-           * More legibly, we're replacing MY=COMMAND ARGS with:
-           *
-           *     /usr/bin/env -u VAR -u VAR2 /bin/sh -euc 'exec "$@"' sh MY=COMMAND ARGS
-           *
-           * This is a standard trick for dealing with env(1). */
-          g_assert (child_argv->len >= 1);
-
-          if (strchr (g_ptr_array_index (child_argv, 0), '=') != NULL)
-            {
-              g_ptr_array_insert (child_argv, 0, g_strdup ("sh"));  /* argv[0] */
-              g_ptr_array_insert (child_argv, 0, g_strdup ("exec \"$@\""));
-              g_ptr_array_insert (child_argv, 0, g_strdup ("-euc"));
-              g_ptr_array_insert (child_argv, 0, g_strdup ("/bin/sh"));
-            }
+  if (sfd < 0)
+    return 1;
 
-          while (g_hash_table_iter_next (&iter, &key, NULL))
-            {
-              /* Again, yes, this is backwards: we're prepending. */
-              g_ptr_array_insert (child_argv, 0, g_strdup (key));
-              g_ptr_array_insert (child_argv, 0, g_strdup ("-u"));
-            }
+  startup_trace ("signals blocked");
+
+#ifdef ENABLE_WIRE_DBUS
+  /* Anything that needs the portal's version or a{sv} options goes
+   * through the launcher, as do commands that we might restart.
+   * FLATPAK_SPAWN_WIRE=0 is for comparing the two in benchmarks. */
+  if (g_strcmp0 (g_getenv ("FLATPAK_SPAWN_WIRE"), "0") != 0 &&
+      opt_restart == RESTART_NO &&
+      g_hash_table_size (opts.unset_env) == 0 &&
+      !opt_share_pids &&
+      !opt_expose_pids &&
+      opt_sandbox_expose == NULL &&
+      opt_sandbox_expose_ro == NULL &&
+      opts.sandbox_flags == 0 &&
+      opt_sandbox_expose_path == NULL &&
+      opt_sandbox_expose_path_try == NULL &&
+      opt_sandbox_expose_path_ro == NULL &&
+      opt_sandbox_expose_path_ro_try == NULL &&
+      opt_sandbox_a11y_own_names == NULL &&
+      opt_app_path == NULL &&
+      opt_usr_path == NULL)
+    {
+      g_autoptr(GArray) fds = g_array_new (FALSE, FALSE, sizeof (int));
+      g_autoptr(GArray) targets = g_array_new (FALSE, FALSE, sizeof (guint32));
+      guint32 spawn_flags = 0;
+      guint32 watch_bus_flag = 0;
+      int fd;
 
-          g_ptr_array_insert (child_argv, 0, g_strdup ("/usr/bin/env"));
-        }
-    }
+      for (fd = 0; fd <= 2; fd++)
+        g_array_append_val (fds, fd);
 
-  g_clear_pointer (&opt_unsetenv, g_hash_table_unref);
+      g_array_append_vals (fds, forwarded->data, forwarded->len);
 
-  if (opt_sandbox_expose)
-    {
-      if (opt_host)
+      for (i = 0; i < (int) fds->len; i++)
         {
-          g_printerr ("--host not compatible with --sandbox-expose\n");
-          return 1;
-        }
-      g_variant_builder_add (&options_builder, "{s@v}", "sandbox-expose",
-                             g_variant_new_variant (g_variant_new_strv ((const char * const *)opt_sandbox_expose, -1)));
-    }
+          guint32 target = g_array_index (fds, int, i);
 
-  if (opt_sandbox_expose_ro)
-    {
-      if (opt_host)
-        {
-          g_printerr ("--host not compatible with --sandbox-expose-ro\n");
-          return 1;
+          g_array_append_val (targets, target);
         }
-      g_variant_builder_add (&options_builder, "{s@v}", "sandbox-expose-ro",
-                             g_variant_new_variant (g_variant_new_strv ((const char * const *)opt_sandbox_expose_ro, -1)));
-    }
 
-  if (opt_sandbox_flags)
-    {
       if (opt_host)
         {
-          g_printerr ("--host not compatible with --sandbox-flag\n");
-          return 1;
+          if (opt_clear_env)
+            spawn_flags |= FLATPAK_HOST_COMMAND_FLAGS_CLEAR_ENV;
+
+          if (opt_watch_bus)
+            watch_bus_flag = FLATPAK_HOST_COMMAND_FLAGS_WATCH_BUS;
         }
+      else
+        {
+          if (opt_clear_env)
+            spawn_flags |= FLATPAK_SPAWN_FLAGS_CLEAR_ENV;
 
-      check_portal_version ("sandbox-flags", 3);
+          if (opt_watch_bus)
+            watch_bus_flag = FLATPAK_SPAWN_FLAGS_WATCH_BUS;
 
-      g_variant_builder_add (&options_builder, "{s@v}", "sandbox-flags",
-                             g_variant_new_variant (g_variant_new_uint32 (opt_sandbox_flags)));
-    }
+          if (opt_latest_version)
+            spawn_flags |= FLATPAK_SPAWN_FLAGS_LATEST_VERSION;
 
-  if (opt_sandbox_expose_path || opt_sandbox_expose_path_try)
-    {
-      g_autoptr(GVariantBuilder) expose_fd_builder = g_variant_builder_new (G_VARIANT_TYPE ("ah"));
+          if (opt_sandbox)
+            spawn_flags |= FLATPAK_SPAWN_FLAGS_SANDBOX;
 
-      if (opt_host)
-        {
-          g_printerr ("--host not compatible with --sandbox-expose-path\n");
-          return 1;
+          if (opt_no_network)
+            spawn_flags |= FLATPAK_SPAWN_FLAGS_NO_NETWORK;
         }
 
-      check_portal_version ("sandbox-expose-path", 3);
+      if (run_with_wire ((const char * const *) child_argv->pdata,
+                         opt_directory,
+                         (const int *) fds->data,
+                         (const guint32 *) targets->data,
+                         fds->len,
+                         spawn_flags | watch_bus_flag,
+                         watch_bus_flag,
+                         sfd))
+        {
+          g_option_context_free (context);
+          return exit_code;
+        }
+    }
+#endif
 
-      if (!add_paths_to_variant (expose_fd_builder, fd_list, opt_sandbox_expose_path, home_realpath, flatpak_id, FALSE)
-          || !add_paths_to_variant (expose_fd_builder, fd_list, opt_sandbox_expose_path_try, home_realpath, flatpak_id, TRUE))
-        return 1;
+  signal_source = forward_signals (sfd);
 
-      g_variant_builder_add (&options_builder, "{s@v}", "sandbox-expose-fd",
-                             g_variant_new_variant (g_variant_builder_end (g_steal_pointer (&expose_fd_builder))));
-    }
+  if (signal_source == 0)
+    return 1;
 
-  if (opt_sandbox_expose_path_ro || opt_sandbox_expose_path_ro_try)
+  session_bus = deadline_bus_get_sync (G_BUS_TYPE_SESSION, &error);
+  if (session_bus == NULL)
     {
-      g_autoptr(GVariantBuilder) expose_fd_builder = g_variant_builder_new (G_VARIANT_TYPE ("ah"));
+      g_printerr ("Can't find bus: %s\n", error->message);
+      return deadline_error_is_timeout (error) ? DEADLINE_EXIT_STATUS : 1;
+    }
 
-      if (opt_host)
-        {
-          g_printerr ("--host not compatible with --sandbox-expose-path-ro\n");
-          return 1;
-        }
+  startup_trace ("bus connected");
 
-      check_portal_version ("sandbox-expose-path-ro", 3);
+  launcher = flatpak_spawn_launcher_new (FLATPAK_SPAWN_LAUNCHER_FLAGS_NONE);
+  flatpak_spawn_launcher_set_connection (launcher, session_bus);
 
-      if (!add_paths_to_variant (expose_fd_builder, fd_list, opt_sandbox_expose_path_ro, home_realpath, flatpak_id, FALSE)
-          || !add_paths_to_variant (expose_fd_builder, fd_list, opt_sandbox_expose_path_ro_try, home_realpath, flatpak_id, TRUE))
-        return 1;
+  for (i = 0; i < (int) forwarded->len; i++)
+    {
+      int fd = g_array_index (forwarded, int, i);
 
-      g_variant_builder_add (&options_builder, "{s@v}", "sandbox-expose-fd-ro",
-                             g_variant_new_variant (g_variant_builder_end (g_steal_pointer (&expose_fd_builder))));
+      flatpak_spawn_launcher_take_fd (launcher, fd, fd);
     }
 
-  if (sandbox_a11y_own_names != NULL)
-    {
-      g_autoptr(GVariantBuilder) sandbox_a11y_own_names_builder = g_variant_builder_new (G_VARIANT_TYPE ("as"));
+  g_hash_table_iter_init (&iter, opts.env);
 
-      check_portal_version ("sandbox-a11y-own-names", 7);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    flatpak_spawn_launcher_setenv (launcher, key, value);
 
-      for (size_t i = 0; i < sandbox_a11y_own_names->len; i++)
-        g_variant_builder_add (sandbox_a11y_own_names_builder, "s", g_ptr_array_index (sandbox_a11y_own_names, i));
+  g_hash_table_iter_init (&iter, opts.unset_env);
 
-      g_variant_builder_add (&options_builder, "{s@v}", "sandbox-a11y-own-names",
-                             g_variant_new_variant (g_variant_builder_end (g_steal_pointer (&sandbox_a11y_own_names_builder))));
-    }
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    flatpak_spawn_launcher_unsetenv (launcher, key);
 
-  if (opt_app_path != NULL)
-    {
-      gint32 handle;
+  for (i = 0; opt_sandbox_a11y_own_names != NULL && i < (int) opt_sandbox_a11y_own_names->len; i++)
+    flatpak_spawn_launcher_sandbox_a11y_own_name (launcher, g_ptr_array_index (opt_sandbox_a11y_own_names, i));
 
-      g_debug ("Using \"%s\" as /app instead of runtime", opt_app_path);
+  launcher_flags = FLATPAK_SPAWN_LAUNCHER_FLAGS_NONE;
 
-      if (opt_host)
-        {
-          g_printerr ("--host not compatible with --app-path\n");
-          return 1;
-        }
+  if (opt_host)
+    launcher_flags |= FLATPAK_SPAWN_LAUNCHER_FLAGS_HOST;
 
-      check_portal_version ("app-path", 6);
+  if (opt_clear_env)
+    launcher_flags |= FLATPAK_SPAWN_LAUNCHER_FLAGS_CLEAR_ENV;
 
-      if (opt_app_path[0] == '\0')
-        {
-          /* Empty path is special-cased to mean an empty directory */
-          spawn_flags |= FLATPAK_SPAWN_FLAGS_EMPTY_APP;
-        }
-      else
-        {
-          handle = path_to_handle (fd_list, opt_app_path, home_realpath,
-                                   flatpak_id, &error);
+  if (opt_watch_bus)
+    launcher_flags |= FLATPAK_SPAWN_LAUNCHER_FLAGS_WATCH_BUS;
 
-          if (handle < 0)
-            {
-              g_printerr ("%s\n", error->message);
-              return 1;
-            }
+  if (opt_share_pids)
+    launcher_flags |= FLATPAK_SPAWN_LAUNCHER_FLAGS_SHARE_PIDS;
+  else if (opt_expose_pids)
+    launcher_flags |= FLATPAK_SPAWN_LAUNCHER_FLAGS_EXPOSE_PIDS;
 
-          g_variant_builder_add (&options_builder, "{s@v}", "app-fd",
-                                 g_variant_new_variant (g_variant_new_handle (handle)));
-        }
-    }
+  if (opt_latest_version)
+    launcher_flags |= FLATPAK_SPAWN_LAUNCHER_FLAGS_LATEST_VERSION;
 
-  if (opt_usr_path != NULL)
-    {
-      gint32 handle;
+  if (opt_sandbox)
+    launcher_flags |= FLATPAK_SPAWN_LAUNCHER_FLAGS_SANDBOX;
 
-      g_debug ("Using %s as /usr instead of runtime", opt_usr_path);
+  if (opt_no_network)
+    launcher_flags |= FLATPAK_SPAWN_LAUNCHER_FLAGS_NO_NETWORK;
 
-      if (opt_host)
-        {
-          g_printerr ("--host not compatible with --usr-path\n");
-          return 1;
-        }
+  flatpak_spawn_launcher_set_flags (launcher, launcher_flags);
+  flatpak_spawn_launcher_set_timeouts (launcher, deadline_get_probe_timeout (),
+                                       deadline_get_end_time ());
 
-      check_portal_version ("usr-path", 6);
+  for (i = 0; opt_sandbox_expose != NULL && opt_sandbox_expose[i] != NULL; i++)
+    flatpak_spawn_launcher_sandbox_expose (launcher, opt_sandbox_expose[i], FALSE);
 
-      handle = path_to_handle (fd_list, opt_usr_path, home_realpath,
-                               flatpak_id, &error);
+  for (i = 0; opt_sandbox_expose_ro != NULL && opt_sandbox_expose_ro[i] != NULL; i++)
+    flatpak_spawn_launcher_sandbox_expose (launcher, opt_sandbox_expose_ro[i], TRUE);
 
-      if (handle < 0)
-        {
-          g_printerr ("%s\n", error->message);
-          return 1;
-        }
+  flatpak_spawn_launcher_set_sandbox_flags (launcher, opts.sandbox_flags);
 
-      g_variant_builder_add (&options_builder, "{s@v}", "usr-fd",
-                             g_variant_new_variant (g_variant_new_handle (handle)));
-    }
+  add_paths_to_launcher (opt_sandbox_expose_path,
+                         FLATPAK_SPAWN_EXPOSE_FLAGS_NONE);
+  add_paths_to_launcher (opt_sandbox_expose_path_try,
+                         FLATPAK_SPAWN_EXPOSE_FLAGS_TRY);
+  add_paths_to_launcher (opt_sandbox_expose_path_ro,
+                         FLATPAK_SPAWN_EXPOSE_FLAGS_READONLY);
+  add_paths_to_launcher (opt_sandbox_expose_path_ro_try,
+                         FLATPAK_SPAWN_EXPOSE_FLAGS_READONLY | FLATPAK_SPAWN_EXPOSE_FLAGS_TRY);
 
-  if (!opt_directory)
+  if (opt_app_path != NULL)
     {
-      opt_directory = cwd;
+      g_debug ("Using \"%s\" as /app instead of runtime", opt_app_path);
+      flatpak_spawn_launcher_set_app_path (launcher, opt_app_path);
     }
 
-  g_dbus_connection_signal_subscribe (session_bus,
-                                      "org.freedesktop.DBus",
-                                      "org.freedesktop.DBus",
-                                      "NameOwnerChanged",
-                                      "/org/freedesktop/DBus",
-                                      NULL,
-                                      G_DBUS_SIGNAL_FLAGS_NONE,
-                                      name_owner_changed,
-                                      NULL, NULL);
-
-  {
-    g_autoptr(GVariant) fds = NULL;
-    g_autoptr(GVariant) env = NULL;
-    g_autoptr(GVariant) opts = NULL;
-
-    fds = g_variant_ref_sink (g_variant_builder_end (g_steal_pointer (&fd_builder)));
-    env = g_variant_ref_sink (g_variant_builder_end (g_steal_pointer (&env_builder)));
-    opts = g_variant_ref_sink (g_variant_builder_end (&options_builder));
-
-retry:
-    reply = g_dbus_connection_call_with_unix_fd_list_sync (session_bus,
-                                                           service_bus_name,
-                                                           service_obj_path,
-                                                           service_iface,
-                                                           opt_host ? "HostCommand" : "Spawn",
-                                                           opt_host ?
-                                                           g_variant_new ("(^ay^aay@a{uh}@a{ss}u)",
-                                                                          opt_directory,
-                                                                          (const char * const *) child_argv->pdata,
-                                                                          fds,
-                                                                          env,
-                                                                          spawn_flags)
-                                                           :
-                                                           g_variant_new ("(^ay^aay@a{uh}@a{ss}u@a{sv})",
-                                                                          opt_directory,
-                                                                          (const char * const *) child_argv->pdata,
-                                                                          fds,
-                                                                          env,
-                                                                          spawn_flags,
-                                                                          opts),
-                                                           G_VARIANT_TYPE ("(u)"),
-                                                           G_DBUS_CALL_FLAGS_NONE,
-                                                           -1,
-                                                           fd_list,
-                                                           NULL,
-                                                           NULL, &error);
-
-    if (reply == NULL)
-      {
-        if (g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS) &&
-            opt_watch_bus)
-          {
-            g_debug ("Got an invalid argument error; trying again without --watch-bus");
-
-            opt_watch_bus = FALSE;
-            spawn_flags &= opt_host ? ~FLATPAK_HOST_COMMAND_FLAGS_WATCH_BUS : ~FLATPAK_SPAWN_FLAGS_WATCH_BUS;
-            g_clear_error (&error);
-
-            goto retry;
-          }
-
-        g_dbus_error_strip_remote_error (error);
-        g_printerr ("Portal call failed: %s\n", error->message);
-        if (opt_host && g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN)) {
-          g_printerr ("Hint: --host only works when the Flatpak is allowed to talk to org.freedesktop.Flatpak\n");
-        }
-        return 1;
-      }
-
-    g_variant_get (reply, "(u)", &child_pid);
-  }
-
-  g_debug ("child_pid: %d", child_pid);
+  if (opt_usr_path != NULL)
+    {
+      g_debug ("Using %s as /usr instead of runtime", opt_usr_path);
+      flatpak_spawn_launcher_set_usr_path (launcher, opt_usr_path);
+    }
 
-  /* Release our reference to the fds, so that only the copy we sent over
-   * D-Bus remains open */
-  g_clear_object (&fd_list);
+  if (opt_directory != NULL)
+    flatpak_spawn_launcher_set_cwd (launcher, opt_directory);
 
   loop = g_main_loop_new (NULL, FALSE);
 
-  g_signal_connect (session_bus, "closed", G_CALLBACK (session_bus_closed_cb), loop);
+  startup_trace ("spawning");
+  deadline_watch ();
+  flatpak_spawn_launcher_spawn_async (launcher, spawn_argv,
+                                      deadline_get_cancellable (),
+                                      spawn_cb, loop);
 
   g_main_loop_run (loop);
 
+  if (n_restarts > 0)
+    g_debug ("Command was restarted %u times", n_restarts);
+
+  g_clear_object (&launcher);
+
   if (signal_source != 0)
     g_source_remove (signal_source);
 
-  return 0;
+  g_clear_object (&child_process);
+  g_clear_object (&exited_process);
+  g_main_loop_unref (loop);
+  g_option_context_free (context);
+
+  return exit_code;
 }
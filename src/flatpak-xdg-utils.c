@@ -0,0 +1,86 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "flatpak-xdg-utils.h"
+
+typedef int (*ToolMain) (int    argc,
+                         char **argv);
+
+static const struct
+{
+  const char *name;
+  ToolMain main;
+} tools[] = {
+  { "flatpak-spawn", flatpak_spawn_main },
+  { "xdg-email", xdg_email_main },
+  { "xdg-open", xdg_open_main },
+};
+
+static ToolMain
+lookup_tool (const char *name)
+{
+  const char *slash = strrchr (name, '/');
+  size_t i;
+
+  if (slash != NULL)
+    name = slash + 1;
+
+  for (i = 0; i < sizeof (tools) / sizeof (tools[0]); i++)
+    {
+      if (strcmp (name, tools[i].name) == 0)
+        return tools[i].main;
+    }
+
+  return NULL;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  ToolMain tool_main;
+  size_t i;
+
+  if (argc < 1)
+    return 1;
+
+  /* Normally we are invoked through one of the links installed
+   * alongside us... */
+  tool_main = lookup_tool (argv[0]);
+
+  if (tool_main != NULL)
+    return tool_main (argc, argv);
+
+  /* ... but "flatpak-xdg-utils xdg-open URI" works too */
+  if (argc > 1)
+    {
+      tool_main = lookup_tool (argv[1]);
+
+      if (tool_main != NULL)
+        return tool_main (argc - 1, argv + 1);
+    }
+
+  fprintf (stderr, "Usage: %s TOOL [ARGUMENTS...]\n\nAvailable tools:\n", argv[0]);
+
+  for (i = 0; i < sizeof (tools) / sizeof (tools[0]); i++)
+    fprintf (stderr, "  %s\n", tools[i].name);
+
+  return 1;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_XDG_UTILS_H__
+#define __FLATPAK_XDG_UTILS_H__
+
+/* When built with -Dmulticall=true, all the tools are linked into a
+ * single flatpak-xdg-utils binary, and each tool's entry point is
+ * renamed so that flatpak-xdg-utils.c can dispatch on argv[0]. */
+#ifdef FLATPAK_XDG_UTILS_MULTICALL
+#define FLATPAK_XDG_UTILS_MAIN(tool) tool##_main
+#else
+#define FLATPAK_XDG_UTILS_MAIN(tool) main
+#endif
+
+int flatpak_spawn_main (int argc, char **argv);
+int xdg_email_main (int argc, char **argv);
+int xdg_open_main (int argc, char **argv);
+
+#endif /* __FLATPAK_XDG_UTILS_H__ */
@@ -0,0 +1,12 @@
+#!/bin/sh
+# Install each tool as a symlink to the multi-call binary
+# Usage: install-multicall-links.sh BINDIR TOOL...
+
+set -e
+
+bindir="${DESTDIR}$1"
+shift
+
+for tool in "$@"; do
+    ln -sf flatpak-xdg-utils "${bindir}/${tool}"
+done
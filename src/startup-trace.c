@@ -0,0 +1,58 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "startup-trace.h"
+
+static double
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+void
+startup_trace (const char *step)
+{
+  static enum { UNKNOWN, DISABLED, ENABLED } state = UNKNOWN;
+  static double start, previous;
+  double now;
+
+  /* This deliberately avoids GLib, so that it can be used before
+   * anything has been initialized, and costs nothing when disabled */
+  if (state == UNKNOWN)
+    {
+      state = getenv ("FLATPAK_XDG_UTILS_TRACE_STARTUP") != NULL ? ENABLED : DISABLED;
+
+      if (state == ENABLED)
+        start = previous = now_ms ();
+    }
+
+  if (state == DISABLED)
+    return;
+
+  now = now_ms ();
+  fprintf (stderr, "%s: startup: %9.3f ms (+%8.3f ms) %s\n",
+           program_invocation_short_name, now - start, now - previous, step);
+  previous = now;
+}
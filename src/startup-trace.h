@@ -0,0 +1,26 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STARTUP_TRACE_H__
+#define __STARTUP_TRACE_H__
+
+/* If FLATPAK_XDG_UTILS_TRACE_STARTUP is set in the environment, print
+ * the time elapsed since the first call, and since the previous call,
+ * to stderr, labelled with @step. Otherwise do nothing. */
+void startup_trace (const char *step);
+
+#endif /* __STARTUP_TRACE_H__ */
@@ -0,0 +1,132 @@
+/*
+ * Copyright © 2017 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "xdg-email-mailto.h"
+
+#include <string.h>
+
+#include "backport-autoptr.h"
+
+static void
+add_addresses (GPtrArray *array,
+               char      *list)
+{
+  char *a, *saveptr = NULL;
+
+  for (a = strtok_r (list, ",", &saveptr);
+       a != NULL;
+       a = strtok_r (NULL, ",", &saveptr))
+    g_ptr_array_add (array, g_strdup (a));
+}
+
+void
+xdg_email_parse_mailto (const char  *uri,
+                        GPtrArray   *to,
+                        GPtrArray   *cc,
+                        GPtrArray   *bcc,
+                        char       **subject,
+                        char       **body)
+{
+  g_autofree gchar *rest = NULL;
+  char *token;
+  char *question_mark;
+  char *saveptr = NULL;
+
+  g_return_if_fail (g_ascii_strncasecmp (uri, "mailto:", strlen ("mailto:")) == 0);
+
+  rest = g_strdup (uri + strlen ("mailto:"));
+  question_mark = strchr (rest, '?');
+
+  if (question_mark != NULL)
+    *question_mark = '\0';
+
+  /* The part before any '?' is a comma-separated list of URI-escaped
+   * email addresses, but may be empty */
+  if (rest[0] != '\0')
+    {
+      for (token = strtok_r (rest, ",", &saveptr);
+           token != NULL;
+           token = strtok_r (NULL, ",", &saveptr))
+        {
+          g_autofree gchar *addr = g_uri_unescape_string (token, NULL);
+
+          if (addr != NULL)
+            g_ptr_array_add (to, g_steal_pointer (&addr));
+          else
+            g_warning ("Invalid URI-escaped email address: %s", token);
+        }
+    }
+
+  if (question_mark == NULL)
+    return;
+
+  /* The part after '?' (if any) is an &-separated list of header
+   * field/value pairs */
+  for (token = strtok_r (question_mark + 1, "&", &saveptr);
+       token != NULL;
+       token = strtok_r (NULL, "&", &saveptr))
+    {
+      g_autofree gchar *value = NULL;
+      char *equals = strchr (token, '=');
+      const char *header;
+
+      if (equals == NULL)
+        {
+          g_warning ("No '=' found in %s", token);
+          continue;
+        }
+
+      *equals = '\0';
+      header = token;
+      value = g_uri_unescape_string (equals + 1, NULL);
+
+      if (value == NULL)
+        {
+          g_warning ("Invalid URI-escaped value for '%s': %s",
+                     header, equals + 1);
+          continue;
+        }
+
+      if (g_ascii_strcasecmp (header, "to") == 0)
+        {
+          add_addresses (to, value);
+        }
+      else if (g_ascii_strcasecmp (header, "cc") == 0)
+        {
+          add_addresses (cc, value);
+        }
+      else if (g_ascii_strcasecmp (header, "bcc") == 0)
+        {
+          add_addresses (bcc, value);
+        }
+      else if (g_ascii_strcasecmp (header, "subject") == 0)
+        {
+          g_clear_pointer (subject, g_free);
+          *subject = g_steal_pointer (&value);
+        }
+      else if (g_ascii_strcasecmp (header, "body") == 0)
+        {
+          g_clear_pointer (body, g_free);
+          *body = g_steal_pointer (&value);
+        }
+      else
+        {
+          g_debug ("Ignoring unknown header field in mailto: URI: %s",
+                   header);
+        }
+    }
+}
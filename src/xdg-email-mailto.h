@@ -0,0 +1,41 @@
+/*
+ * Copyright © 2017 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __XDG_EMAIL_MAILTO_H__
+#define __XDG_EMAIL_MAILTO_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Adds the addresses in an RFC 6068 mailto: URI to @to, @cc and @bcc,
+ * which free their elements with g_free(), and replaces *@subject and
+ * *@body if the URI has those headers. @uri must start with "mailto:",
+ * in any case. Parts that cannot be unescaped are warned about and
+ * skipped.
+ */
+void xdg_email_parse_mailto (const char  *uri,
+                             GPtrArray   *to,
+                             GPtrArray   *cc,
+                             GPtrArray   *bcc,
+                             char       **subject,
+                             char       **body);
+
+G_END_DECLS
+
+#endif /* __XDG_EMAIL_MAILTO_H__ */
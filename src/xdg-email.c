@@ -28,6 +28,10 @@
 #include <errno.h>
 
 #include "backport-autoptr.h"
+#include "deadline.h"
+#include "flatpak-xdg-utils.h"
+#include "startup-trace.h"
+#include "xdg-email-mailto.h"
 
 #define PORTAL_BUS_NAME    "org.freedesktop.portal.Desktop"
 #define PORTAL_OBJECT_PATH "/org/freedesktop/portal/desktop"
@@ -63,12 +67,14 @@ static GOptionEntry entries[] = {
   { "manual", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &show_help, NULL, NULL },
   { "version", 0, 0, G_OPTION_ARG_NONE, &show_version, N_("Show program version"), NULL },
 
+  { "deadline", 0, 0, G_OPTION_ARG_CALLBACK, deadline_option_cb, N_("Give up waiting for the portal after SECONDS"), N_("SECONDS") },
+
   { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &addresses, NULL, NULL },
   { NULL, 0, 0, 0, NULL, NULL, NULL }
 };
 
 int
-main (int argc, char *argv[])
+FLATPAK_XDG_UTILS_MAIN (xdg_email) (int argc, char *argv[])
 {
   GOptionContext *context;
   GError *error = NULL;
@@ -85,6 +91,12 @@ main (int argc, char *argv[])
   gsize i;
   const char *single_uri = NULL;
 
+  startup_trace ("main");
+
+  /* GFile is only used to check that attachments are local files,
+   * which doesn't need GVfs */
+  g_setenv ("GIO_USE_VFS", "local", TRUE);
+
   context = g_option_context_new ("[ mailto-uri | address(es) ]");
 
   g_option_context_add_main_entries (context, entries, NULL);
@@ -100,6 +112,8 @@ main (int argc, char *argv[])
       return 1;
     }
 
+  startup_trace ("options parsed");
+
   if (show_version)
     {
       g_print ("%s\n", PACKAGE_VERSION);
@@ -144,104 +158,8 @@ main (int argc, char *argv[])
           if (g_ascii_strncasecmp (addresses[i], "mailto:",
                                    strlen ("mailto:")) == 0)
             {
-              g_autofree gchar *rest = g_strdup (addresses[i] + strlen ("mailto:"));
-              char *token;
-              char *question_mark = strchr (rest, '?');
-              char *saveptr = NULL;
-
-              if (question_mark != NULL)
-                *question_mark = '\0';
-
-              /* The part before any '?' is a comma-separated list of URI-escaped
-               * email addresses, but may be empty */
-              if (rest[0] != '\0')
-                {
-                  for (token = strtok_r (rest, ",", &saveptr);
-                       token != NULL;
-                       token = strtok_r (NULL, ",", &saveptr))
-                    {
-                      g_autofree gchar *addr = g_uri_unescape_string (token, NULL);
-
-                      if (addr != NULL)
-                        g_ptr_array_add (to, g_steal_pointer (&addr));
-                      else
-                        g_warning ("Invalid URI-escaped email address: %s", token);
-                    }
-                }
-
-              if (question_mark == NULL)
-                continue;
-
-              /* The part after '?' (if any) is an &-separated list of header
-               * field/value pairs */
-              for (token = strtok_r (question_mark + 1, "&", &saveptr);
-                   token != NULL;
-                   token = strtok_r (NULL, "&", &saveptr))
-                {
-                  g_autofree gchar *value = NULL;
-                  char *equals = strchr (token, '=');
-                  const char *header;
-
-                  if (equals == NULL)
-                    {
-                      g_warning ("No '=' found in %s", token);
-                      continue;
-                    }
-
-                  *equals = '\0';
-                  header = token;
-                  value = g_uri_unescape_string (equals + 1, NULL);
-
-                  if (value == NULL)
-                    {
-                      g_warning ("Invalid URI-escaped value for '%s': %s",
-                                 header, value);
-                      continue;
-                    }
-
-                  if (g_ascii_strcasecmp (header, "to") == 0)
-                    {
-                      char *a, *saveptr2 = NULL;
-
-                      for (a = strtok_r (value, ",", &saveptr2);
-                           a != NULL;
-                           a = strtok_r (NULL, ",", &saveptr2))
-                        g_ptr_array_add (to, g_strdup (a));
-                    }
-                  else if (g_ascii_strcasecmp (header, "cc") == 0)
-                    {
-                      char *a, *saveptr2 = NULL;
-
-                      for (a = strtok_r (value, ",", &saveptr2);
-                           a != NULL;
-                           a = strtok_r (NULL, ",", &saveptr2))
-                        g_ptr_array_add (cc, g_strdup (a));
-                    }
-                  else if (g_ascii_strcasecmp (header, "bcc") == 0)
-                    {
-                      char *a, *saveptr2 = NULL;
-
-                      for (a = strtok_r (value, ",", &saveptr2);
-                           a != NULL;
-                           a = strtok_r (NULL, ",", &saveptr2))
-                        g_ptr_array_add (bcc, g_strdup (a));
-                    }
-                  else if (g_ascii_strcasecmp (header, "subject") == 0)
-                    {
-                      g_clear_pointer (&subject, g_free);
-                      subject = g_steal_pointer (&value);
-                    }
-                  else if (g_ascii_strcasecmp (header, "body") == 0)
-                    {
-                      g_clear_pointer (&body, g_free);
-                      body = g_steal_pointer (&value);
-                    }
-                  else
-                    {
-                      g_debug ("Ignoring unknown header field in mailto: URI: %s",
-                               header);
-                    }
-                }
+              xdg_email_parse_mailto (addresses[i], to, cc, bcc,
+                                      &subject, &body);
             }
           else
             {
@@ -250,19 +168,23 @@ main (int argc, char *argv[])
         }
     }
 
-  connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  connection = deadline_bus_get_sync (G_BUS_TYPE_SESSION, &error);
 
   if (connection == NULL)
     {
+      int status = deadline_error_is_timeout (error) ? DEADLINE_EXIT_STATUS : 3;
+
       if (error)
         g_printerr ("Failed to connect to session bus: %s", error->message);
       else
         g_printerr ("Failed to connect to session bus");
 
       g_clear_pointer (&error, g_error_free);
-      return 3;
+      return status;
     }
 
+  startup_trace ("bus connected");
+
   g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
 
   if (single_uri != NULL)
@@ -277,17 +199,19 @@ main (int argc, char *argv[])
                                                         g_variant_builder_end (&opt_builder)),
                                          NULL,
                                          G_DBUS_CALL_FLAGS_NONE,
-                                         -1,
+                                         deadline_get_timeout (-1),
                                          NULL,
                                          &error);
 
       if (ret == NULL)
         {
+          int status = deadline_error_is_timeout (error) ? DEADLINE_EXIT_STATUS : 4;
+
           g_printerr ("Failed to call portal: %s\n", error->message);
 
           g_object_unref (connection);
           g_error_free (error);
-          return 4;
+          return status;
         }
 
       g_object_unref (connection);
@@ -302,7 +226,7 @@ main (int argc, char *argv[])
                                      g_variant_new ("(ss)", "org.freedesktop.portal.Email", "version"),
                                      G_VARIANT_TYPE ("(v)"),
                                      0,
-                                     G_MAXINT,
+                                     deadline_get_timeout (deadline_get_probe_timeout ()),
                                      NULL,
                                      NULL);
   if (ret != NULL)
@@ -400,7 +324,7 @@ main (int argc, char *argv[])
                                                  parameters,
                                                  NULL,
                                                  G_DBUS_CALL_FLAGS_NONE,
-                                                 -1,
+                                                 deadline_get_timeout (-1),
                                                  fd_list,
                                                  NULL,
                                                  NULL,
@@ -408,12 +332,14 @@ main (int argc, char *argv[])
 
   if (error)
     {
+      int status = deadline_error_is_timeout (error) ? DEADLINE_EXIT_STATUS : 4;
+
       g_printerr ("Failed to call portal: %s\n", error->message);
 
       g_object_unref (connection);
       g_error_free (error);
 
-      return 4;
+      return status;
     }
 
   g_object_unref (connection);
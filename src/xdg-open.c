@@ -27,6 +27,9 @@
 #include <errno.h>
 
 #include "backport-autoptr.h"
+#include "deadline.h"
+#include "flatpak-xdg-utils.h"
+#include "startup-trace.h"
 
 #define PORTAL_BUS_NAME    "org.freedesktop.portal.Desktop"
 #define PORTAL_OBJECT_PATH "/org/freedesktop/portal/desktop"
@@ -41,12 +44,14 @@ static GOptionEntry entries[] = {
   { "manual", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &show_help, NULL, NULL },
   { "version", 0, 0, G_OPTION_ARG_NONE, &show_version, N_("Show program version"), NULL },
 
+  { "deadline", 0, 0, G_OPTION_ARG_CALLBACK, deadline_option_cb, N_("Give up waiting for the portal after SECONDS"), N_("SECONDS") },
+
   { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &uris, NULL, NULL },
   { NULL, 0, 0, 0, NULL, NULL, NULL }
 };
 
 int
-main (int argc, char *argv[])
+FLATPAK_XDG_UTILS_MAIN (xdg_open) (int argc, char *argv[])
 {
   g_autoptr(GOptionContext) context = NULL;
   g_autoptr(GError) error = NULL;
@@ -55,6 +60,12 @@ main (int argc, char *argv[])
   g_autoptr(GVariant) reply = NULL;
   GVariantBuilder opt_builder;
 
+  startup_trace ("main");
+
+  /* We only need GFile to tell local files from URIs, so don't spend
+   * time loading GVfs */
+  g_setenv ("GIO_USE_VFS", "local", TRUE);
+
   context = g_option_context_new ("{ file | URL }");
 
   g_option_context_add_main_entries (context, entries, NULL);
@@ -69,6 +80,8 @@ main (int argc, char *argv[])
       return 1;
     }
 
+  startup_trace ("options parsed");
+
   if (show_version)
     {
       g_print ("%s\n", PACKAGE_VERSION);
@@ -84,7 +97,7 @@ main (int argc, char *argv[])
       return 0;
     }
 
-  connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  connection = deadline_bus_get_sync (G_BUS_TYPE_SESSION, &error);
 
   if (connection == NULL)
     {
@@ -93,9 +106,14 @@ main (int argc, char *argv[])
       else
         g_printerr ("Failed to connect to session bus");
 
+      if (deadline_error_is_timeout (error))
+        return DEADLINE_EXIT_STATUS;
+
       return 3;
     }
 
+  startup_trace ("bus connected");
+
   g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
 
   file = g_file_new_for_commandline_arg (uris[0]);
@@ -127,7 +145,7 @@ main (int argc, char *argv[])
                                                                             g_variant_builder_end (&opt_builder)),
                                                              NULL,
                                                              G_DBUS_CALL_FLAGS_NONE,
-                                                             -1,
+                                                             deadline_get_timeout (-1),
                                                              fd_list,
                                                              NULL,
                                                              NULL,
@@ -145,7 +163,7 @@ main (int argc, char *argv[])
                                                           g_variant_builder_end (&opt_builder)),
                                            NULL,
                                            G_DBUS_CALL_FLAGS_NONE,
-                                           -1,
+                                           deadline_get_timeout (-1),
                                            NULL,
                                            &error);
     }
@@ -154,6 +172,9 @@ main (int argc, char *argv[])
     {
       g_printerr ("Failed to call portal: %s\n", error->message);
 
+      if (deadline_error_is_timeout (error))
+        return DEADLINE_EXIT_STATUS;
+
       return 4;
     }
 
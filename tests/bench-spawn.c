@@ -0,0 +1,369 @@
+/*
+ * Copyright © 2018-2019 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark for a complete flatpak-spawn run against a mock portal that
+ * reports the command as exited as soon as it is started, with the
+ * built-in D-Bus client (FLATPAK_SPAWN_WIRE=1) and with GDBus
+ * (FLATPAK_SPAWN_WIRE=0). Without -Dwire_dbus=true, both use GDBus.
+ *
+ * It also runs the command lines that flatpak-spawn --host --unset-env
+ * sends to a mock session helper, to show what each way of unsetting
+ * variables costs on the host compared with running the command
+ * directly and with the env(1) and sh(1) chain that was used before.
+ *
+ * Usage: bench-spawn [FLATPAK-SPAWN]
+ *
+ * BENCH_ITERATIONS sets the number of runs of each (default 200).
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "backport-autoptr.h"
+#include "common.h"
+
+#define FLATPAK_PORTAL_BUS_NAME "org.freedesktop.portal.Flatpak"
+#define FLATPAK_PORTAL_PATH "/org/freedesktop/portal/Flatpak"
+#define FLATPAK_PORTAL_INTERFACE FLATPAK_PORTAL_BUS_NAME
+
+#define FLATPAK_SESSION_HELPER_BUS_NAME "org.freedesktop.Flatpak"
+#define FLATPAK_SESSION_HELPER_PATH_DEVELOPMENT "/org/freedesktop/Flatpak/Development"
+#define FLATPAK_SESSION_HELPER_INTERFACE_DEVELOPMENT "org.freedesktop.Flatpak.Development"
+
+static const char portal_xml[] =
+  "<node>"
+  "  <interface name='" FLATPAK_PORTAL_INTERFACE "'>"
+  "    <method name='Spawn'>"
+  "      <arg type='ay' name='cwd_path' direction='in'/>"
+  "      <arg type='aay' name='argv' direction='in'/>"
+  "      <arg type='a{uh}' name='fds' direction='in'/>"
+  "      <arg type='a{ss}' name='envs' direction='in'/>"
+  "      <arg type='u' name='flags' direction='in'/>"
+  "      <arg type='a{sv}' name='options' direction='in'/>"
+  "      <arg type='u' name='pid' direction='out'/>"
+  "    </method>"
+  "    <method name='SpawnSignal'>"
+  "      <arg type='u' name='pid' direction='in'/>"
+  "      <arg type='u' name='signal' direction='in'/>"
+  "      <arg type='b' name='to_process_group' direction='in'/>"
+  "    </method>"
+  "    <property name='version' type='u' access='read'/>"
+  "    <property name='supports' type='u' access='read'/>"
+  "  </interface>"
+  "  <interface name='" FLATPAK_SESSION_HELPER_INTERFACE_DEVELOPMENT "'>"
+  "    <method name='HostCommand'>"
+  "      <arg type='ay' name='cwd_path' direction='in'/>"
+  "      <arg type='aay' name='argv' direction='in'/>"
+  "      <arg type='a{uh}' name='fds' direction='in'/>"
+  "      <arg type='a{ss}' name='envs' direction='in'/>"
+  "      <arg type='u' name='flags' direction='in'/>"
+  "      <arg type='u' name='pid' direction='out'/>"
+  "    </method>"
+  "    <method name='HostCommandSignal'>"
+  "      <arg type='u' name='pid' direction='in'/>"
+  "      <arg type='u' name='signal' direction='in'/>"
+  "      <arg type='b' name='to_process_group' direction='in'/>"
+  "    </method>"
+  "    <property name='version' type='u' access='read'/>"
+  "  </interface>"
+  "</node>";
+
+typedef struct
+{
+  guint32 next_pid;
+  guint calls;
+  /* The argv of the last HostCommand call */
+  gchar **host_argv;
+} MockPortal;
+
+static void
+mock_method_call (GDBusConnection *conn,
+                  const gchar *sender G_GNUC_UNUSED,
+                  const gchar *object_path,
+                  const gchar *interface_name,
+                  const gchar *method_name,
+                  GVariant *parameters,
+                  GDBusMethodInvocation *invocation,
+                  gpointer user_data)
+{
+  MockPortal *portal = user_data;
+  g_autoptr(GError) error = NULL;
+  const char *exited;
+  guint32 pid;
+
+  portal->calls++;
+
+  if (strcmp (method_name, "HostCommand") == 0)
+    {
+      g_strfreev (portal->host_argv);
+      g_variant_get_child (parameters, 1, "^aay", &portal->host_argv);
+      exited = "HostCommandExited";
+    }
+  else if (strcmp (method_name, "Spawn") == 0)
+    {
+      exited = "SpawnExited";
+    }
+  else
+    {
+      g_dbus_method_invocation_return_value (invocation, NULL);
+      return;
+    }
+
+  pid = portal->next_pid++;
+  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(u)", pid));
+  g_dbus_connection_emit_signal (conn, NULL, object_path, interface_name,
+                                 exited, g_variant_new ("(uu)", pid, 0), &error);
+  g_assert_no_error (error);
+}
+
+static GVariant *
+mock_get_property (GDBusConnection *conn G_GNUC_UNUSED,
+                   const gchar *sender G_GNUC_UNUSED,
+                   const gchar *object_path G_GNUC_UNUSED,
+                   const gchar *interface_name G_GNUC_UNUSED,
+                   const gchar *property_name,
+                   GError **error G_GNUC_UNUSED,
+                   gpointer user_data)
+{
+  MockPortal *portal = user_data;
+
+  portal->calls++;
+
+  if (strcmp (property_name, "version") == 0)
+    return g_variant_new_uint32 (6);
+
+  return g_variant_new_uint32 (0);
+}
+
+static const GDBusInterfaceVTable vtable =
+{
+  mock_method_call,
+  mock_get_property,
+  NULL  /* set */
+};
+
+static gint64
+run_argv (GSubprocessLauncher *launcher,
+          const char * const  *argv)
+{
+  g_autoptr(GSubprocess) subprocess = NULL;
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GError) error = NULL;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  subprocess = g_subprocess_launcher_spawnv (launcher, argv, &error);
+  g_assert_no_error (error);
+
+  /* The mock portal runs in our main context */
+  g_subprocess_wait_check_async (subprocess, NULL, store_result_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_subprocess_wait_check_finish (subprocess, result, &error);
+  g_assert_no_error (error);
+
+  return g_get_monotonic_time () - start;
+}
+
+static gint64
+run_once (GSubprocessLauncher *launcher,
+          const char          *flatpak_spawn)
+{
+  const char * const argv[] = { flatpak_spawn, "true", NULL };
+
+  return run_argv (launcher, argv);
+}
+
+static void
+bench (const char  *label,
+       const char  *wire,
+       const char  *flatpak_spawn,
+       const char  *dbus_address,
+       MockPortal  *portal,
+       guint        iterations)
+{
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  gint64 total = 0;
+  guint calls;
+  guint i;
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDOUT_SILENCE);
+  g_subprocess_launcher_setenv (launcher, "DBUS_SESSION_BUS_ADDRESS",
+                                dbus_address, TRUE);
+  g_subprocess_launcher_setenv (launcher, "FLATPAK_SPAWN_WIRE", wire, TRUE);
+
+  /* Warm up */
+  run_once (launcher, flatpak_spawn);
+  calls = portal->calls;
+
+  for (i = 0; i < iterations; i++)
+    total += run_once (launcher, flatpak_spawn);
+
+  g_print ("  %-24s %8.3f ms per run, %.1f portal calls per run\n",
+           label, total / 1000.0 / iterations,
+           (double) (portal->calls - calls) / iterations);
+}
+
+static void
+bench_host_argv (const char         *label,
+                 const char * const *argv,
+                 guint               iterations)
+{
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  gint64 total = 0;
+  guint i;
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_setenv (launcher, "BENCH_UNSET", "1", TRUE);
+
+  /* Warm up */
+  run_argv (launcher, argv);
+
+  for (i = 0; i < iterations; i++)
+    total += run_argv (launcher, argv);
+
+  g_print ("    %-34s %8.3f ms per run\n", label, total / 1000.0 / iterations);
+}
+
+/* @command is run on the "host" with BENCH_UNSET unset */
+static void
+bench_unset_env (const char  *label,
+                 const char  *command,
+                 const char  *flatpak_spawn,
+                 const char  *dbus_address,
+                 MockPortal  *portal,
+                 guint        iterations)
+{
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  const char * const spawn_argv[] = {
+    flatpak_spawn, "--host", "--unset-env=BENCH_UNSET", command, NULL
+  };
+  const char * const direct_argv[] = { command, NULL };
+  const char * const old_argv[] = {
+    "/usr/bin/env", "-u", "BENCH_UNSET",
+    "/bin/sh", "-euc", "exec \"$@\"", "sh", command, NULL
+  };
+  g_autofree gchar *joined = NULL;
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDOUT_SILENCE);
+  g_subprocess_launcher_setenv (launcher, "DBUS_SESSION_BUS_ADDRESS",
+                                dbus_address, TRUE);
+  g_clear_pointer (&portal->host_argv, g_strfreev);
+  run_argv (launcher, spawn_argv);
+  g_assert_nonnull (portal->host_argv);
+
+  joined = g_strjoinv ("' '", portal->host_argv);
+  g_print ("  --host --unset-env, %s\n    sent: '%s'\n", label, joined);
+  bench_host_argv ("command alone", direct_argv, iterations);
+  bench_host_argv ("env -u and sh -c 'exec \"$@\"'", old_argv, iterations);
+  bench_host_argv ("as sent", (const char * const *) portal->host_argv,
+                   iterations);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_autoptr(GSubprocess) dbus_daemon = NULL;
+  g_autoptr(GDBusConnection) conn = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *dbus_address = NULL;
+  GDBusNodeInfo *node_info;
+  MockPortal portal = { 1000, 0, NULL };
+  g_autofree gchar *tmpdir = NULL;
+  g_autofree gchar *awkward = NULL;
+  const char *flatpak_spawn;
+  const char *env;
+  guint iterations = 200;
+  guint object_id;
+  guint host_object_id;
+
+  if (argc > 1)
+    flatpak_spawn = argv[1];
+  else
+    flatpak_spawn = g_getenv ("FLATPAK_SPAWN");
+
+  if (flatpak_spawn == NULL)
+    g_error ("FLATPAK_SPAWN must be set, or a path given");
+
+  env = g_getenv ("BENCH_ITERATIONS");
+
+  if (env != NULL)
+    iterations = MAX (atoi (env), 1);
+
+  setup_dbus_daemon (&dbus_daemon, &dbus_address);
+
+  node_info = g_dbus_node_info_new_for_xml (portal_xml, &error);
+  g_assert_no_error (error);
+
+  conn = g_dbus_connection_new_for_address_sync (dbus_address,
+                                                 (G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                  G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION),
+                                                 NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  object_id = g_dbus_connection_register_object (conn, FLATPAK_PORTAL_PATH,
+                                                 node_info->interfaces[0],
+                                                 &vtable, &portal, NULL,
+                                                 &error);
+  g_assert_no_error (error);
+  host_object_id = g_dbus_connection_register_object (conn,
+                                                      FLATPAK_SESSION_HELPER_PATH_DEVELOPMENT,
+                                                      node_info->interfaces[1],
+                                                      &vtable, &portal, NULL,
+                                                      &error);
+  g_assert_no_error (error);
+  own_name_sync (conn, FLATPAK_PORTAL_BUS_NAME);
+  own_name_sync (conn, FLATPAK_SESSION_HELPER_BUS_NAME);
+
+  /* env(1) can't run a command with = in its name, so that is the case
+   * that used to need sh(1) as well */
+  tmpdir = g_dir_make_tmp ("bench-spawn-XXXXXX", &error);
+  g_assert_no_error (error);
+  awkward = g_build_filename (tmpdir, "awkward=name", NULL);
+  g_assert_no_errno (symlink ("/bin/true", awkward));
+
+  g_print ("%s\n", flatpak_spawn);
+  bench ("GDBus", "0", flatpak_spawn, dbus_address, &portal, iterations);
+  bench ("built-in D-Bus client", "1", flatpak_spawn, dbus_address, &portal, iterations);
+  bench_unset_env ("/bin/true", "/bin/true", flatpak_spawn, dbus_address,
+                   &portal, iterations);
+  bench_unset_env ("a command with = in its name", awkward, flatpak_spawn,
+                   dbus_address, &portal, iterations);
+
+  g_unlink (awkward);
+  g_rmdir (tmpdir);
+  g_strfreev (portal.host_argv);
+  g_dbus_connection_unregister_object (conn, host_object_id);
+  g_dbus_connection_unregister_object (conn, object_id);
+  g_dbus_node_info_unref (node_info);
+  g_subprocess_send_signal (dbus_daemon, SIGTERM);
+  g_subprocess_wait (dbus_daemon, NULL, &error);
+  g_assert_no_error (error);
+
+  return 0;
+}
@@ -0,0 +1,432 @@
+/*
+ * Copyright © 2018-2019 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Startup benchmark for the tools.
+ *
+ * Usage: bench-startup [DIR...]
+ *
+ * Each DIR must contain flatpak-spawn, xdg-email and xdg-open, for
+ * example the src directory of a normal build and of a build with
+ * -Dmulticall=true. Without arguments, the tools named by the
+ * FLATPAK_SPAWN, XDG_EMAIL and XDG_OPEN environment variables are
+ * measured, as in the tests.
+ *
+ * For each set of tools this reports:
+ *  - warm start: median wall-clock time of running each tool to completion
+ *  - cold start: the same, after evicting the tool's binary from the
+ *    page cache (or all caches, if BENCH_DROP_CACHES=1 and we are root)
+ *  - exec to first D-Bus byte: median time from starting the tool to
+ *    receiving the first byte of its connection to a D-Bus server
+ *  - footprint: Rss, Pss and Shared_Clean of all three tools running at
+ *    the same time, blocked while connecting to a D-Bus server that
+ *    never answers
+ *
+ * BENCH_ITERATIONS sets the number of warm runs (default 200); a tenth
+ * as many cold runs are made.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+
+#include "backport-autoptr.h"
+
+typedef struct
+{
+  const char *name;
+  const char *env;
+  /* Arguments that make the tool exit successfully without using D-Bus */
+  const char *quick_arg;
+  /* Arguments that make the tool connect to the session bus */
+  const char *bus_arg;
+} Tool;
+
+static const Tool tools[] = {
+  { "flatpak-spawn", "FLATPAK_SPAWN", "--help", "true" },
+  { "xdg-email", "XDG_EMAIL", "--version", "me@example.com" },
+  { "xdg-open", "XDG_OPEN", "--version", "https://example.com/" },
+};
+
+#define N_TOOLS G_N_ELEMENTS (tools)
+
+typedef struct
+{
+  guint64 rss;
+  guint64 pss;
+  guint64 shared_clean;
+} Footprint;
+
+static void
+evict (const char *path,
+       gboolean    drop_caches)
+{
+  g_autofree gchar *real = NULL;
+  int fd;
+
+  if (drop_caches)
+    {
+      sync ();
+
+      if (g_file_set_contents ("/proc/sys/vm/drop_caches", "3", -1, NULL))
+        return;
+    }
+
+  /* Follow the link to a multi-call binary */
+  real = realpath (path, NULL);
+
+  if (real == NULL)
+    g_error ("%s: %s", path, g_strerror (errno));
+
+  fd = open (real, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    g_error ("%s: %s", real, g_strerror (errno));
+
+  posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+  close (fd);
+}
+
+static gint64
+run_once (const char *path,
+          const char *arg)
+{
+  g_autoptr(GSubprocess) subprocess = NULL;
+  g_autoptr(GError) error = NULL;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  subprocess = g_subprocess_new (G_SUBPROCESS_FLAGS_STDOUT_SILENCE,
+                                 &error, path, arg, NULL);
+  g_assert_no_error (error);
+  g_subprocess_wait_check (subprocess, NULL, &error);
+  g_assert_no_error (error);
+
+  return g_get_monotonic_time () - start;
+}
+
+static guint64
+smaps_field (const char *contents,
+             const char *field)
+{
+  const char *p = strstr (contents, field);
+
+  if (p == NULL)
+    return 0;
+
+  return g_ascii_strtoull (p + strlen (field), NULL, 10);
+}
+
+typedef struct
+{
+  gchar *tmpdir;
+  gchar *socket_path;
+  gchar *address;
+  GSocket *listener;
+  GSubprocessLauncher *launcher;
+} FakeBus;
+
+/* A listening socket that looks like a D-Bus server, but never replies,
+ * so that clients stay blocked in the authentication handshake */
+static FakeBus *
+fake_bus_new (void)
+{
+  g_autoptr(GSocketAddress) address = NULL;
+  g_autoptr(GError) error = NULL;
+  FakeBus *bus = g_new0 (FakeBus, 1);
+
+  bus->tmpdir = g_dir_make_tmp ("bench-startup-XXXXXX", &error);
+  g_assert_no_error (error);
+  bus->socket_path = g_build_filename (bus->tmpdir, "bus", NULL);
+  bus->address = g_strdup_printf ("unix:path=%s", bus->socket_path);
+
+  bus->listener = g_socket_new (G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM,
+                                G_SOCKET_PROTOCOL_DEFAULT, &error);
+  g_assert_no_error (error);
+  address = g_unix_socket_address_new (bus->socket_path);
+  g_socket_bind (bus->listener, address, TRUE, &error);
+  g_assert_no_error (error);
+  g_socket_listen (bus->listener, &error);
+  g_assert_no_error (error);
+  g_socket_set_timeout (bus->listener, 10);
+
+  bus->launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDOUT_SILENCE |
+                                             G_SUBPROCESS_FLAGS_STDERR_SILENCE);
+  g_subprocess_launcher_setenv (bus->launcher, "DBUS_SESSION_BUS_ADDRESS",
+                                bus->address, TRUE);
+
+  return bus;
+}
+
+static void
+fake_bus_free (FakeBus *bus)
+{
+  g_object_unref (bus->launcher);
+  g_object_unref (bus->listener);
+  g_unlink (bus->socket_path);
+  g_rmdir (bus->tmpdir);
+  g_free (bus->address);
+  g_free (bus->socket_path);
+  g_free (bus->tmpdir);
+  g_free (bus);
+}
+
+static GSubprocess *
+fake_bus_spawn (FakeBus    *bus,
+                const char *path,
+                const char *arg)
+{
+  g_autoptr(GError) error = NULL;
+  GSubprocess *subprocess;
+
+  subprocess = g_subprocess_launcher_spawn (bus->launcher, &error,
+                                            path, arg, NULL);
+  g_assert_no_error (error);
+  return subprocess;
+}
+
+static GSocket *
+fake_bus_accept (FakeBus *bus)
+{
+  g_autoptr(GError) error = NULL;
+  GSocket *connection;
+
+  connection = g_socket_accept (bus->listener, NULL, &error);
+  g_assert_no_error (error);
+  return connection;
+}
+
+static void
+kill_subprocess (GSubprocess *subprocess)
+{
+  g_subprocess_send_signal (subprocess, SIGKILL);
+  g_subprocess_wait (subprocess, NULL, NULL);
+  g_object_unref (subprocess);
+}
+
+/* Time from exec to the tool's first byte of D-Bus traffic, which is
+ * what startup costs the user of a tool that does nothing else */
+static gint64
+time_to_first_bus_byte (FakeBus    *bus,
+                        const char *path,
+                        const char *arg)
+{
+  g_autoptr(GSocket) connection = NULL;
+  g_autoptr(GError) error = NULL;
+  GSubprocess *subprocess;
+  gint64 start;
+  gint64 end;
+  char byte;
+
+  start = g_get_monotonic_time ();
+  subprocess = fake_bus_spawn (bus, path, arg);
+  connection = fake_bus_accept (bus);
+  g_socket_set_timeout (connection, 10);
+  g_socket_receive (connection, &byte, 1, NULL, &error);
+  end = g_get_monotonic_time ();
+  g_assert_no_error (error);
+
+  kill_subprocess (subprocess);
+  return end - start;
+}
+
+static void
+measure_footprint (FakeBus            *bus,
+                   const char * const *paths,
+                   Footprint          *footprint)
+{
+  g_autoptr(GError) error = NULL;
+  GSubprocess *subprocesses[N_TOOLS] = { NULL };
+  GSocket *connections[N_TOOLS] = { NULL };
+  gsize i;
+
+  memset (footprint, 0, sizeof (*footprint));
+
+  for (i = 0; i < N_TOOLS; i++)
+    subprocesses[i] = fake_bus_spawn (bus, paths[i], tools[i].bus_arg);
+
+  /* Once all three have connected, they have finished starting up and
+   * are waiting for us to authenticate them, which we never do */
+  for (i = 0; i < N_TOOLS; i++)
+    connections[i] = fake_bus_accept (bus);
+
+  for (i = 0; i < N_TOOLS; i++)
+    {
+      g_autofree gchar *smaps = NULL;
+      g_autofree gchar *contents = NULL;
+
+      smaps = g_strdup_printf ("/proc/%s/smaps_rollup",
+                               g_subprocess_get_identifier (subprocesses[i]));
+      g_file_get_contents (smaps, &contents, NULL, &error);
+      g_assert_no_error (error);
+
+      footprint->rss += smaps_field (contents, "\nRss:");
+      footprint->pss += smaps_field (contents, "\nPss:");
+      footprint->shared_clean += smaps_field (contents, "\nShared_Clean:");
+    }
+
+  for (i = 0; i < N_TOOLS; i++)
+    {
+      kill_subprocess (subprocesses[i]);
+      g_object_unref (connections[i]);
+    }
+}
+
+static gint
+compare_gint64 (gconstpointer a,
+                gconstpointer b)
+{
+  gint64 x = *(const gint64 *) a;
+  gint64 y = *(const gint64 *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* Medians are less disturbed than means by the occasional run that
+ * gets descheduled */
+static double
+median_ms (GArray *samples)
+{
+  gint64 *values = (gint64 *) (void *) samples->data;
+  guint n = samples->len;
+
+  g_array_sort (samples, compare_gint64);
+
+  if (n % 2 == 1)
+    return values[n / 2] / 1000.0;
+
+  return (values[n / 2 - 1] + values[n / 2]) / 2000.0;
+}
+
+static void
+bench (const char         *label,
+       const char * const *paths,
+       guint               iterations,
+       gboolean            drop_caches)
+{
+  guint cold_iterations = MAX (iterations / 10, 1);
+  FakeBus *bus = fake_bus_new ();
+  Footprint footprint;
+  gsize i;
+  guint j;
+
+  g_print ("%s\n", label);
+
+  for (i = 0; i < N_TOOLS; i++)
+    {
+      g_autoptr(GArray) warm = g_array_sized_new (FALSE, FALSE, sizeof (gint64), iterations);
+      g_autoptr(GArray) cold = g_array_sized_new (FALSE, FALSE, sizeof (gint64), cold_iterations);
+      g_autoptr(GArray) first_byte = g_array_sized_new (FALSE, FALSE, sizeof (gint64), iterations);
+      gint64 t;
+
+      /* Warm up */
+      run_once (paths[i], tools[i].quick_arg);
+
+      for (j = 0; j < iterations; j++)
+        {
+          t = run_once (paths[i], tools[i].quick_arg);
+          g_array_append_val (warm, t);
+        }
+
+      for (j = 0; j < cold_iterations; j++)
+        {
+          evict (paths[i], drop_caches);
+          t = run_once (paths[i], tools[i].quick_arg);
+          g_array_append_val (cold, t);
+        }
+
+      for (j = 0; j < iterations; j++)
+        {
+          t = time_to_first_bus_byte (bus, paths[i], tools[i].bus_arg);
+          g_array_append_val (first_byte, t);
+        }
+
+      g_print ("  %-14s warm %8.3f ms   cold %8.3f ms   "
+               "exec to first D-Bus byte %8.3f ms\n",
+               tools[i].name,
+               median_ms (warm),
+               median_ms (cold),
+               median_ms (first_byte));
+    }
+
+  measure_footprint (bus, paths, &footprint);
+  g_print ("  all three running: Rss %" G_GUINT64_FORMAT " kB, "
+           "Pss %" G_GUINT64_FORMAT " kB, "
+           "Shared_Clean %" G_GUINT64_FORMAT " kB\n",
+           footprint.rss, footprint.pss, footprint.shared_clean);
+
+  fake_bus_free (bus);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  const char *env;
+  guint iterations = 200;
+  gboolean drop_caches = FALSE;
+  int i;
+
+  env = g_getenv ("BENCH_ITERATIONS");
+
+  if (env != NULL)
+    iterations = MAX (atoi (env), 1);
+
+  drop_caches = (g_strcmp0 (g_getenv ("BENCH_DROP_CACHES"), "1") == 0 &&
+                 geteuid () == 0);
+
+  if (argc < 2)
+    {
+      const char *paths[N_TOOLS];
+      gsize j;
+
+      for (j = 0; j < N_TOOLS; j++)
+        {
+          paths[j] = g_getenv (tools[j].env);
+
+          if (paths[j] == NULL)
+            g_error ("%s must be set, or a directory given", tools[j].env);
+        }
+
+      bench ("(environment)", paths, iterations, drop_caches);
+      return 0;
+    }
+
+  for (i = 1; i < argc; i++)
+    {
+      gchar *paths[N_TOOLS] = { NULL };
+      gsize j;
+
+      for (j = 0; j < N_TOOLS; j++)
+        paths[j] = g_build_filename (argv[i], tools[j].name, NULL);
+
+      bench (argv[i], (const char * const *) paths, iterations, drop_caches);
+
+      for (j = 0; j < N_TOOLS; j++)
+        g_free (paths[j]);
+    }
+
+  return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Entry point for the fuzz targets when they are not linked with
+ * libFuzzer: runs the target once on each file named on the command
+ * line, on each file in each directory named, or on standard input if
+ * there are no arguments. This is how the seed corpora are run as
+ * tests, and how AFL can run the targets (with @@ as the argument).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "backport-autoptr.h"
+#include "fuzz.h"
+
+static gboolean
+run_file (const char *path)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *contents = NULL;
+  gsize len;
+
+  if (!g_file_get_contents (path, &contents, &len, &error))
+    {
+      fprintf (stderr, "%s\n", error->message);
+      return FALSE;
+    }
+
+  LLVMFuzzerTestOneInput ((const uint8_t *) contents, len);
+  return TRUE;
+}
+
+static gboolean
+run_path (const char *path)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+  gboolean ret = TRUE;
+
+  if (!g_file_test (path, G_FILE_TEST_IS_DIR))
+    return run_file (path);
+
+  dir = g_dir_open (path, 0, &error);
+
+  if (dir == NULL)
+    {
+      fprintf (stderr, "%s\n", error->message);
+      return FALSE;
+    }
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *child = g_build_filename (path, name, NULL);
+
+      if (!run_file (child))
+        ret = FALSE;
+    }
+
+  return ret;
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  int ret = 0;
+  int i;
+
+  if (argc < 2)
+    {
+      g_autoptr(GByteArray) input = g_byte_array_new ();
+      guint8 buf[4096];
+      ssize_t n;
+
+      while ((n = read (STDIN_FILENO, buf, sizeof (buf))) > 0)
+        g_byte_array_append (input, buf, n);
+
+      if (n < 0)
+        {
+          perror ("read");
+          return 1;
+        }
+
+      LLVMFuzzerTestOneInput (input->data, input->len);
+      return 0;
+    }
+
+  for (i = 1; i < argc; i++)
+    {
+      if (!run_path (argv[i]))
+        ret = 1;
+    }
+
+  return ret;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The input is a mailto: URI, as xdg-email would get in its argv */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "backport-autoptr.h"
+#include "fuzz.h"
+#include "xdg-email-mailto.h"
+
+int
+LLVMFuzzerTestOneInput (const uint8_t *data,
+                        size_t         size)
+{
+  g_autofree gchar *uri = g_strndup ((const char *) data, size);
+  g_autoptr(GPtrArray) to = NULL;
+  g_autoptr(GPtrArray) cc = NULL;
+  g_autoptr(GPtrArray) bcc = NULL;
+  g_autofree gchar *subject = NULL;
+  g_autofree gchar *body = NULL;
+
+  fuzz_set_logging_func ();
+
+  if (g_ascii_strncasecmp (uri, "mailto:", strlen ("mailto:")) != 0)
+    return 0;
+
+  to = g_ptr_array_new_with_free_func (g_free);
+  cc = g_ptr_array_new_with_free_func (g_free);
+  bcc = g_ptr_array_new_with_free_func (g_free);
+
+  xdg_email_parse_mailto (uri, to, cc, bcc, &subject, &body);
+  return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The input is flatpak-spawn's arguments after argv[0], each followed
+ * by a \0, which are parsed as flatpak-spawn's main() would parse them.
+ * --env-fd is left out, because it would read whatever file descriptor
+ * it was given; fuzz-spawn-env-fd covers it.
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "backport-autoptr.h"
+#include "flatpak-spawn-options.h"
+#include "fuzz.h"
+
+static const GOptionEntry options[] = {
+  { "env", 0, 0, G_OPTION_ARG_CALLBACK, flatpak_spawn_options_env_cb, "Set environment variable", "VAR=VALUE" },
+  { "unset-env", 0, 0, G_OPTION_ARG_CALLBACK, flatpak_spawn_options_unset_env_cb, "Unset environment variable", "VAR=VALUE" },
+  { "sandbox-flag", 0, 0, G_OPTION_ARG_CALLBACK, flatpak_spawn_options_sandbox_flag_cb, "Enable sandbox flag", "FLAG" },
+  { NULL }
+};
+
+int
+LLVMFuzzerTestOneInput (const uint8_t *data,
+                        size_t         size)
+{
+  g_autoptr(GPtrArray) args = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GOptionContext) context = NULL;
+  g_autofree char **argv = NULL;
+  FlatpakSpawnOptions opts;
+  GOptionGroup *main_group;
+  const char *p = (const char *) data;
+  const char *end = p + size;
+  int opt_argc;
+
+  fuzz_set_logging_func ();
+
+  g_ptr_array_add (args, g_strdup ("flatpak-spawn"));
+
+  while (p < end)
+    {
+      const char *nul = memchr (p, '\0', end - p);
+
+      if (nul == NULL)
+        nul = end;
+
+      g_ptr_array_add (args, g_strndup (p, nul - p));
+      p = nul + 1;
+    }
+
+  /* GOption rearranges argv, so it gets a copy and args keeps
+   * ownership of the strings */
+  argv = g_new0 (char *, args->len + 1);
+  memcpy (argv, args->pdata, args->len * sizeof (char *));
+
+  /* As in main(), only the options before the command are parsed */
+  for (opt_argc = 1;
+       opt_argc < (int) args->len && argv[opt_argc][0] == '-';
+       opt_argc++)
+    ;
+
+  flatpak_spawn_options_init (&opts);
+
+  context = g_option_context_new (NULL);
+  g_option_context_set_help_enabled (context, FALSE);
+  g_option_context_set_ignore_unknown_options (context, TRUE);
+  main_group = g_option_group_new (NULL, NULL, NULL, &opts, NULL);
+  g_option_group_add_entries (main_group, options);
+  g_option_context_set_main_group (context, main_group);
+
+  g_option_context_parse (context, &opt_argc, &argv, NULL);
+
+  flatpak_spawn_options_clear (&opts);
+  return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The input is what flatpak-spawn --env-fd would read from its file
+ * descriptor, in env -0 format. It is passed through a temporary file,
+ * so that the option's callback reads it as it would in flatpak-spawn.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "backport-autoptr.h"
+#include "flatpak-spawn-options.h"
+#include "fuzz.h"
+
+int
+LLVMFuzzerTestOneInput (const uint8_t *data,
+                        size_t         size)
+{
+  g_autofree gchar *path = NULL;
+  g_autofree gchar *fd_str = NULL;
+  FlatpakSpawnOptions opts;
+  size_t done = 0;
+  int fd;
+
+  fuzz_set_logging_func ();
+
+  fd = g_file_open_tmp ("fuzz-spawn-env-fd-XXXXXX", &path, NULL);
+
+  if (fd < 0)
+    abort ();
+
+  g_unlink (path);
+
+  while (done < size)
+    {
+      ssize_t n = write (fd, data + done, size - done);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n < 0)
+        abort ();
+
+      done += n;
+    }
+
+  fd_str = g_strdup_printf ("%d", fd);
+  flatpak_spawn_options_init (&opts);
+
+  /* The callback only closes the file descriptor if it succeeds */
+  if (!flatpak_spawn_options_env_fd_cb ("--env-fd", fd_str, &opts, NULL))
+    close (fd);
+
+  flatpak_spawn_options_clear (&opts);
+  return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+/* Implemented by each fuzz target, and called by libFuzzer or driver.c */
+int LLVMFuzzerTestOneInput (const uint8_t *data,
+                            size_t         size);
+
+/* The parsers warn about bad input, which is most of what a fuzzer
+ * gives them, so anything up to a warning is not shown */
+static void
+fuzz_log_handler (const gchar    *log_domain,
+                  GLogLevelFlags  log_level,
+                  const gchar    *message,
+                  gpointer        user_data)
+{
+  if (log_level & (G_LOG_LEVEL_DEBUG | G_LOG_LEVEL_INFO |
+                   G_LOG_LEVEL_MESSAGE | G_LOG_LEVEL_WARNING))
+    return;
+
+  g_log_default_handler (log_domain, log_level, message, user_data);
+}
+
+/* Criticals and errors are shown, and abort: a failed g_return_if_fail()
+ * is exactly what fuzzing should find, whether or not G_DEBUG has
+ * fatal-criticals, which only the test suite sets */
+static inline void
+fuzz_set_logging_func (void)
+{
+  static gboolean done = FALSE;
+
+  if (done)
+    return;
+
+  g_log_set_default_handler (fuzz_log_handler, NULL);
+  g_log_set_always_fatal (G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_ERROR);
+  done = TRUE;
+}
@@ -0,0 +1,442 @@
+/*
+ * Copyright © 2018-2019 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+
+#include "backport-autoptr.h"
+#include "common.h"
+#include "flatpak-spawn-launcher.h"
+
+#define FLATPAK_PORTAL_BUS_NAME "org.freedesktop.portal.Flatpak"
+#define FLATPAK_PORTAL_PATH "/org/freedesktop/portal/Flatpak"
+#define FLATPAK_PORTAL_INTERFACE FLATPAK_PORTAL_BUS_NAME
+
+#define N_CHILDREN 100
+
+static const char portal_xml[] =
+  "<node>"
+  "  <interface name='" FLATPAK_PORTAL_INTERFACE "'>"
+  "    <method name='Spawn'>"
+  "      <arg type='ay' name='cwd_path' direction='in'/>"
+  "      <arg type='aay' name='argv' direction='in'/>"
+  "      <arg type='a{uh}' name='fds' direction='in'/>"
+  "      <arg type='a{ss}' name='envs' direction='in'/>"
+  "      <arg type='u' name='flags' direction='in'/>"
+  "      <arg type='a{sv}' name='options' direction='in'/>"
+  "      <arg type='u' name='pid' direction='out'/>"
+  "    </method>"
+  "    <method name='SpawnSignal'>"
+  "      <arg type='u' name='pid' direction='in'/>"
+  "      <arg type='u' name='signal' direction='in'/>"
+  "      <arg type='b' name='to_process_group' direction='in'/>"
+  "    </method>"
+  "    <property name='version' type='u' access='read'/>"
+  "  </interface>"
+  "</node>";
+
+typedef struct
+{
+  GSubprocess *dbus_daemon;
+  gchar *dbus_address;
+  GDBusConnection *mock_portal_conn;
+  GDBusConnection *client_conn;
+  GDBusNodeInfo *node_info;
+  guint mock_portal_object;
+  guint32 next_pid;
+  GQueue signals;
+  GCancellable *cancel_on_spawn;
+} Fixture;
+
+typedef struct
+{
+  FlatpakSpawnProcess *process;
+  GAsyncResult *wait_result;
+} Child;
+
+static void
+mock_method_call (GDBusConnection *conn G_GNUC_UNUSED,
+                  const gchar *sender G_GNUC_UNUSED,
+                  const gchar *object_path G_GNUC_UNUSED,
+                  const gchar *interface_name,
+                  const gchar *method_name,
+                  GVariant *parameters,
+                  GDBusMethodInvocation *invocation,
+                  gpointer user_data)
+{
+  Fixture *f = user_data;
+  g_autofree gchar *params = NULL;
+
+  params = g_variant_print (parameters, TRUE);
+
+  g_test_message ("Method called: %s.%s%s", interface_name, method_name,
+                  params);
+
+  if (strcmp (method_name, "Spawn") == 0)
+    {
+      if (f->cancel_on_spawn != NULL)
+        g_cancellable_cancel (f->cancel_on_spawn);
+
+      g_dbus_method_invocation_return_value (invocation,
+                                             g_variant_new ("(u)", f->next_pid++));
+    }
+  else
+    {
+      g_queue_push_tail (&f->signals, g_variant_ref (parameters));
+      g_dbus_method_invocation_return_value (invocation, NULL);
+    }
+}
+
+static GVariant *
+mock_get_property (GDBusConnection *conn G_GNUC_UNUSED,
+                   const gchar *sender G_GNUC_UNUSED,
+                   const gchar *object_path G_GNUC_UNUSED,
+                   const gchar *interface_name G_GNUC_UNUSED,
+                   const gchar *property_name G_GNUC_UNUSED,
+                   GError **error G_GNUC_UNUSED,
+                   gpointer user_data G_GNUC_UNUSED)
+{
+  return g_variant_new_uint32 (6);
+}
+
+static const GDBusInterfaceVTable vtable =
+{
+  mock_method_call,
+  mock_get_property,
+  NULL  /* set */
+};
+
+static void
+setup (Fixture *f,
+       gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+
+  f->next_pid = 1000;
+  g_queue_init (&f->signals);
+
+  setup_dbus_daemon (&f->dbus_daemon, &f->dbus_address);
+
+  f->node_info = g_dbus_node_info_new_for_xml (portal_xml, &error);
+  g_assert_no_error (error);
+
+  f->mock_portal_conn = g_dbus_connection_new_for_address_sync (f->dbus_address,
+                                                                (G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                                 G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION),
+                                                                NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (f->mock_portal_conn);
+
+  f->client_conn = g_dbus_connection_new_for_address_sync (f->dbus_address,
+                                                           (G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                            G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION),
+                                                           NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (f->client_conn);
+
+  f->mock_portal_object = g_dbus_connection_register_object (f->mock_portal_conn,
+                                                             FLATPAK_PORTAL_PATH,
+                                                             f->node_info->interfaces[0],
+                                                             &vtable,
+                                                             f,
+                                                             NULL,
+                                                             &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (f->mock_portal_object, !=, 0);
+
+  own_name_sync (f->mock_portal_conn, FLATPAK_PORTAL_BUS_NAME);
+}
+
+static FlatpakSpawnProcess *
+spawn_sync (Fixture *f,
+            FlatpakSpawnLauncher *launcher,
+            const char * const *argv)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GError) error = NULL;
+  FlatpakSpawnProcess *process;
+
+  flatpak_spawn_launcher_spawn_async (launcher, argv, NULL,
+                                      store_result_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  process = flatpak_spawn_launcher_spawn_finish (launcher, result, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (process);
+  g_assert_cmpuint (flatpak_spawn_process_get_pid (process), >=, 1000);
+  g_assert_cmpuint (flatpak_spawn_process_get_pid (process), <, f->next_pid);
+  return process;
+}
+
+static void
+emit_exited (Fixture *f,
+             guint32 pid,
+             guint32 wait_status)
+{
+  g_autoptr(GError) error = NULL;
+
+  g_dbus_connection_emit_signal (f->mock_portal_conn,
+                                 NULL,
+                                 FLATPAK_PORTAL_PATH,
+                                 FLATPAK_PORTAL_INTERFACE,
+                                 "SpawnExited",
+                                 g_variant_new ("(uu)", pid, wait_status),
+                                 &error);
+  g_assert_no_error (error);
+}
+
+/* Many children share one connection, and each exit notification goes
+ * to the right one, whatever order they exit in */
+static void
+test_many (Fixture *f,
+           gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(FlatpakSpawnLauncher) launcher = NULL;
+  const char * const argv[] = { "some-command", NULL };
+  Child children[N_CHILDREN] = {};
+  gsize i;
+
+  launcher = flatpak_spawn_launcher_new (FLATPAK_SPAWN_LAUNCHER_FLAGS_NONE);
+  flatpak_spawn_launcher_set_connection (launcher, f->client_conn);
+  flatpak_spawn_launcher_set_cwd (launcher, "/");
+
+  for (i = 0; i < N_CHILDREN; i++)
+    {
+      children[i].process = spawn_sync (f, launcher, argv);
+      flatpak_spawn_process_wait_async (children[i].process, NULL,
+                                        store_result_cb,
+                                        &children[i].wait_result);
+    }
+
+  for (i = N_CHILDREN; i > 0; i--)
+    emit_exited (f, flatpak_spawn_process_get_pid (children[i - 1].process),
+                 (i - 1) << 8);
+
+  for (i = 0; i < N_CHILDREN; i++)
+    {
+      g_autoptr(GError) error = NULL;
+      int status;
+
+      while (children[i].wait_result == NULL)
+        g_main_context_iteration (NULL, TRUE);
+
+      g_assert_true (flatpak_spawn_process_wait_finish (children[i].process,
+                                                        children[i].wait_result,
+                                                        &error));
+      g_assert_no_error (error);
+      g_assert_true (flatpak_spawn_process_has_exited (children[i].process));
+      status = flatpak_spawn_process_get_status (children[i].process);
+      g_assert_true (WIFEXITED (status));
+      g_assert_cmpint (WEXITSTATUS (status), ==, i);
+
+      g_clear_object (&children[i].wait_result);
+      g_clear_object (&children[i].process);
+    }
+}
+
+static void
+test_signal (Fixture *f,
+             gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(FlatpakSpawnLauncher) launcher = NULL;
+  g_autoptr(FlatpakSpawnProcess) process = NULL;
+  g_autoptr(GVariant) parameters = NULL;
+  g_autoptr(GError) error = NULL;
+  const char * const argv[] = { "some-command", NULL };
+  guint32 pid, sig;
+  gboolean to_process_group;
+
+  launcher = flatpak_spawn_launcher_new (FLATPAK_SPAWN_LAUNCHER_FLAGS_NONE);
+  flatpak_spawn_launcher_set_connection (launcher, f->client_conn);
+  process = spawn_sync (f, launcher, argv);
+
+  g_assert_true (flatpak_spawn_process_send_signal_sync (process, SIGUSR1,
+                                                         TRUE, NULL, &error));
+  g_assert_no_error (error);
+
+  flatpak_spawn_process_send_signal (process, SIGTERM, FALSE);
+
+  while (g_queue_get_length (&f->signals) < 2)
+    g_main_context_iteration (NULL, TRUE);
+
+  parameters = g_queue_pop_head (&f->signals);
+  g_variant_get (parameters, "(uub)", &pid, &sig, &to_process_group);
+  g_assert_cmpuint (pid, ==, flatpak_spawn_process_get_pid (process));
+  g_assert_cmpuint (sig, ==, SIGUSR1);
+  g_assert_true (to_process_group);
+  g_clear_pointer (&parameters, g_variant_unref);
+
+  parameters = g_queue_pop_head (&f->signals);
+  g_variant_get (parameters, "(uub)", &pid, &sig, &to_process_group);
+  g_assert_cmpuint (pid, ==, flatpak_spawn_process_get_pid (process));
+  g_assert_cmpuint (sig, ==, SIGTERM);
+  g_assert_false (to_process_group);
+}
+
+/* If the portal goes away, we can no longer track its children */
+static void
+test_vanished (Fixture *f,
+               gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(FlatpakSpawnLauncher) launcher = NULL;
+  g_autoptr(FlatpakSpawnProcess) process = NULL;
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GError) error = NULL;
+  const char * const argv[] = { "some-command", NULL };
+
+  launcher = flatpak_spawn_launcher_new (FLATPAK_SPAWN_LAUNCHER_FLAGS_NONE);
+  flatpak_spawn_launcher_set_connection (launcher, f->client_conn);
+  process = spawn_sync (f, launcher, argv);
+  flatpak_spawn_process_wait_async (process, NULL, store_result_cb, &result);
+
+  g_dbus_connection_unregister_object (f->mock_portal_conn,
+                                       f->mock_portal_object);
+  f->mock_portal_object = 0;
+  g_dbus_connection_close_sync (f->mock_portal_conn, NULL, &error);
+  g_assert_no_error (error);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_false (flatpak_spawn_process_wait_finish (process, result, &error));
+  g_assert_error (error, FLATPAK_SPAWN_ERROR, FLATPAK_SPAWN_ERROR_SERVICE_VANISHED);
+  g_assert_false (flatpak_spawn_process_has_exited (process));
+}
+
+static void
+test_no_command (Fixture *f G_GNUC_UNUSED,
+                 gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(FlatpakSpawnLauncher) launcher = NULL;
+  g_autoptr(FlatpakSpawnProcess) process = NULL;
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GError) error = NULL;
+  const char * const argv[] = { NULL };
+
+  launcher = flatpak_spawn_launcher_new (FLATPAK_SPAWN_LAUNCHER_FLAGS_HOST |
+                                         FLATPAK_SPAWN_LAUNCHER_FLAGS_SANDBOX);
+  flatpak_spawn_launcher_set_connection (launcher, f->client_conn);
+
+  flatpak_spawn_launcher_spawn_async (launcher, argv, NULL,
+                                      store_result_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  process = flatpak_spawn_launcher_spawn_finish (launcher, result, &error);
+  g_assert_error (error, FLATPAK_SPAWN_ERROR, FLATPAK_SPAWN_ERROR_INVALID_OPTION);
+  g_assert_null (process);
+}
+
+/* A command that the service has started is returned even if the
+ * caller cancels meanwhile, because otherwise it could not be reaped */
+static void
+test_cancel_after_spawn (Fixture *f,
+                         gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(FlatpakSpawnLauncher) launcher = NULL;
+  g_autoptr(FlatpakSpawnProcess) process = NULL;
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GError) error = NULL;
+  const char * const argv[] = { "some-command", NULL };
+
+  launcher = flatpak_spawn_launcher_new (FLATPAK_SPAWN_LAUNCHER_FLAGS_NONE);
+  flatpak_spawn_launcher_set_connection (launcher, f->client_conn);
+  flatpak_spawn_launcher_set_cwd (launcher, "/");
+
+  f->cancel_on_spawn = cancellable;
+  flatpak_spawn_launcher_spawn_async (launcher, argv, cancellable,
+                                      store_result_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  f->cancel_on_spawn = NULL;
+  g_assert_true (g_cancellable_is_cancelled (cancellable));
+
+  process = flatpak_spawn_launcher_spawn_finish (launcher, result, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (process);
+  g_assert_cmpuint (flatpak_spawn_process_get_pid (process), ==, 1000);
+
+  /* Cancelled before anything was sent, nothing is started */
+  g_clear_object (&result);
+  flatpak_spawn_launcher_spawn_async (launcher, argv, cancellable,
+                                      store_result_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_clear_object (&process);
+  process = flatpak_spawn_launcher_spawn_finish (launcher, result, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_null (process);
+  g_assert_cmpuint (f->next_pid, ==, 1001);
+}
+
+static void
+teardown (Fixture *f,
+          gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  gpointer free_me;
+
+  for (free_me = g_queue_pop_head (&f->signals);
+       free_me != NULL;
+       free_me = g_queue_pop_head (&f->signals))
+    g_variant_unref (free_me);
+
+  if (f->mock_portal_object != 0)
+    g_dbus_connection_unregister_object (f->mock_portal_conn,
+                                         f->mock_portal_object);
+
+  if (f->dbus_daemon != NULL)
+    {
+      g_subprocess_send_signal (f->dbus_daemon, SIGTERM);
+      g_subprocess_wait (f->dbus_daemon, NULL, &error);
+      g_assert_no_error (error);
+    }
+
+  g_clear_object (&f->dbus_daemon);
+  g_clear_object (&f->mock_portal_conn);
+  g_clear_object (&f->client_conn);
+  g_clear_pointer (&f->node_info, g_dbus_node_info_unref);
+  g_free (f->dbus_address);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/launcher/cancel-after-spawn", Fixture, NULL, setup, test_cancel_after_spawn, teardown);
+  g_test_add ("/launcher/many", Fixture, NULL, setup, test_many, teardown);
+  g_test_add ("/launcher/no-command", Fixture, NULL, setup, test_no_command, teardown);
+  g_test_add ("/launcher/signal", Fixture, NULL, setup, test_signal, teardown);
+  g_test_add ("/launcher/vanished", Fixture, NULL, setup, test_vanished, teardown);
+
+  return g_test_run ();
+}
@@ -40,6 +40,7 @@ typedef struct
   GDBusConnection *mock_conn;
   guint mock_object;
   GQueue invocations;
+  gboolean portal_hangs;
 } Fixture;
 
 typedef struct
@@ -66,6 +67,10 @@ mock_method_call (GDBusConnection *conn G_GNUC_UNUSED,
                   params);
 
   g_queue_push_tail (&f->invocations, g_object_ref (invocation));
+
+  if (f->portal_hangs)
+    return;
+
   g_dbus_method_invocation_return_value (invocation,
                                          g_variant_new ("(o)", "/foo"));
 }
@@ -289,6 +294,43 @@ test_uri (Fixture *f,
   g_assert_cmpstr (uri, ==, "http://example.com/");
 }
 
+static void
+test_deadline (Fixture *f,
+               gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autoptr(GError) error = NULL;
+
+  f->portal_hangs = TRUE;
+  g_test_timer_start ();
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE);
+  g_subprocess_launcher_setenv (launcher,
+                                "DBUS_SESSION_BUS_ADDRESS",
+                                f->dbus_address,
+                                TRUE);
+
+  f->xdg_open = g_subprocess_launcher_spawn (launcher, &error,
+                                             f->xdg_open_path,
+                                             "--deadline=0.5",
+                                             "http://example.com/",
+                                             NULL);
+  g_assert_no_error (error);
+  g_assert_nonnull (f->xdg_open);
+
+  while (g_queue_get_length (&f->invocations) < 1)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_subprocess_wait_check (f->xdg_open, NULL, &error);
+  g_assert_error (error, G_SPAWN_EXIT_ERROR, 124);
+
+  /* Well before the 25 second D-Bus default */
+  g_assert_cmpfloat (g_test_timer_elapsed (), <=, 20);
+  g_test_minimized_result (g_test_timer_elapsed (),
+                           "time to time out: %.1f",
+                           g_test_timer_elapsed ());
+}
+
 static void
 test_file (Fixture *f,
            gconstpointer context G_GNUC_UNUSED)
@@ -395,6 +437,7 @@ main (int argc,
   g_test_add ("/help", Fixture, NULL, setup, test_help, teardown);
   g_test_add ("/uri", Fixture, NULL, setup, test_uri, teardown);
   g_test_add ("/file", Fixture, NULL, setup, test_file, teardown);
+  g_test_add ("/deadline", Fixture, NULL, setup, test_deadline, teardown);
 
   return g_test_run ();
 }
@@ -0,0 +1,376 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks that flatpak-spawn's option callbacks and xdg-email's mailto:
+ * parser take time linear in the size of their input, by timing them
+ * on pathological inputs of two sizes. Timings depend on what else the
+ * machine is doing, so they are only checked with -m perf, as the
+ * benchmark does; otherwise this only checks that the inputs parse.
+ *
+ * If PARSER_CORPUS_DIR is set, the larger inputs are also written to
+ * PARSER_CORPUS_DIR/TARGET/NAME in the format of the fuzz target of that
+ * name in tests/fuzzing, to measure its throughput or to seed it.
+ */
+
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "backport-autoptr.h"
+#include "flatpak-spawn-options.h"
+#include "xdg-email-mailto.h"
+
+#define SMALL 10000
+#define LARGE 100000
+/* Linear parsing would take 10 times as long for the larger input, and
+ * quadratic parsing 100 times; allow for noise in between */
+#define MAX_RATIO 40.0
+#define RUNS 3
+
+typedef struct
+{
+  const char *target;
+  /* Appends the i'th repetition of the pathological part */
+  void (*append) (GString *input, guint i);
+  const char *prefix;
+  const char *suffix;
+  /* Returns how many items were parsed */
+  guint (*parse) (const GString *input);
+  guint items_per_repetition;
+} Config;
+
+static guint
+parse_spawn_argv (const GString *input)
+{
+  static const GOptionEntry options[] = {
+    { "env", 0, 0, G_OPTION_ARG_CALLBACK, flatpak_spawn_options_env_cb, "Set environment variable", "VAR=VALUE" },
+    { "unset-env", 0, 0, G_OPTION_ARG_CALLBACK, flatpak_spawn_options_unset_env_cb, "Unset environment variable", "VAR=VALUE" },
+    { "sandbox-flag", 0, 0, G_OPTION_ARG_CALLBACK, flatpak_spawn_options_sandbox_flag_cb, "Enable sandbox flag", "FLAG" },
+    { NULL }
+  };
+  g_autoptr(GPtrArray) args = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char **argv = NULL;
+  FlatpakSpawnOptions opts;
+  GOptionGroup *main_group;
+  const char *p = input->str;
+  const char *end = input->str + input->len;
+  int argc;
+  guint n;
+
+  g_ptr_array_add (args, g_strdup ("flatpak-spawn"));
+
+  while (p < end)
+    {
+      g_ptr_array_add (args, g_strdup (p));
+      p += strlen (p) + 1;
+    }
+
+  argv = g_new0 (char *, args->len + 1);
+  memcpy (argv, args->pdata, args->len * sizeof (char *));
+  argc = args->len;
+
+  flatpak_spawn_options_init (&opts);
+
+  context = g_option_context_new (NULL);
+  main_group = g_option_group_new (NULL, NULL, NULL, &opts, NULL);
+  g_option_group_add_entries (main_group, options);
+  g_option_context_set_main_group (context, main_group);
+
+  g_option_context_parse (context, &argc, &argv, &error);
+  g_assert_no_error (error);
+
+  n = g_hash_table_size (opts.env) + g_hash_table_size (opts.unset_env);
+
+  if (opts.sandbox_flags != 0)
+    n++;
+
+  flatpak_spawn_options_clear (&opts);
+  return n;
+}
+
+static guint
+parse_env_block (const GString *input)
+{
+  g_autoptr(GError) error = NULL;
+  FlatpakSpawnOptions opts;
+  guint n;
+
+  flatpak_spawn_options_init (&opts);
+  flatpak_spawn_options_add_env_block (&opts, input->str, input->len, &error);
+  g_assert_no_error (error);
+  n = g_hash_table_size (opts.env);
+  flatpak_spawn_options_clear (&opts);
+  return n;
+}
+
+static guint
+parse_mailto (const GString *input)
+{
+  g_autoptr(GPtrArray) to = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) cc = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) bcc = g_ptr_array_new_with_free_func (g_free);
+  g_autofree gchar *subject = NULL;
+  g_autofree gchar *body = NULL;
+
+  xdg_email_parse_mailto (input->str, to, cc, bcc, &subject, &body);
+  return to->len + cc->len + bcc->len + (subject != NULL) + (body != NULL);
+}
+
+static void
+append_env (GString *input,
+            guint i)
+{
+  g_string_append_printf (input, "--env=VAR%u=value", i);
+  g_string_append_c (input, '\0');
+}
+
+static void
+append_env_same (GString *input,
+                 guint i)
+{
+  g_string_append_printf (input, "--env=VAR=value%u", i);
+  g_string_append_c (input, '\0');
+}
+
+static void
+append_env_unset_env (GString *input,
+                      guint i)
+{
+  g_string_append_printf (input, "--env=VAR%u=value", i % 100);
+  g_string_append_c (input, '\0');
+  g_string_append_printf (input, "--unset-env=VAR%u", i % 100);
+  g_string_append_c (input, '\0');
+}
+
+static void
+append_sandbox_flag (GString *input,
+                     G_GNUC_UNUSED guint i)
+{
+  g_string_append (input, "--sandbox-flag=share-gpu");
+  g_string_append_c (input, '\0');
+}
+
+static void
+append_env_block (GString *input,
+                  guint i)
+{
+  g_string_append_printf (input, "VAR%u=value", i);
+  g_string_append_c (input, '\0');
+}
+
+static void
+append_address (GString *input,
+                guint i)
+{
+  g_string_append_printf (input, "user%u@example.com,", i);
+}
+
+static void
+append_to_header (GString *input,
+                  guint i)
+{
+  g_string_append_printf (input, "to=user%u%%40example.com&", i);
+}
+
+static void
+append_subject_header (GString *input,
+                       guint i)
+{
+  g_string_append_printf (input, "subject=Subject%%20%u&", i);
+}
+
+static const Config env_config =
+{
+  .target = "fuzz-spawn-argv",
+  .append = append_env,
+  .suffix = "true",
+  .parse = parse_spawn_argv,
+  .items_per_repetition = 1,
+};
+
+static const Config env_same_config =
+{
+  .target = "fuzz-spawn-argv",
+  .append = append_env_same,
+  .suffix = "true",
+  .parse = parse_spawn_argv,
+};
+
+static const Config env_unset_env_config =
+{
+  .target = "fuzz-spawn-argv",
+  .append = append_env_unset_env,
+  .suffix = "true",
+  .parse = parse_spawn_argv,
+};
+
+static const Config sandbox_flag_config =
+{
+  .target = "fuzz-spawn-argv",
+  .append = append_sandbox_flag,
+  .suffix = "true",
+  .parse = parse_spawn_argv,
+};
+
+static const Config env_block_config =
+{
+  .target = "fuzz-spawn-env-fd",
+  .append = append_env_block,
+  .parse = parse_env_block,
+  .items_per_repetition = 1,
+};
+
+static const Config addresses_config =
+{
+  .target = "fuzz-mailto",
+  .prefix = "mailto:",
+  .append = append_address,
+  .parse = parse_mailto,
+  .items_per_repetition = 1,
+};
+
+static const Config to_header_config =
+{
+  .target = "fuzz-mailto",
+  .prefix = "mailto:?",
+  .append = append_to_header,
+  .parse = parse_mailto,
+  .items_per_repetition = 1,
+};
+
+static const Config subject_header_config =
+{
+  .target = "fuzz-mailto",
+  .prefix = "mailto:?",
+  .append = append_subject_header,
+  .parse = parse_mailto,
+};
+
+static GString *
+generate (const Config *config,
+          guint n)
+{
+  GString *input = g_string_new (config->prefix);
+  guint i;
+
+  for (i = 0; i < n; i++)
+    config->append (input, i);
+
+  if (config->suffix != NULL)
+    {
+      g_string_append (input, config->suffix);
+      g_string_append_c (input, '\0');
+    }
+
+  return input;
+}
+
+/* Returns the shortest of several runs, in seconds */
+static double
+time_parse (const Config *config,
+            const GString *input,
+            guint n)
+{
+  double best = G_MAXDOUBLE;
+  guint run;
+
+  for (run = 0; run < RUNS; run++)
+    {
+      guint items;
+
+      g_test_timer_start ();
+      items = config->parse (input);
+      best = MIN (best, g_test_timer_elapsed ());
+
+      if (config->items_per_repetition > 0)
+        g_assert_cmpuint (items, ==, n * config->items_per_repetition);
+      else
+        g_assert_cmpuint (items, >, 0);
+    }
+
+  return best;
+}
+
+static void
+write_corpus (const char *name,
+              const Config *config,
+              const GString *input)
+{
+  const char *dir = g_getenv ("PARSER_CORPUS_DIR");
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *target_dir = NULL;
+  g_autofree gchar *path = NULL;
+
+  if (dir == NULL)
+    return;
+
+  target_dir = g_build_filename (dir, config->target, NULL);
+  g_assert_cmpint (g_mkdir_with_parents (target_dir, 0755), ==, 0);
+
+  /* Test paths start with '/' */
+  path = g_build_filename (target_dir, name + 1, NULL);
+  g_strdelimit (path + strlen (target_dir) + 1, "/", '-');
+  g_file_set_contents (path, input->str, input->len, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_scaling (gconstpointer context)
+{
+  const Config *config = context;
+  const char *name = g_test_get_path ();
+  g_autoptr(GString) small = generate (config, SMALL);
+  g_autoptr(GString) large = generate (config, LARGE);
+  double small_time;
+  double large_time;
+
+  small_time = time_parse (config, small, SMALL);
+  large_time = time_parse (config, large, LARGE);
+
+  g_test_message ("%u repetitions: %.1f ms", SMALL, small_time * 1000);
+  g_test_message ("%u repetitions: %.1f ms", LARGE, large_time * 1000);
+  g_test_minimized_result (large_time, "%s: %.0f repetitions per second",
+                           name, LARGE / MAX (large_time, 1e-9));
+
+  /* Too quick to measure at all is fine */
+  if (g_test_perf () && large_time > 0.001)
+    g_assert_cmpfloat (large_time / MAX (small_time, 1e-6), <, MAX_RATIO);
+
+  write_corpus (name, config, large);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_data_func ("/spawn-argv/env", &env_config, test_scaling);
+  g_test_add_data_func ("/spawn-argv/env-same", &env_same_config, test_scaling);
+  g_test_add_data_func ("/spawn-argv/env-unset-env", &env_unset_env_config, test_scaling);
+  g_test_add_data_func ("/spawn-argv/sandbox-flag", &sandbox_flag_config, test_scaling);
+  g_test_add_data_func ("/spawn-env-fd/env", &env_block_config, test_scaling);
+  g_test_add_data_func ("/mailto/addresses", &addresses_config, test_scaling);
+  g_test_add_data_func ("/mailto/to-header", &to_header_config, test_scaling);
+  g_test_add_data_func ("/mailto/subject-header", &subject_header_config, test_scaling);
+
+  return g_test_run ();
+}
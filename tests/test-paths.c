@@ -0,0 +1,286 @@
+/*
+ * Copyright © 2018 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "backport-autoptr.h"
+#include "flatpak-spawn-paths.h"
+
+#define APP_PATH "/var/lib/flatpak/app/org.example.App/x86_64/master/abc/files"
+#define RUNTIME_PATH "/var/lib/flatpak/runtime/org.example.Platform/x86_64/1/def/files"
+
+/* The host has the filesystem with /var/lib/flatpak mounted on /var */
+static const char flatpak_info[] =
+  "[Application]\n"
+  "name=org.example.App\n"
+  "\n"
+  "[Instance]\n"
+  "app-path=" APP_PATH "\n"
+  "runtime-path=" RUNTIME_PATH "\n";
+
+static const char mountinfo[] =
+  "1 0 0:30 / / rw,nosuid - tmpfs tmpfs rw\n"
+  "2 1 253:1 /lib/flatpak/app/org.example.App/x86_64/master/abc/files /app ro,nosuid master:1 - ext4 /dev/vda1 rw\n"
+  "3 1 253:1 /lib/flatpak/runtime/org.example.Platform/x86_64/1/def/files /usr ro - ext4 /dev/vda1 rw\n"
+  "4 1 253:1 /lib/flatpak/exports/share /run/host/share ro - ext4 /dev/vda1 rw\n"
+  "5 1 0:50 /by-app/org.example.App /run/user/1000/doc rw - fuse.portal portal rw\n"
+  "6 1 0:31 / /tmp rw - tmpfs tmpfs rw\n"
+  "7 1 0:32 /alice/My\\040Files /home/alice/My\\040Files rw - ext4 /dev/vda2 rw\n"
+  "8 2 0:33 / /app/private rw - tmpfs tmpfs rw\n";
+
+typedef struct
+{
+  gchar *dir;
+  gchar *flatpak_info_path;
+  gchar *mountinfo_path;
+  gchar *cache_path;
+} Fixture;
+
+static void
+setup (Fixture *f,
+       gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+
+  f->dir = g_dir_make_tmp ("test-paths-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  f->flatpak_info_path = g_build_filename (f->dir, "flatpak-info", NULL);
+  f->mountinfo_path = g_build_filename (f->dir, "mountinfo", NULL);
+  f->cache_path = g_build_filename (f->dir, "cache", NULL);
+
+  g_file_set_contents (f->flatpak_info_path, flatpak_info, -1, &error);
+  g_assert_no_error (error);
+  g_file_set_contents (f->mountinfo_path, mountinfo, -1, &error);
+  g_assert_no_error (error);
+}
+
+static void
+assert_translates (FlatpakSpawnPathMap *map,
+                   const char          *path,
+                   const char          *expected)
+{
+  g_autofree char *host = flatpak_spawn_path_map_translate (map, path);
+
+  g_test_message ("%s -> %s", path, host);
+  g_assert_cmpstr (host, ==, expected);
+}
+
+static void
+test_translate (Fixture *f,
+                gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FlatpakSpawnPathMap) map = NULL;
+
+  map = flatpak_spawn_path_map_load (NULL, f->flatpak_info_path,
+                                     f->mountinfo_path, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (map);
+
+  assert_translates (map, "/app", APP_PATH);
+  assert_translates (map, "/app/", APP_PATH "/");
+  assert_translates (map, "/app/bin/tool", APP_PATH "/bin/tool");
+  assert_translates (map, "/usr/lib/libfoo.so", RUNTIME_PATH "/lib/libfoo.so");
+  assert_translates (map, "/run/host/share/icons",
+                     "/var/lib/flatpak/exports/share/icons");
+  assert_translates (map, "/run/user/1000/doc/1234/file.txt",
+                     "/run/user/1000/doc/by-app/org.example.App/1234/file.txt");
+
+  /* Mounts that we cannot place on the host are left alone, even
+   * below a translated mount */
+  assert_translates (map, "/app/private/scratch", "/app/private/scratch");
+  assert_translates (map, "/tmp/x", "/tmp/x");
+  assert_translates (map, "/home/alice/My Files/a", "/home/alice/My Files/a");
+
+  /* Only whole components match */
+  assert_translates (map, "/applications", "/applications");
+  assert_translates (map, "/", "/");
+  assert_translates (map, "relative/app", "relative/app");
+}
+
+static void
+test_translate_args (Fixture *f,
+                     gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FlatpakSpawnPathMap) map = NULL;
+  g_autoptr(GPtrArray) allocated = g_ptr_array_new_with_free_func (g_free);
+  char *argv[] = {
+    "/usr/bin/make", "-C", "/app/src", "relative/app", "/usr/lib/libfoo.so", NULL
+  };
+
+  map = flatpak_spawn_path_map_load (NULL, f->flatpak_info_path,
+                                     f->mountinfo_path, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (map);
+
+  flatpak_spawn_path_map_translate_args (map, argv, allocated);
+
+  /* The command is the host's, not the runtime's */
+  g_assert_cmpstr (argv[0], ==, "/usr/bin/make");
+  g_assert_cmpstr (argv[1], ==, "-C");
+  g_assert_cmpstr (argv[2], ==, APP_PATH "/src");
+  g_assert_cmpstr (argv[3], ==, "relative/app");
+  g_assert_cmpstr (argv[4], ==, RUNTIME_PATH "/lib/libfoo.so");
+  g_assert_null (argv[5]);
+}
+
+static void
+test_no_flatpak_info (Fixture *f,
+                      gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FlatpakSpawnPathMap) map = NULL;
+
+  g_assert_cmpint (g_unlink (f->flatpak_info_path), ==, 0);
+
+  map = flatpak_spawn_path_map_load (NULL, f->flatpak_info_path,
+                                     f->mountinfo_path, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (map);
+
+  assert_translates (map, "/app/bin/tool", "/app/bin/tool");
+  assert_translates (map, "/run/host/share/icons", "/run/host/share/icons");
+  assert_translates (map, "/run/user/1000/doc/1234/file.txt",
+                     "/run/user/1000/doc/by-app/org.example.App/1234/file.txt");
+}
+
+static void
+test_no_mountinfo (Fixture *f,
+                   gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FlatpakSpawnPathMap) map = NULL;
+
+  g_assert_cmpint (g_unlink (f->mountinfo_path), ==, 0);
+
+  map = flatpak_spawn_path_map_load (f->cache_path, f->flatpak_info_path,
+                                     f->mountinfo_path, &error);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+  g_assert_null (map);
+  g_assert_false (g_file_test (f->cache_path, G_FILE_TEST_EXISTS));
+}
+
+static void
+test_cache (Fixture *f,
+            gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FlatpakSpawnPathMap) map = NULL;
+
+  map = flatpak_spawn_path_map_load (f->cache_path, f->flatpak_info_path,
+                                     f->mountinfo_path, &error);
+  g_assert_no_error (error);
+  g_assert_true (g_file_test (f->cache_path, G_FILE_TEST_IS_REGULAR));
+  g_clear_pointer (&map, flatpak_spawn_path_map_free);
+
+  /* The mount table is not read again while the cache is valid */
+  g_assert_cmpint (g_unlink (f->mountinfo_path), ==, 0);
+  map = flatpak_spawn_path_map_load (f->cache_path, f->flatpak_info_path,
+                                     f->mountinfo_path, &error);
+  g_assert_no_error (error);
+  assert_translates (map, "/app/bin/tool", APP_PATH "/bin/tool");
+  assert_translates (map, "/tmp/x", "/tmp/x");
+  g_clear_pointer (&map, flatpak_spawn_path_map_free);
+
+  /* A new /.flatpak-info makes it stale */
+  g_file_set_contents (f->mountinfo_path, mountinfo, -1, &error);
+  g_assert_no_error (error);
+  g_file_set_contents (f->flatpak_info_path,
+                       "[Instance]\napp-path=/elsewhere/files\n", -1, &error);
+  g_assert_no_error (error);
+  map = flatpak_spawn_path_map_load (f->cache_path, f->flatpak_info_path,
+                                     f->mountinfo_path, &error);
+  g_assert_no_error (error);
+  assert_translates (map, "/app/bin/tool", "/elsewhere/files/bin/tool");
+  assert_translates (map, "/usr/lib", "/usr/lib");
+}
+
+static void
+test_corrupt_cache (Fixture *f,
+                    gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FlatpakSpawnPathMap) map = NULL;
+  g_autofree gchar *contents = NULL;
+  gsize len;
+  gsize i;
+
+  map = flatpak_spawn_path_map_load (f->cache_path, f->flatpak_info_path,
+                                     f->mountinfo_path, &error);
+  g_assert_no_error (error);
+  g_clear_pointer (&map, flatpak_spawn_path_map_free);
+
+  g_file_get_contents (f->cache_path, &contents, &len, &error);
+  g_assert_no_error (error);
+
+  /* Truncated, or with wild offsets: the cache must either be rebuilt
+   * or be safe to use. A flipped byte in a string can still be valid. */
+  for (i = 0; i < len; i += 7)
+    {
+      g_autofree gchar *broken = g_malloc (len);
+      g_autofree gchar *host = NULL;
+
+      memcpy (broken, contents, len);
+      broken[i] ^= 0xff;
+      g_file_set_contents (f->cache_path, broken, (i % 2) ? len : i, &error);
+      g_assert_no_error (error);
+
+      map = flatpak_spawn_path_map_load (f->cache_path, f->flatpak_info_path,
+                                         f->mountinfo_path, &error);
+      g_assert_no_error (error);
+      g_assert_nonnull (map);
+      host = flatpak_spawn_path_map_translate (map, "/app/bin/tool");
+      g_assert_nonnull (host);
+      g_clear_pointer (&map, flatpak_spawn_path_map_free);
+    }
+}
+
+static void
+teardown (Fixture *f,
+          gconstpointer context G_GNUC_UNUSED)
+{
+  g_unlink (f->cache_path);
+  g_unlink (f->mountinfo_path);
+  g_unlink (f->flatpak_info_path);
+  g_rmdir (f->dir);
+
+  g_free (f->cache_path);
+  g_free (f->mountinfo_path);
+  g_free (f->flatpak_info_path);
+  g_free (f->dir);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/translate", Fixture, NULL, setup, test_translate, teardown);
+  g_test_add ("/translate-args", Fixture, NULL, setup, test_translate_args, teardown);
+  g_test_add ("/no-flatpak-info", Fixture, NULL, setup, test_no_flatpak_info, teardown);
+  g_test_add ("/no-mountinfo", Fixture, NULL, setup, test_no_mountinfo, teardown);
+  g_test_add ("/cache", Fixture, NULL, setup, test_cache, teardown);
+  g_test_add ("/corrupt-cache", Fixture, NULL, setup, test_corrupt_cache, teardown);
+
+  return g_test_run ();
+}
@@ -18,6 +18,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <string.h>
 #include <sys/stat.h>
 
@@ -79,11 +80,14 @@ typedef struct
   int fails_immediately;
   int fails_after_version_check;
   gboolean awkward_command_name;
+  gboolean awkward_unset_name;
   gboolean dbus_call_fails;
   gboolean extra;
   gboolean host;
   gboolean no_command;
   gboolean no_session_bus;
+  gboolean portal_hangs;
+  gboolean probe_hangs;
   gboolean sandbox_complex;
 } Config;
 
@@ -106,6 +110,17 @@ typedef struct
 
 static const Config default_config = {};
 
+/* The variable that the "extra" options unset */
+static const char *
+unset_env_name (const Config *config)
+{
+  /* Not a name that the shell could unset */
+  if (config->awkward_unset_name)
+    return "NO.PE";
+
+  return "NOPE";
+}
+
 static void
 mock_method_call (GDBusConnection *conn G_GNUC_UNUSED,
                   const gchar *sender G_GNUC_UNUSED,
@@ -126,6 +141,10 @@ mock_method_call (GDBusConnection *conn G_GNUC_UNUSED,
 
   g_queue_push_tail (&f->invocations, g_object_ref (invocation));
 
+  /* Only with hanging_probe_vtable: never answer Get */
+  if (strcmp (interface_name, "org.freedesktop.DBus.Properties") == 0)
+    return;
+
   if (f->config->dbus_call_fails)
     {
       g_dbus_method_invocation_return_dbus_error (invocation,
@@ -134,6 +153,11 @@ mock_method_call (GDBusConnection *conn G_GNUC_UNUSED,
       return;
     }
 
+  if (f->config->portal_hangs &&
+      (strcmp (method_name, "HostCommand") == 0 ||
+       strcmp (method_name, "Spawn") == 0))
+    return;
+
   if (strcmp (method_name, "HostCommand") == 0 ||
       strcmp (method_name, "Spawn") == 0)
     g_dbus_method_invocation_return_value (invocation,
@@ -405,6 +429,14 @@ static const GDBusInterfaceVTable vtable =
   NULL  /* set */
 };
 
+/* Without a get_property, GDBus passes Get to mock_method_call */
+static const GDBusInterfaceVTable hanging_probe_vtable =
+{
+  mock_method_call,
+  NULL, /* get */
+  NULL  /* set */
+};
+
 static void
 setup (Fixture *f,
        gconstpointer context)
@@ -446,7 +478,7 @@ setup (Fixture *f,
   f->mock_development_object = g_dbus_connection_register_object (f->mock_development_conn,
                                                                   FLATPAK_SESSION_HELPER_PATH_DEVELOPMENT,
                                                                   &development_iface_info,
-                                                                  &vtable,
+                                                                  f->config->probe_hangs ? &hanging_probe_vtable : &vtable,
                                                                   f,
                                                                   NULL,
                                                                   &error);
@@ -456,7 +488,7 @@ setup (Fixture *f,
   f->mock_portal_object = g_dbus_connection_register_object (f->mock_portal_conn,
                                                              FLATPAK_PORTAL_PATH,
                                                              &portal_iface_info,
-                                                             &vtable,
+                                                             f->config->probe_hangs ? &hanging_probe_vtable : &vtable,
                                                              f,
                                                              NULL,
                                                              &error);
@@ -637,7 +669,7 @@ test_command (Fixture *f,
       g_ptr_array_add (command, g_strdup ("--forward-fd=2"));
       g_subprocess_launcher_take_fd (launcher, open ("/dev/null", O_RDWR|O_CLOEXEC), 4);
       g_ptr_array_add (command, g_strdup ("--forward-fd=4"));
-      g_ptr_array_add (command, g_strdup ("--unset-env=NOPE"));
+      g_ptr_array_add (command, g_strdup_printf ("--unset-env=%s", unset_env_name (config)));
       g_ptr_array_add (command, g_strdup ("--verbose"));
     }
 
@@ -754,17 +786,37 @@ test_command (Fixture *f,
 
   if (config->extra && config->host)
     {
-      g_assert_cmpstr (argv[i++], ==, "/usr/bin/env");
-      g_assert_cmpstr (argv[i++], ==, "-u");
-      g_assert_cmpstr (argv[i++], ==, "NOPE");
-
-      if (config->awkward_command_name)
+      /* A single trampoline, whichever way it has to be done */
+      if (config->awkward_command_name && config->awkward_unset_name)
         {
+          g_assert_cmpstr (argv[i++], ==, "/usr/bin/env");
+          g_assert_cmpstr (argv[i++], ==, "-u");
+          g_assert_cmpstr (argv[i++], ==, "NO.PE");
           g_assert_cmpstr (argv[i++], ==, "/bin/sh");
           g_assert_cmpstr (argv[i++], ==, "-euc");
           g_assert_cmpstr (argv[i++], ==, "exec \"$@\"");
           g_assert_cmpstr (argv[i++], ==, "sh");  /* sh's argv[0] */
         }
+      else if (config->awkward_command_name)
+        {
+          g_assert_cmpstr (argv[i++], ==, "/bin/sh");
+          g_assert_cmpstr (argv[i++], ==, "-c");
+          /* The script itself is part of the contract: it must stop
+           * at the first "--" and exec the rest unchanged */
+          g_assert_cmpstr (argv[i++], ==,
+                           "for v do shift; [ \"$v\" = -- ] && break; "
+                           "unset -v \"$v\"; done; exec \"$@\"");
+          g_assert_cmpstr (argv[i++], ==, "sh");  /* sh's argv[0] */
+          g_assert_cmpstr (argv[i++], ==, "NOPE");
+          g_assert_cmpstr (argv[i++], ==, "--");
+        }
+      else
+        {
+          g_assert_cmpstr (argv[i++], ==, "/usr/bin/env");
+          g_assert_cmpstr (argv[i++], ==, "-u");
+          g_assert_cmpstr (argv[i++], ==, "NOPE");
+          g_assert_cmpstr (argv[i++], ==, "--");
+        }
     }
 
   if (config->awkward_command_name)
@@ -860,7 +912,7 @@ test_command (Fixture *f,
           g_assert_true (g_variant_lookup (options_variant, "unset-env", "^a&s", &unset));
           g_assert_nonnull (unset);
           i = 0;
-          g_assert_cmpstr (unset[i++], ==, "NOPE");
+          g_assert_cmpstr (unset[i++], ==, unset_env_name (config));
           g_assert_cmpstr (unset[i++], ==, NULL);
           options_handled++;
         }
@@ -993,6 +1045,283 @@ test_command (Fixture *f,
                            g_test_timer_elapsed ());
 }
 
+/* Lets the command exit with @wait_status each time it is started, and
+ * checks that flatpak-spawn starts it @n_spawns times in all */
+static void
+check_restarts (Fixture    *f,
+                const char *restart_arg,
+                guint32     wait_status,
+                guint       n_spawns,
+                int         expected_exit_status)
+{
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autoptr(GError) error = NULL;
+  guint i;
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_set_cwd (launcher, "/");
+  g_subprocess_launcher_setenv (launcher,
+                                "DBUS_SESSION_BUS_ADDRESS",
+                                f->dbus_address,
+                                TRUE);
+
+  f->flatpak_spawn = g_subprocess_launcher_spawn (launcher, &error,
+                                                  f->flatpak_spawn_path,
+                                                  restart_arg,
+                                                  "--restart-limit=2",
+                                                  "some-command",
+                                                  NULL);
+  g_assert_no_error (error);
+  g_assert_nonnull (f->flatpak_spawn);
+
+  for (i = 0; i < n_spawns; i++)
+    {
+      g_autoptr(GDBusMethodInvocation) invocation = NULL;
+
+      while (g_queue_get_length (&f->invocations) < 1)
+        g_main_context_iteration (NULL, TRUE);
+
+      invocation = g_queue_pop_head (&f->invocations);
+      g_assert_cmpstr (g_dbus_method_invocation_get_method_name (invocation),
+                       ==, "Spawn");
+
+      g_dbus_connection_emit_signal (f->mock_portal_conn,
+                                     NULL,
+                                     FLATPAK_PORTAL_PATH,
+                                     FLATPAK_PORTAL_INTERFACE,
+                                     "SpawnExited",
+                                     g_variant_new ("(uu)", 12345, wait_status),
+                                     &error);
+      g_assert_no_error (error);
+    }
+
+  g_subprocess_wait_check (f->flatpak_spawn, NULL, &error);
+
+  if (expected_exit_status == 0)
+    {
+      g_assert_no_error (error);
+    }
+  else
+    {
+      g_assert_error (error, G_SPAWN_EXIT_ERROR, expected_exit_status);
+      g_clear_error (&error);
+    }
+
+  /* Only the calls we expected, and no more */
+  while (g_main_context_iteration (NULL, FALSE))
+    continue;
+
+  g_assert_cmpuint (g_queue_get_length (&f->invocations), ==, 0);
+}
+
+static void
+test_restart (Fixture *f,
+              gconstpointer context G_GNUC_UNUSED)
+{
+  g_test_timer_start ();
+
+  /* Restarted twice, then the budget is used up */
+  check_restarts (f, "--restart=on-failure", 23 << 8, 3, 23);
+
+  g_test_minimized_result (g_test_timer_elapsed (),
+                           "time for two restarts: %.1f",
+                           g_test_timer_elapsed ());
+}
+
+static void
+test_restart_success (Fixture *f,
+                      gconstpointer context G_GNUC_UNUSED)
+{
+  /* Success is not a failure */
+  check_restarts (f, "--restart=on-failure", 0, 1, 0);
+}
+
+static void
+test_restart_always (Fixture *f,
+                     gconstpointer context G_GNUC_UNUSED)
+{
+  check_restarts (f, "--restart=always", 0, 3, 0);
+}
+
+/* A signal that arrives between restarts has no command to be forwarded
+ * to, so it acts on flatpak-spawn itself */
+static void
+test_restart_signal_during_backoff (Fixture *f,
+                                    gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autoptr(GDBusMethodInvocation) invocation = NULL;
+  g_autoptr(GDataInputStream) stderr_lines = NULL;
+  g_autoptr(GError) error = NULL;
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDERR_PIPE);
+  g_subprocess_launcher_set_cwd (launcher, "/");
+  g_subprocess_launcher_setenv (launcher,
+                                "DBUS_SESSION_BUS_ADDRESS",
+                                f->dbus_address,
+                                TRUE);
+  /* Long enough that the signal certainly arrives first, however
+   * slow this machine is; it ends the wait anyway */
+  g_subprocess_launcher_setenv (launcher,
+                                "FLATPAK_SPAWN_RESTART_DELAY_MS",
+                                "30000",
+                                TRUE);
+
+  f->flatpak_spawn = g_subprocess_launcher_spawn (launcher, &error,
+                                                  f->flatpak_spawn_path,
+                                                  "--restart=on-failure",
+                                                  "--verbose",
+                                                  "some-command",
+                                                  NULL);
+  g_assert_no_error (error);
+  g_assert_nonnull (f->flatpak_spawn);
+
+  while (g_queue_get_length (&f->invocations) < 1)
+    g_main_context_iteration (NULL, TRUE);
+
+  invocation = g_queue_pop_head (&f->invocations);
+  g_assert_cmpstr (g_dbus_method_invocation_get_method_name (invocation),
+                   ==, "Spawn");
+
+  g_dbus_connection_emit_signal (f->mock_portal_conn,
+                                 NULL,
+                                 FLATPAK_PORTAL_PATH,
+                                 FLATPAK_PORTAL_INTERFACE,
+                                 "SpawnExited",
+                                 g_variant_new ("(uu)", 12345, 23 << 8),
+                                 &error);
+  g_assert_no_error (error);
+
+  /* Wait for the backoff to start */
+  stderr_lines = g_data_input_stream_new (g_subprocess_get_stderr_pipe (f->flatpak_spawn));
+
+  while (TRUE)
+    {
+      g_autofree char *line = g_data_input_stream_read_line_utf8 (stderr_lines,
+                                                                  NULL, NULL,
+                                                                  &error);
+
+      g_assert_no_error (error);
+      g_assert_nonnull (line);
+      g_test_message ("%s", line);
+
+      if (g_str_has_prefix (line, "F: Restarting command in "))
+        break;
+    }
+
+  g_subprocess_send_signal (f->flatpak_spawn, SIGTERM);
+  g_subprocess_wait (f->flatpak_spawn, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_true (g_subprocess_get_if_signaled (f->flatpak_spawn));
+  g_assert_cmpint (g_subprocess_get_term_sig (f->flatpak_spawn), ==, SIGTERM);
+
+  /* Not restarted, and there was nothing to forward the signal to */
+  while (g_main_context_iteration (NULL, FALSE))
+    continue;
+
+  g_assert_cmpuint (g_queue_get_length (&f->invocations), ==, 0);
+}
+
+static void
+test_deadline (Fixture *f,
+               gconstpointer context)
+{
+  const Config *config = context;
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autoptr(GPtrArray) command = g_ptr_array_new ();
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *stderr_buf = NULL;
+
+  g_test_timer_start ();
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDERR_PIPE);
+  g_subprocess_launcher_set_cwd (launcher, "/");
+  g_subprocess_launcher_setenv (launcher,
+                                "DBUS_SESSION_BUS_ADDRESS",
+                                f->dbus_address,
+                                TRUE);
+
+  g_ptr_array_add (command, f->flatpak_spawn_path);
+  g_ptr_array_add (command, "--deadline=0.5");
+  g_ptr_array_add (command, config->host ? "--host" : "--clear-env");
+
+  /* An option that needs the service's version */
+  if (config->extra_arg != NULL)
+    g_ptr_array_add (command, (gpointer) config->extra_arg);
+
+  g_ptr_array_add (command, "some-command");
+  g_ptr_array_add (command, NULL);
+
+  f->flatpak_spawn = g_subprocess_launcher_spawnv (launcher,
+                                                   (const gchar * const *) command->pdata,
+                                                   &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (f->flatpak_spawn);
+
+  while (g_queue_get_length (&f->invocations) < 1)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_subprocess_communicate_utf8 (f->flatpak_spawn, NULL, NULL, NULL,
+                                 &stderr_buf, &error);
+  g_assert_no_error (error);
+  g_test_message ("%s", stderr_buf);
+
+  g_assert_true (g_subprocess_get_if_exited (f->flatpak_spawn));
+  g_assert_cmpint (g_subprocess_get_exit_status (f->flatpak_spawn), ==, 124);
+
+  /* A version that never arrived is not an old version */
+  g_assert_nonnull (strstr (stderr_buf, "Timed out waiting for the command to start"));
+  g_assert_null (strstr (stderr_buf, "newer version"));
+
+  /* Well before the 25 second D-Bus default */
+  g_assert_cmpfloat (g_test_timer_elapsed (), <=, 20);
+  g_test_minimized_result (g_test_timer_elapsed (),
+                           "time to time out: %.1f",
+                           g_test_timer_elapsed ());
+}
+
+/* With --deadline, the session bus connection is made differently;
+ * losing it must still end flatpak-spawn as it does without */
+static void
+test_deadline_bus_closed (Fixture *f,
+                          gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autoptr(GError) error = NULL;
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_set_cwd (launcher, "/");
+  g_subprocess_launcher_setenv (launcher,
+                                "DBUS_SESSION_BUS_ADDRESS",
+                                f->dbus_address,
+                                TRUE);
+  /* The built-in D-Bus client does not use GDBus at all */
+  g_subprocess_launcher_setenv (launcher, "FLATPAK_SPAWN_WIRE", "0", TRUE);
+
+  f->flatpak_spawn = g_subprocess_launcher_spawn (launcher, &error,
+                                                  f->flatpak_spawn_path,
+                                                  "--deadline=20",
+                                                  "some-command",
+                                                  NULL);
+  g_assert_no_error (error);
+  g_assert_nonnull (f->flatpak_spawn);
+
+  while (g_queue_get_length (&f->invocations) < 1)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* The command has started; now the bus goes away */
+  g_subprocess_send_signal (f->dbus_daemon, SIGTERM);
+  g_subprocess_wait (f->dbus_daemon, NULL, &error);
+  g_assert_no_error (error);
+  g_clear_object (&f->dbus_daemon);
+
+  g_subprocess_wait (f->flatpak_spawn, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (g_subprocess_get_if_exited (f->flatpak_spawn));
+  g_assert_cmpint (g_subprocess_get_exit_status (f->flatpak_spawn), ==, 0);
+}
+
 static void
 teardown (Fixture *f,
           gconstpointer context G_GNUC_UNUSED)
@@ -1127,6 +1456,43 @@ static const Config host_complex2 =
   .host_flags = FLATPAK_HOST_COMMAND_FLAGS_WATCH_BUS,
 };
 
+static const Config host_complex3 =
+{
+  .awkward_command_name = TRUE,
+  .awkward_unset_name = TRUE,
+  .extra = TRUE,
+  .host = TRUE,
+};
+
+static const Config host_deadline =
+{
+  .host = TRUE,
+  .portal_hangs = TRUE,
+};
+
+static const Config subsandbox_deadline =
+{
+  .portal_hangs = TRUE,
+};
+
+static const Config subsandbox_deadline_probe =
+{
+  .extra_arg = "--share-pids",
+  .probe_hangs = TRUE,
+};
+
+static const Config fail_invalid_deadline =
+{
+  .fails_immediately = 1,
+  .extra_arg = "--deadline=soon",
+};
+
+static const Config fail_invalid_restart =
+{
+  .fails_immediately = 1,
+  .extra_arg = "--restart=sometimes",
+};
+
 static const Config fail_invalid_env =
 {
   .fails_immediately = 1,
@@ -1151,8 +1517,6 @@ static const Config fail_invalid_fd2 =
   .extra_arg = "--forward-fd=yesplease",
 };
 
-/* TODO: These should fail, but succeed */
-#if 0
 static const Config fail_invalid_fd3 =
 {
   .fails_immediately = 1,
@@ -1164,7 +1528,6 @@ static const Config fail_invalid_fd4 =
   .fails_immediately = 1,
   .extra_arg = "--forward-fd=-1",
 };
-#endif
 
 static const Config fail_invalid_sandbox_flag =
 {
@@ -1238,6 +1601,7 @@ main (int argc,
   g_test_add ("/host/simple", Fixture, &host_simple, setup, test_command, teardown);
   g_test_add ("/host/complex1", Fixture, &host_complex1, setup, test_command, teardown);
   g_test_add ("/host/complex2", Fixture, &host_complex2, setup, test_command, teardown);
+  g_test_add ("/host/complex3", Fixture, &host_complex3, setup, test_command, teardown);
   g_test_add ("/host/fails", Fixture, &host_fails, setup, test_command, teardown);
 
   g_test_add ("/subsandbox/simple", Fixture, &default_config, setup, test_command, teardown);
@@ -1253,10 +1617,24 @@ main (int argc,
   g_test_add ("/subsandbox/share-pids", Fixture, &subsandbox_share_pids, setup, test_command, teardown);
   g_test_add ("/subsandbox/watch-bus", Fixture, &subsandbox_watch_bus, setup, test_command, teardown);
 
+  g_test_add ("/deadline/host", Fixture, &host_deadline, setup, test_deadline, teardown);
+  g_test_add ("/deadline/subsandbox", Fixture, &subsandbox_deadline, setup, test_deadline, teardown);
+  g_test_add ("/deadline/subsandbox/probe", Fixture, &subsandbox_deadline_probe, setup, test_deadline, teardown);
+  g_test_add ("/deadline/bus-closed", Fixture, NULL, setup, test_deadline_bus_closed, teardown);
+
+  g_test_add ("/restart/on-failure", Fixture, NULL, setup, test_restart, teardown);
+  g_test_add ("/restart/on-failure/success", Fixture, NULL, setup, test_restart_success, teardown);
+  g_test_add ("/restart/always", Fixture, NULL, setup, test_restart_always, teardown);
+  g_test_add ("/restart/signal-during-backoff", Fixture, NULL, setup, test_restart_signal_during_backoff, teardown);
+
   g_test_add ("/fail/invalid-env", Fixture, &fail_invalid_env, setup, test_command, teardown);
   g_test_add ("/fail/invalid-env2", Fixture, &fail_invalid_env2, setup, test_command, teardown);
+  g_test_add ("/fail/invalid-deadline", Fixture, &fail_invalid_deadline, setup, test_command, teardown);
+  g_test_add ("/fail/invalid-restart", Fixture, &fail_invalid_restart, setup, test_command, teardown);
   g_test_add ("/fail/invalid-fd", Fixture, &fail_invalid_fd, setup, test_command, teardown);
   g_test_add ("/fail/invalid-fd2", Fixture, &fail_invalid_fd2, setup, test_command, teardown);
+  g_test_add ("/fail/invalid-fd3", Fixture, &fail_invalid_fd3, setup, test_command, teardown);
+  g_test_add ("/fail/invalid-fd4", Fixture, &fail_invalid_fd4, setup, test_command, teardown);
   g_test_add ("/fail/invalid-sandbox-flag", Fixture, &fail_invalid_sandbox_flag, setup, test_command, teardown);
   g_test_add ("/fail/invalid-sandbox-flag2", Fixture, &fail_invalid_sandbox_flag2, setup, test_command, teardown);
   g_test_add ("/fail/no-command", Fixture, &fail_no_command, setup, test_command, teardown);